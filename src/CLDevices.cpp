@@ -0,0 +1,88 @@
+#include "CLDevices.h"
+
+#include <algorithm>
+
+std::string CLDeviceDescription::Label() const {
+  std::string kind = "Other";
+  if (type & CL_DEVICE_TYPE_GPU) {
+    kind = "GPU";
+  } else if (type & CL_DEVICE_TYPE_CPU) {
+    kind = "CPU";
+  } else if (type & CL_DEVICE_TYPE_ACCELERATOR) {
+    kind = "Accelerator";
+  }
+  return kind + ": " + device_name + " (" + platform_name + ")";
+}
+
+std::vector<CLDeviceDescription> ListCLDevices() {
+  std::vector<CLDeviceDescription> result;
+  std::vector<cl::Platform> platforms;
+  try {
+    cl::Platform::get(&platforms);
+  } catch (cl::Error error) {
+    // The ICD loader reports a missing platform as an error.
+    return result;
+  }
+  for (size_t p = 0; p < platforms.size(); p++) {
+    std::vector<cl::Device> devices;
+    try {
+      platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    } catch (cl::Error error) {
+      continue;
+    }
+    for (size_t d = 0; d < devices.size(); d++) {
+      const std::string extensions = devices[d].getInfo<CL_DEVICE_EXTENSIONS>();
+      CLDeviceDescription description;
+      description.platform = static_cast<int>(p);
+      description.device = static_cast<int>(d);
+      description.platform_name = platforms[p].getInfo<CL_PLATFORM_NAME>();
+      description.device_name = devices[d].getInfo<CL_DEVICE_NAME>();
+      description.type = devices[d].getInfo<CL_DEVICE_TYPE>();
+      description.gl_sharing =
+          extensions.find("cl_khr_gl_sharing") != std::string::npos ||
+          extensions.find("cl_APPLE_gl_sharing") != std::string::npos;
+      result.push_back(description);
+    }
+  }
+  return result;
+}
+
+std::vector<CLDeviceDescription> CandidateCLDevices(int platform, int device) {
+  std::vector<CLDeviceDescription> result;
+  for (const CLDeviceDescription& d : ListCLDevices()) {
+    if ((platform < 0 || d.platform == platform) &&
+        (device < 0 || d.device == device)) {
+      result.push_back(d);
+    }
+  }
+  std::stable_partition(result.begin(), result.end(),
+                        [](const CLDeviceDescription& d) {
+                          return (d.type & CL_DEVICE_TYPE_GPU) != 0;
+                        });
+  return result;
+}
+
+cl::Device GetCLDevice(const CLDeviceDescription& d) {
+  std::vector<cl::Platform> platforms;
+  cl::Platform::get(&platforms);
+  std::vector<cl::Device> devices;
+  platforms[d.platform].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+  return devices[d.device];
+}
+
+std::vector<cl::Device> SplitCLDevice(cl::Device device, int parts) {
+  const cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+  if (parts < 1 || units < static_cast<cl_uint>(parts)) {
+    throw cl::Error(CL_INVALID_VALUE, "Not enough compute units to split");
+  }
+  const cl_device_partition_property properties[] = {
+      CL_DEVICE_PARTITION_EQUALLY,
+      static_cast<cl_device_partition_property>(units / parts), 0};
+  std::vector<cl::Device> sub_devices;
+  device.createSubDevices(properties, &sub_devices);
+  // Partitioning equally makes as many sub-devices as fit.
+  if (sub_devices.size() > static_cast<size_t>(parts)) {
+    sub_devices.resize(parts);
+  }
+  return sub_devices;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <CLPreComp.h>
+
+#include <string>
+#include <vector>
+
+// One OpenCL device as the settings and the command line refer to it.
+struct CLDeviceDescription {
+  int platform;
+  int device;
+  std::string platform_name;
+  std::string device_name;
+  cl_device_type type;
+  // cl_khr_gl_sharing or cl_APPLE_gl_sharing
+  bool gl_sharing;
+
+  // "GPU: <device> (<platform>)"
+  std::string Label() const;
+};
+
+// Every device of every platform, in platform then device order. Empty if
+// there is no OpenCL platform at all.
+std::vector<CLDeviceDescription> ListCLDevices();
+
+// The devices NBody tries for the given indices, -1 = any. GPUs come first,
+// so the automatic choice is the first GPU, or the first device (e.g. PoCL
+// on the CPU) on machines without one.
+std::vector<CLDeviceDescription> CandidateCLDevices(int platform, int device);
+
+// The device of a ListCLDevices entry.
+cl::Device GetCLDevice(const CLDeviceDescription& d);
+
+// Partitions device into parts sub-devices with an equal share of its
+// compute units, e.g. to run MultiDeviceNBody on several domains of one CPU
+// with PoCL. Throws cl::Error if the device cannot be partitioned that way.
+std::vector<cl::Device> SplitCLDevice(cl::Device device, int parts);
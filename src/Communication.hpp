@@ -1,36 +1,132 @@
 #pragma once
 
+#ifndef NBODY_HEADLESS
 #include <imgui.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
 
 #include "SimulationSettings.h"
+#include "TripleBuffer.h"
 struct SimulationData {
   int usedNodes = 0;
   int allocatedNodes = 0;
   float boundingboxstage1ms = 0;
   float boundingboxstage2ms = 0;
   float initOctreems = 0;
+  float mortonCodesms = 0;
+  float radixSortms = 0;
+  float reorderms = 0;
   float buildOctreems = 0;
   float centerofMassms = 0;
-  float dividecenterofmassms = 0;
+  float threadOctreems = 0;
   float barneshutms = 0;
+  float fmmInteractionsms = 0;
+  float fmmEvaluatems = 0;
+  // Only counted by the work group kernel and direct summation
+  unsigned long long interactions = 0;
   float positionupdatems = 0;
+  // Filled every energy_diagnostic_every steps
+  bool energyMeasured = false;
+  float energyms = 0;
+  double kineticEnergy = 0;
+  double potentialEnergy = 0;
+  // (E - E0) / |E0|
+  double energyDrift = 0;
+  double momentum[3] = {0, 0, 0};
+  // Block timesteps, force evaluations summed over the substeps
+  int deepestRung = 0;
+  unsigned long long activeUpdates = 0;
+  // Domain decomposition, one entry per device of MultiDeviceNBody. The
+  // stage timings above are those of the slowest device.
+  static constexpr int maxDevices = 16;
+  struct DeviceTimings {
+    int particles = 0;
+    // Nodes and particles received from the other domains
+    int imported = 0;
+    int usedNodes = 0;
+    float uploadms = 0;
+    float buildOctreems = 0;
+    float centerofMassms = 0;
+    float barneshutms = 0;
+    float downloadms = 0;
+  };
+  int deviceCount = 0;
+  DeviceTimings devices[maxDevices];
+  // Building and exchanging the locally essential trees on the host
+  float exchangems = 0;
+  // Distributed mode, every rank of DistributedNBody has its own. The
+  // imported particles are the locally essential trees of the other ranks.
+  int rank = 0;
+  int ranks = 0;
+  int ownParticles = 0;
+  int importedParticles = 0;
+  float migratems = 0;
+  // Force time of the slowest rank over the average of all ranks
+  float loadImbalance = 0;
+  int rebalances = 0;
   float deltaTimesecond = 0;
+  float stepsPerSecond = 0;
   inline float GetUps() const { return 1.0f / deltaTimesecond; }
+#ifndef NBODY_HEADLESS
   void Render() const {
     if (ImGui::Begin("Simulation Results")) {
       ImGui::Text("Used Nodes: %d, allocated: %d", usedNodes, allocatedNodes);
       ImGui::Text("Bounding Box: %fms, %fms", boundingboxstage1ms,
                   boundingboxstage2ms);
       ImGui::Text("Init Octree: %fms", initOctreems);
+      ImGui::Text("Morton codes: %fms, radix sort: %fms", mortonCodesms,
+                  radixSortms);
+      ImGui::Text("Reorder particles: %fms", reorderms);
       ImGui::Text("Build Octree: %fms", buildOctreems);
       ImGui::Text("Center of Mass: %fms", centerofMassms);
-      ImGui::Text("Divide Center of Mass: %fms", dividecenterofmassms);
+      ImGui::Text("Thread Octree: %fms", threadOctreems);
       ImGui::Text("Barnes-Hut: %fms", barneshutms);
+      ImGui::Text("FMM interactions: %fms, evaluate: %fms", fmmInteractionsms,
+                  fmmEvaluatems);
+      if (interactions > 0) {
+        ImGui::Text("Interactions: %llu, %g/s", interactions,
+                    interactions / (barneshutms / 1000.0));
+      }
       ImGui::Text("Position Update: %fms", positionupdatems);
+      if (activeUpdates > 0) {
+        ImGui::Text("Deepest rung: %d, active updates: %llu", deepestRung,
+                    activeUpdates);
+      }
+      if (energyMeasured) {
+        ImGui::Text("Energy: %g (kinetic %g, potential %g), %fms",
+                    kineticEnergy + potentialEnergy, kineticEnergy,
+                    potentialEnergy, energyms);
+        ImGui::Text("Energy drift: %g", energyDrift);
+        ImGui::Text("Momentum: %g %g %g", momentum[0], momentum[1],
+                    momentum[2]);
+      }
+      if (deviceCount > 0 || ranks > 0) {
+        ImGui::Text("Essential tree exchange: %fms", exchangems);
+      }
+      if (ranks > 0) {
+        ImGui::Text("Rank %d of %d: %d particles, %d imported", rank, ranks,
+                    ownParticles, importedParticles);
+        ImGui::Text("Migration: %fms, load imbalance: %f, rebalanced: %d",
+                    migratems, loadImbalance, rebalances);
+      }
+      for (int d = 0; d < deviceCount; d++) {
+        const DeviceTimings& t = devices[d];
+        ImGui::Text(
+            "Device %d: %d particles, %d imported, %d nodes, upload %fms, "
+            "build %fms, center of mass %fms, force %fms, download %fms",
+            d, t.particles, t.imported, t.usedNodes, t.uploadms,
+            t.buildOctreems, t.centerofMassms, t.barneshutms, t.downloadms);
+      }
       ImGui::Text("Delta Time: %fs, UPS: %f", deltaTimesecond, GetUps());
+      ImGui::Text("Steps per second: %f", stepsPerSecond);
     }
     ImGui::End();
   }
+#endif
 };
 
 struct SettingChanges {
@@ -40,106 +136,111 @@ struct SettingChanges {
   SimulationSettings new_settings;
 };
 
+// Between the render thread and the simulation thread. The flags are
+// atomics and the settings and results each go through a TripleBuffer, so
+// the simulation loop never takes a lock and the renderer never blocks it.
+// Only a crash is passed under a mutex, it is rare and both sides check a
+// flag first. The settings go from the render thread (the only writer) to
+// the simulation thread (the only reader), the results the other way. While
+// there is nothing to do the simulation thread sleeps in WaitForWork, every
+// command that gives it work wakes it.
 class Communication {
  public:
-  Communication(const SimulationSettings& s) : settings{false, s} {}
+  Communication(const SimulationSettings& s) : pending{false, s} {}
+  // Render thread
   void Handle(SimulationSettingsEditor& sse,
               const SimulationSettingsEditor::Command& cmd) {
     SetRunning(cmd.on);
     if (cmd.apply_changes || cmd.regenerate_particles) {
-      std::lock_guard m_change_lock(m_changes);
-      std::lock_guard m_settings_lock(m_settings);
-      changes = true;
+      // A change the simulation has not taken yet is overwritten.
       if (cmd.apply_changes) {
-        std::lock_guard m_crash_lock(m_crashed);
-        crashed = std::nullopt;
-        settings.only_regenerate = false;
-        settings.new_settings = sse.GetCurrSettings();
+        ClearCrashed();
+        pending.only_regenerate = false;
+        pending.new_settings = sse.GetCurrSettings();
       } else {
-        settings.only_regenerate = cmd.regenerate_particles;
+        pending.only_regenerate = cmd.regenerate_particles;
       }
+      changes.Back() = pending;
+      changes.Publish();
+      Wake();
     }
   }
-  SettingChanges GetNewSettings() {
-    std::lock_guard lock(m_settings);
-    // Copied
-    return settings;
-  }
 
+  // Simulation thread, whether new settings arrived since the last call.
+  // They stay in GetNewSettings() until the next call.
+  bool TakeNewSettings() { return changes.Update(); }
+  const SettingChanges& GetNewSettings() const { return changes.Front(); }
+
+  // Called every frame, only a paused simulation has to be woken.
   void SetRunning(bool _new) {
-    std::lock_guard lock(m_is_running);
-    is_running = _new;
-  }
-  bool GetRunning() {
-    std::lock_guard lock(m_is_running);
-    return is_running;
-  }
-  bool GetRunningOrTrue() {
-    bool locked = m_is_running.try_lock();
-    bool val = !locked || is_running;
-    if (locked) m_is_running.unlock();
-    return val;
+    if (!is_running.exchange(_new) && _new) Wake();
   }
+  bool GetRunning() const { return is_running; }
   void SetShutDown(bool _new) {
-    std::lock_guard lock(m_shutdown);
     shutdown = _new;
+    if (_new) Wake();
   }
-  bool GetShutDown() {
-    std::lock_guard lock(m_shutdown);
-    return shutdown;
-  }
-  bool GetShutDownOrFalse() {
-    bool locked = m_shutdown.try_lock();
-    bool val = locked && shutdown;
-    if (locked) m_shutdown.unlock();
-    return val;
-  }
+  bool GetShutDown() const { return shutdown; }
 
-  bool GetChangesOrFalseAndReset() {
-    bool locked = m_changes.try_lock();
-    bool val = locked && changes;
-    if (locked) {
-      m_changes.unlock();
-      changes = false;
-    };
-    return val;
+  // Simulation thread, blocks until it is running, new settings arrived or
+  // it has to shut down. Returns right away if it is already the case.
+  void WaitForWork() {
+    if (HasWork()) return;
+    std::unique_lock lock(m_wake);
+    wake.wait(lock, [this] { return HasWork(); });
   }
 
-  SimulationData GetSimulationData() {
-    std::lock_guard lock(m_simulationdata);
-    return data;
-  }
-  void SetSimulationData(SimulationData _new) {
-    std::lock_guard lock(m_simulationdata);
-    data = _new;
+  // Simulation thread
+  void SetSimulationData(const SimulationData& _new) {
+    results.Back() = _new;
+    results.Publish();
   }
 
   void SetCrashed(CustomCLError ex) {
     std::lock_guard lock(m_crashed);
     crashed = ex;
+    has_crashed = true;
   }
 
   std::optional<CustomCLError> GetCrashed() {
+    if (!has_crashed) return std::nullopt;
     std::lock_guard lock(m_crashed);
     return crashed;
   }
 
+#ifndef NBODY_HEADLESS
+  // Render thread, shows the newest results.
   void RenderSimulationResults() {
-    std::lock_guard lock(m_simulationdata);
-    data.Render();
+    results.Update();
+    results.Front().Render();
+  }
+#endif
+
+ private:
+  bool HasWork() const { return is_running || shutdown || changes.HasNew(); }
+  // Wakes WaitForWork after its condition changed. The empty critical
+  // section orders the change before a check that is about to go to sleep,
+  // so the notification cannot be lost.
+  void Wake() {
+    { std::lock_guard lock(m_wake); }
+    wake.notify_one();
+  }
+  void ClearCrashed() {
+    std::lock_guard lock(m_crashed);
+    crashed = std::nullopt;
+    has_crashed = false;
   }
 
-  std::mutex m_changes;
-  bool changes = false;
-  std::mutex m_settings;
-  SettingChanges settings;
-  std::mutex m_is_running;
-  bool is_running = false;
-  std::mutex m_shutdown;
-  bool shutdown = false;
-  std::mutex m_simulationdata;
-  SimulationData data;
+  // Render thread, the settings of the last change
+  SettingChanges pending;
+  TripleBuffer<SettingChanges> changes;
+  std::atomic<bool> is_running = false;
+  std::atomic<bool> shutdown = false;
+  TripleBuffer<SimulationData> results;
+  std::mutex m_wake;
+  std::condition_variable wake;
 
+  std::atomic<bool> has_crashed = false;
   std::mutex m_crashed;
   std::optional<CustomCLError> crashed;
 };
\ No newline at end of file
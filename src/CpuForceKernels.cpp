@@ -0,0 +1,165 @@
+#include "CpuForceKernels.h"
+
+#include <cmath>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CPU_FORCE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+void InteractScalar(const float* px, const float* py, const float* pz,
+                    int count, const PointMasses& sources, float eps2,
+                    float* ax, float* ay, float* az) {
+  const int source_count = static_cast<int>(sources.size());
+  for (int i = 0; i < count; i++) {
+    float acc_x = 0;
+    float acc_y = 0;
+    float acc_z = 0;
+    for (int j = 0; j < source_count; j++) {
+      const float dx = sources.x[j] - px[i];
+      const float dy = sources.y[j] - py[i];
+      const float dz = sources.z[j] - pz[i];
+      const float r2 = dx * dx + dy * dy + dz * dz + eps2;
+      if (r2 <= 0) continue;
+      const float inv = 1.0f / std::sqrt(r2);
+      const float s = sources.mass[j] * inv * inv * inv;
+      acc_x += dx * s;
+      acc_y += dy * s;
+      acc_z += dz * s;
+    }
+    ax[i] = acc_x;
+    ay[i] = acc_y;
+    az[i] = acc_z;
+  }
+}
+
+#ifdef CPU_FORCE_KERNELS_X86
+// Eight particles per register, every source is broadcast. The 12 bit
+// rsqrt estimate is refined with one Newton-Raphson step,
+// y' = y * (1.5 - 0.5 * r2 * y * y).
+__attribute__((target("avx2,fma"))) void InteractAvx2(
+    const float* px, const float* py, const float* pz, int count,
+    const PointMasses& sources, float eps2, float* ax, float* ay, float* az) {
+  const int source_count = static_cast<int>(sources.size());
+  const __m256 eps = _mm256_set1_ps(eps2);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 three_halves = _mm256_set1_ps(1.5f);
+  const __m256 zero = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 x = _mm256_loadu_ps(px + i);
+    const __m256 y = _mm256_loadu_ps(py + i);
+    const __m256 z = _mm256_loadu_ps(pz + i);
+    __m256 acc_x = zero;
+    __m256 acc_y = zero;
+    __m256 acc_z = zero;
+    for (int j = 0; j < source_count; j++) {
+      const __m256 dx = _mm256_sub_ps(_mm256_set1_ps(sources.x[j]), x);
+      const __m256 dy = _mm256_sub_ps(_mm256_set1_ps(sources.y[j]), y);
+      const __m256 dz = _mm256_sub_ps(_mm256_set1_ps(sources.z[j]), z);
+      const __m256 r2 = _mm256_fmadd_ps(
+          dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_fmadd_ps(dz, dz, eps)));
+      __m256 inv = _mm256_rsqrt_ps(r2);
+      inv = _mm256_mul_ps(
+          inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2),
+                                _mm256_mul_ps(inv, inv), three_halves));
+      inv = _mm256_and_ps(inv, _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+      const __m256 inv3 = _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv));
+      const __m256 s = _mm256_mul_ps(_mm256_set1_ps(sources.mass[j]), inv3);
+      acc_x = _mm256_fmadd_ps(dx, s, acc_x);
+      acc_y = _mm256_fmadd_ps(dy, s, acc_y);
+      acc_z = _mm256_fmadd_ps(dz, s, acc_z);
+    }
+    _mm256_storeu_ps(ax + i, acc_x);
+    _mm256_storeu_ps(ay + i, acc_y);
+    _mm256_storeu_ps(az + i, acc_z);
+  }
+  InteractScalar(px + i, py + i, pz + i, count - i, sources, eps2, ax + i,
+                 ay + i, az + i);
+}
+
+// Sixteen particles per register, rsqrt14 plus one Newton-Raphson step is
+// already exact to float precision.
+__attribute__((target("avx512f"))) void InteractAvx512(
+    const float* px, const float* py, const float* pz, int count,
+    const PointMasses& sources, float eps2, float* ax, float* ay, float* az) {
+  const int source_count = static_cast<int>(sources.size());
+  const __m512 eps = _mm512_set1_ps(eps2);
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512 three_halves = _mm512_set1_ps(1.5f);
+  const __m512 zero = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m512 x = _mm512_loadu_ps(px + i);
+    const __m512 y = _mm512_loadu_ps(py + i);
+    const __m512 z = _mm512_loadu_ps(pz + i);
+    __m512 acc_x = zero;
+    __m512 acc_y = zero;
+    __m512 acc_z = zero;
+    for (int j = 0; j < source_count; j++) {
+      const __m512 dx = _mm512_sub_ps(_mm512_set1_ps(sources.x[j]), x);
+      const __m512 dy = _mm512_sub_ps(_mm512_set1_ps(sources.y[j]), y);
+      const __m512 dz = _mm512_sub_ps(_mm512_set1_ps(sources.z[j]), z);
+      const __m512 r2 = _mm512_fmadd_ps(
+          dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_fmadd_ps(dz, dz, eps)));
+      __m512 inv = _mm512_rsqrt14_ps(r2);
+      inv = _mm512_mul_ps(
+          inv, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2),
+                                _mm512_mul_ps(inv, inv), three_halves));
+      inv = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ),
+                                inv);
+      const __m512 inv3 = _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv));
+      const __m512 s = _mm512_mul_ps(_mm512_set1_ps(sources.mass[j]), inv3);
+      acc_x = _mm512_fmadd_ps(dx, s, acc_x);
+      acc_y = _mm512_fmadd_ps(dy, s, acc_y);
+      acc_z = _mm512_fmadd_ps(dz, s, acc_z);
+    }
+    _mm512_storeu_ps(ax + i, acc_x);
+    _mm512_storeu_ps(ay + i, acc_y);
+    _mm512_storeu_ps(az + i, acc_z);
+  }
+  InteractScalar(px + i, py + i, pz + i, count - i, sources, eps2, ax + i,
+                 ay + i, az + i);
+}
+#endif
+
+constexpr InteractionKernel scalarKernel = {"scalar", 1, InteractScalar};
+#ifdef CPU_FORCE_KERNELS_X86
+constexpr InteractionKernel avx2Kernel = {"avx2", 8, InteractAvx2};
+constexpr InteractionKernel avx512Kernel = {"avx512", 16, InteractAvx512};
+
+bool SupportsAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+bool SupportsAvx512() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+}  // namespace
+
+const InteractionKernel& BestInteractionKernel() {
+  static const InteractionKernel best = [] {
+#ifdef CPU_FORCE_KERNELS_X86
+    if (SupportsAvx512()) return avx512Kernel;
+    if (SupportsAvx2()) return avx2Kernel;
+#endif
+    return scalarKernel;
+  }();
+  return best;
+}
+
+std::optional<InteractionKernel> FindInteractionKernel(
+    const std::string& name) {
+  if (name == scalarKernel.name) return scalarKernel;
+#ifdef CPU_FORCE_KERNELS_X86
+  if (name == avx2Kernel.name && SupportsAvx2()) return avx2Kernel;
+  if (name == avx512Kernel.name && SupportsAvx512()) return avx512Kernel;
+#endif
+  return std::nullopt;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Point masses in structure of arrays layout, so the kernels can load 8 or
+// 16 of them at once. Holds the particles of CpuNBody, and the accepted
+// nodes and opened leaves a block of particles interacts with.
+struct PointMasses {
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+  std::vector<float> mass;
+
+  size_t size() const { return x.size(); }
+  void resize(size_t n) {
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+    mass.resize(n);
+  }
+  void clear() { resize(0); }
+  void push_back(float px, float py, float pz, float m) {
+    x.push_back(px);
+    y.push_back(py);
+    z.push_back(pz);
+    mass.push_back(m);
+  }
+};
+
+// Writes the acceleration without G of the particles (px, py, pz)[0, count)
+// caused by every source into (ax, ay, az). eps2 is the squared softening,
+// a source at the position of the particle contributes nothing.
+using InteractionFunction = void (*)(const float* px, const float* py,
+                                     const float* pz, int count,
+                                     const PointMasses& sources, float eps2,
+                                     float* ax, float* ay, float* az);
+
+struct InteractionKernel {
+  const char* name;
+  // Particles per instruction
+  int width;
+  InteractionFunction function;
+};
+
+// The widest kernel the CPU supports, checked once at runtime. The AVX
+// kernels are only compiled with GCC and Clang on x86.
+const InteractionKernel& BestInteractionKernel();
+// "scalar", "avx2" or "avx512", nullopt if unknown or unsupported here.
+std::optional<InteractionKernel> FindInteractionKernel(const std::string& name);
@@ -0,0 +1,612 @@
+#include "CpuNBody.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace {
+// Particles per task of the linear passes.
+constexpr size_t BLOCK_SIZE = 4096;
+// Particles per force task, neighbours in Morton order share most of their
+// traversal.
+constexpr size_t FORCE_BLOCK_SIZE = 64;
+// Leaves hold up to this many particles, summed directly once opened.
+constexpr int LEAF_SIZE = 8;
+constexpr int KEY_BITS = 21;
+// The levels above this depth are built serially, every cell of this depth
+// (a bucket) is a separate task.
+constexpr int TOP_DEPTH = 3;
+constexpr int BUCKETS = 1 << (3 * TOP_DEPTH);
+constexpr int BUCKET_SHIFT = 3 * (KEY_BITS - TOP_DEPTH);
+// 8 children per level
+constexpr int STACK_SIZE = 8 * KEY_BITS + 8;
+
+// Spreads the low 21 bits of v out to every third bit.
+uint64_t SpreadBits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+
+float MsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<float, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+}  // namespace
+
+CpuNBody::CpuNBody(const SimulationSettings& s, unsigned thread_count)
+    : settings(s), pool(thread_count), kernel(BestInteractionKernel()) {}
+
+bool CpuNBody::Init() { return true; }
+
+void CpuNBody::ChangeSettings(const SimulationSettings& s) {
+  const bool requires_restart = must_regenerate ||
+                                settings.particle_count != s.particle_count ||
+                                s.layoutchanged;
+  settings = s;
+  initial_energy.reset();
+  must_regenerate = false;
+  if (requires_restart) {
+    RegenerateParticles();
+  }
+}
+
+void CpuNBody::RegenerateParticles() {
+  ParticleSetDescription set = settings.layout(settings.particle_count);
+  set.first.resize(settings.particle_count);
+  set.second.resize(settings.particle_count);
+  LoadParticles(set, 0);
+}
+
+void CpuNBody::LoadParticles(const ParticleSetDescription& set,
+                             int first_index) {
+  const size_t n = set.first.size();
+  std::lock_guard lock(frames);
+  positions.resize(n);
+  velocities.resize(n);
+  forces.assign(n, glm::vec3(0));
+  order.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    const cl_float4& p = set.first[i];
+    const cl_float3& v = set.second[i].velocity;
+    positions[i] = glm::vec4(p.s[0], p.s[1], p.s[2], p.s[3]);
+    velocities[i] = glm::vec3(v.s[0], v.s[1], v.s[2]);
+    order[i] = first_index + static_cast<int>(i);
+  }
+  pending_kick_dt = 0;
+  steps_until_energy = 0;
+  initial_energy.reset();
+  frames.Publish();
+}
+
+void CpuNBody::Clean() {
+  nodes = std::vector<Node>();
+  keys = std::vector<KeyIndex>();
+  keysScratch = std::vector<KeyIndex>();
+}
+
+void CpuNBody::ReadPositions(std::vector<cl_float4>& out) {
+  out.resize(positions.size());
+  for (size_t i = 0; i < positions.size(); i++) {
+    cl_float4& p = out[order[i]];
+    for (int d = 0; d < 4; d++) {
+      p.s[d] = positions[i][d];
+    }
+  }
+}
+
+void CpuNBody::SortKeys() {
+  const size_t n = positions.size();
+  const size_t blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<glm::vec3> mins(blocks);
+  std::vector<glm::vec3> maxs(blocks);
+  pool.ParallelFor(n, BLOCK_SIZE, [&](size_t begin, size_t end) {
+    glm::vec3 lo(std::numeric_limits<float>::max());
+    glm::vec3 hi(-std::numeric_limits<float>::max());
+    for (size_t i = begin; i < end; i++) {
+      lo = glm::min(lo, glm::vec3(positions[i]));
+      hi = glm::max(hi, glm::vec3(positions[i]));
+    }
+    mins[begin / BLOCK_SIZE] = lo;
+    maxs[begin / BLOCK_SIZE] = hi;
+  });
+  glm::vec3 lo = mins[0];
+  glm::vec3 hi = maxs[0];
+  for (size_t b = 1; b < blocks; b++) {
+    lo = glm::min(lo, mins[b]);
+    hi = glm::max(hi, maxs[b]);
+  }
+  const glm::vec3 extent = hi - lo;
+  box_min = lo;
+  // Slightly larger, so the largest coordinate still gets a valid cell.
+  box_size = glm::max(glm::max(extent.x, extent.y), extent.z) * 1.0001f;
+  if (box_size <= 0) {
+    box_size = 1;
+  }
+  simulation_results.boundingboxstage1ms += MsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  keysScratch.resize(n);
+  const float scale = static_cast<float>(1 << KEY_BITS) / box_size;
+  const float max_cell = static_cast<float>((1 << KEY_BITS) - 1);
+  pool.ParallelFor(n, BLOCK_SIZE, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const glm::vec3 cell = glm::clamp(
+          (glm::vec3(positions[i]) - box_min) * scale, 0.0f, max_cell);
+      keysScratch[i].key = SpreadBits(static_cast<uint64_t>(cell.x)) |
+                           SpreadBits(static_cast<uint64_t>(cell.y)) << 1 |
+                           SpreadBits(static_cast<uint64_t>(cell.z)) << 2;
+      keysScratch[i].index = static_cast<int>(i);
+    }
+  });
+  simulation_results.mortonCodesms += MsSince(start);
+
+  // Counting sort into the buckets, then every bucket is sorted on its own.
+  start = std::chrono::steady_clock::now();
+  std::vector<size_t> histogram(blocks * BUCKETS, 0);
+  pool.ParallelFor(n, BLOCK_SIZE, [&](size_t begin, size_t end) {
+    size_t* own = &histogram[begin / BLOCK_SIZE * BUCKETS];
+    for (size_t i = begin; i < end; i++) {
+      own[keysScratch[i].key >> BUCKET_SHIFT]++;
+    }
+  });
+  bucketStart.resize(BUCKETS + 1);
+  size_t sum = 0;
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    bucketStart[bucket] = static_cast<int>(sum);
+    for (size_t b = 0; b < blocks; b++) {
+      const size_t count = histogram[b * BUCKETS + bucket];
+      histogram[b * BUCKETS + bucket] = sum;
+      sum += count;
+    }
+  }
+  bucketStart[BUCKETS] = static_cast<int>(sum);
+
+  keys.resize(n);
+  pool.ParallelFor(n, BLOCK_SIZE, [&](size_t begin, size_t end) {
+    size_t* own = &histogram[begin / BLOCK_SIZE * BUCKETS];
+    for (size_t i = begin; i < end; i++) {
+      keys[own[keysScratch[i].key >> BUCKET_SHIFT]++] = keysScratch[i];
+    }
+  });
+  pool.ParallelFor(BUCKETS, [&](size_t bucket) {
+    std::sort(keys.begin() + bucketStart[bucket],
+              keys.begin() + bucketStart[bucket + 1],
+              [](const KeyIndex& a, const KeyIndex& b) {
+                return a.key < b.key;
+              });
+  });
+  simulation_results.radixSortms += MsSince(start);
+}
+
+void CpuNBody::SortParticles() {
+  const size_t n = positions.size();
+  SortKeys();
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<glm::vec4> sorted_positions(n);
+  std::vector<glm::vec3> sorted_velocities(n);
+  std::vector<int> sorted_order(n);
+  pool.ParallelFor(n, BLOCK_SIZE, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const int from = keys[i].index;
+      sorted_positions[i] = positions[from];
+      sorted_velocities[i] = velocities[from];
+      sorted_order[i] = order[from];
+    }
+  });
+  {
+    std::lock_guard lock(frames);
+    positions.swap(sorted_positions);
+    velocities.swap(sorted_velocities);
+    order.swap(sorted_order);
+  }
+  simulation_results.reorderms += MsSince(start);
+}
+
+void CpuNBody::BuildTree() {
+  if (positions.empty()) {
+    nodes.clear();
+    return;
+  }
+  SortParticles();
+
+  // Every bucket builds its subtree with local indices. The subtree roots
+  // then become the deepest level of the serially built top of the tree, the
+  // rest of every subtree is moved after the top nodes.
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::vector<Node>> subtrees(BUCKETS);
+  pool.ParallelFor(BUCKETS, [&](size_t bucket) {
+    if (bucketStart[bucket] == bucketStart[bucket + 1]) {
+      return;
+    }
+    subtrees[bucket].resize(1);
+    BuildNode(subtrees[bucket], 0, bucketStart[bucket],
+              bucketStart[bucket + 1], TOP_DEPTH);
+  });
+
+  int top_nodes = 0;
+  for (int depth = 0; depth <= TOP_DEPTH; depth++) {
+    const int shift = 3 * (TOP_DEPTH - depth);
+    for (int cell = 0; cell < (1 << (3 * depth)); cell++) {
+      if (bucketStart[cell << shift] != bucketStart[(cell + 1) << shift]) {
+        top_nodes++;
+      }
+    }
+  }
+  std::vector<int> offsets(BUCKETS);
+  int total = top_nodes;
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    offsets[bucket] = total;
+    if (!subtrees[bucket].empty()) {
+      total += static_cast<int>(subtrees[bucket].size()) - 1;
+    }
+  }
+
+  nodes.resize(total);
+  int next_slot = 1;
+  BuildTop(0, 0, 0, next_slot, subtrees, offsets);
+  pool.ParallelFor(BUCKETS, [&](size_t bucket) {
+    const std::vector<Node>& subtree = subtrees[bucket];
+    for (size_t j = 1; j < subtree.size(); j++) {
+      Node node = subtree[j];
+      if (!node.leaf) {
+        node.first += offsets[bucket] - 1;
+      }
+      nodes[offsets[bucket] + j - 1] = node;
+    }
+  });
+  simulation_results.buildOctreems += MsSince(start);
+  simulation_results.usedNodes = static_cast<int>(nodes.size());
+  // The tree is sized to fit, there is no node budget like on the device.
+  simulation_results.allocatedNodes = static_cast<int>(nodes.size());
+}
+
+void CpuNBody::BuildNode(std::vector<Node>& tree, int slot, int begin,
+                         int end, int depth) const {
+  Node node;
+  node.size = box_size / static_cast<float>(1 << depth);
+  node.mass = 0;
+  node.center_of_mass = glm::vec3(0);
+
+  if (end - begin <= LEAF_SIZE || depth == KEY_BITS) {
+    for (int i = begin; i < end; i++) {
+      node.mass += positions[i].w;
+      node.center_of_mass += glm::vec3(positions[i]) * positions[i].w;
+    }
+    node.first = begin;
+    node.count = end - begin;
+    node.leaf = true;
+  } else {
+    // The particles of every child cell are contiguous, find where they
+    // start.
+    const int shift = 3 * (KEY_BITS - 1 - depth);
+    int bounds[9];
+    bounds[0] = begin;
+    int children = 0;
+    for (int digit = 0; digit < 8; digit++) {
+      auto split = std::partition_point(
+          keys.begin() + bounds[digit], keys.begin() + end,
+          [&](const KeyIndex& k) {
+            return static_cast<int>((k.key >> shift) & 7) <= digit;
+          });
+      bounds[digit + 1] = static_cast<int>(split - keys.begin());
+      if (bounds[digit + 1] != bounds[digit]) {
+        children++;
+      }
+    }
+
+    const int first = static_cast<int>(tree.size());
+    tree.resize(first + children);
+    int child = first;
+    for (int digit = 0; digit < 8; digit++) {
+      if (bounds[digit + 1] != bounds[digit]) {
+        BuildNode(tree, child++, bounds[digit], bounds[digit + 1], depth + 1);
+      }
+    }
+    for (int c = first; c < first + children; c++) {
+      node.mass += tree[c].mass;
+      node.center_of_mass += tree[c].center_of_mass * tree[c].mass;
+    }
+    node.first = first;
+    node.count = children;
+    node.leaf = false;
+  }
+  if (node.mass > 0) {
+    node.center_of_mass /= node.mass;
+  }
+  tree[slot] = node;
+}
+
+void CpuNBody::BuildTop(int slot, uint32_t prefix, int depth, int& next_slot,
+                        const std::vector<std::vector<Node>>& subtrees,
+                        const std::vector<int>& offsets) {
+  if (depth == TOP_DEPTH) {
+    Node root = subtrees[prefix][0];
+    if (!root.leaf) {
+      root.first += offsets[prefix] - 1;
+    }
+    nodes[slot] = root;
+    return;
+  }
+
+  const int shift = 3 * (TOP_DEPTH - depth - 1);
+  int children = 0;
+  for (uint32_t digit = 0; digit < 8; digit++) {
+    const uint32_t cell = prefix * 8 + digit;
+    if (bucketStart[cell << shift] != bucketStart[(cell + 1) << shift]) {
+      children++;
+    }
+  }
+  const int first = next_slot;
+  next_slot += children;
+  int child = first;
+  for (uint32_t digit = 0; digit < 8; digit++) {
+    const uint32_t cell = prefix * 8 + digit;
+    if (bucketStart[cell << shift] != bucketStart[(cell + 1) << shift]) {
+      BuildTop(child++, cell, depth + 1, next_slot, subtrees, offsets);
+    }
+  }
+
+  Node node;
+  node.size = box_size / static_cast<float>(1 << depth);
+  node.mass = 0;
+  node.center_of_mass = glm::vec3(0);
+  for (int c = first; c < first + children; c++) {
+    node.mass += nodes[c].mass;
+    node.center_of_mass += nodes[c].center_of_mass * nodes[c].mass;
+  }
+  if (node.mass > 0) {
+    node.center_of_mass /= node.mass;
+  }
+  node.first = first;
+  node.count = children;
+  node.leaf = false;
+  nodes[slot] = node;
+}
+
+void CpuNBody::BuildInteractionList(int begin, int end,
+                                    PointMasses& list) const {
+  glm::vec3 lo(positions[begin]);
+  glm::vec3 hi(positions[begin]);
+  for (int i = begin + 1; i < end; i++) {
+    lo = glm::min(lo, glm::vec3(positions[i]));
+    hi = glm::max(hi, glm::vec3(positions[i]));
+  }
+  const float eps2 = settings.eps * settings.eps;
+  const float threshold2 =
+      settings.distance_threshold * settings.distance_threshold;
+
+  list.clear();
+  int stack[STACK_SIZE];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const Node& node = nodes[stack[--stack_size]];
+    if (node.mass <= 0) continue;
+
+    const glm::vec3 delta =
+        node.center_of_mass - glm::clamp(node.center_of_mass, lo, hi);
+    const float distance_squared = glm::dot(delta, delta) + eps2;
+    if (node.size * node.size < threshold2 * distance_squared) {
+      list.push_back(node.center_of_mass.x, node.center_of_mass.y,
+                     node.center_of_mass.z, node.mass);
+    } else if (node.leaf) {
+      for (int j = node.first; j < node.first + node.count; j++) {
+        list.push_back(particleMasses.x[j], particleMasses.y[j],
+                       particleMasses.z[j], particleMasses.mass[j]);
+      }
+    } else {
+      for (int c = 0; c < node.count; c++) {
+        stack[stack_size++] = node.first + c;
+      }
+    }
+  }
+}
+
+void CpuNBody::ComputeForces() {
+  const size_t n = positions.size();
+  const bool direct_sum = settings.force_kernel == ForceKernel::DirectSum ||
+                          settings.particle_count < settings.direct_sum_below;
+  if (!direct_sum) {
+    BuildTree();
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  particleMasses.resize(n);
+  pool.ParallelFor(n, BLOCK_SIZE, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      particleMasses.x[i] = positions[i].x;
+      particleMasses.y[i] = positions[i].y;
+      particleMasses.z[i] = positions[i].z;
+      particleMasses.mass[i] = positions[i].w;
+    }
+  });
+
+  const float eps2 = settings.eps * settings.eps;
+  std::vector<unsigned long long> interactions(
+      (n + FORCE_BLOCK_SIZE - 1) / FORCE_BLOCK_SIZE, 0);
+  pool.ParallelFor(n, FORCE_BLOCK_SIZE, [&](size_t begin, size_t end) {
+    thread_local PointMasses list;
+    float ax[FORCE_BLOCK_SIZE];
+    float ay[FORCE_BLOCK_SIZE];
+    float az[FORCE_BLOCK_SIZE];
+    // Only the particles that need a force, see order.
+    int targets[FORCE_BLOCK_SIZE];
+    int count = 0;
+    for (size_t i = begin; i < end; i++) {
+      if (order[i] >= 0) targets[count++] = static_cast<int>(i);
+    }
+    if (count == 0) return;
+    const PointMasses* sources = &particleMasses;
+    if (!direct_sum) {
+      BuildInteractionList(static_cast<int>(begin), static_cast<int>(end),
+                           list);
+      sources = &list;
+    }
+    if (count == static_cast<int>(end - begin)) {
+      kernel.function(&particleMasses.x[begin], &particleMasses.y[begin],
+                      &particleMasses.z[begin], count, *sources, eps2, ax, ay,
+                      az);
+    } else {
+      float x[FORCE_BLOCK_SIZE];
+      float y[FORCE_BLOCK_SIZE];
+      float z[FORCE_BLOCK_SIZE];
+      for (int k = 0; k < count; k++) {
+        x[k] = particleMasses.x[targets[k]];
+        y[k] = particleMasses.y[targets[k]];
+        z[k] = particleMasses.z[targets[k]];
+      }
+      kernel.function(x, y, z, count, *sources, eps2, ax, ay, az);
+    }
+    for (int k = 0; k < count; k++) {
+      forces[targets[k]] = glm::vec3(ax[k], ay[k], az[k]) *
+                           (settings.gravitational_constant *
+                            positions[targets[k]].w);
+    }
+    // The direct sum counts N^2 like the DirectSum kernel. The list holds
+    // the block's own particles as well, which contribute nothing to
+    // themselves.
+    interactions[begin / FORCE_BLOCK_SIZE] =
+        static_cast<unsigned long long>(count) * sources->size() -
+        (direct_sum ? 0 : count);
+  });
+  for (unsigned long long count : interactions) {
+    simulation_results.interactions += count;
+  }
+  simulation_results.barneshutms += MsSince(start);
+}
+
+void CpuNBody::Integrate(float kick_dt, float drift_dt) {
+  auto start = std::chrono::steady_clock::now();
+  std::lock_guard lock(frames);
+  pool.ParallelFor(positions.size(), BLOCK_SIZE, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      velocities[i] += forces[i] * kick_dt / positions[i].w;
+      positions[i] += glm::vec4(velocities[i] * drift_dt, 0);
+    }
+  });
+  simulation_results.positionupdatems += MsSince(start);
+}
+
+CpuNBody::EnergySums CpuNBody::SumEnergy(float velocity_dt) {
+  const size_t n = positions.size();
+  const float eps2 = settings.eps * settings.eps;
+  std::vector<EnergySums> partial((n + FORCE_BLOCK_SIZE - 1) /
+                                  FORCE_BLOCK_SIZE);
+  pool.ParallelFor(n, FORCE_BLOCK_SIZE, [&](size_t begin, size_t end) {
+    EnergySums& own = partial[begin / FORCE_BLOCK_SIZE];
+    for (size_t i = begin; i < end; i++) {
+      const glm::vec3 pos(positions[i]);
+      const float mass = positions[i].w;
+      double potential = 0;
+      for (size_t j = 0; j < n; j++) {
+        if (j == i) continue;
+        const glm::vec3 d = glm::vec3(positions[j]) - pos;
+        potential -= positions[j].w / std::sqrt(glm::dot(d, d) + eps2);
+      }
+      own.Add(KineticSums(i, velocity_dt));
+      // Every pair is counted twice
+      own.potential +=
+          0.5 * static_cast<double>(settings.gravitational_constant) * mass *
+          potential;
+    }
+  });
+
+  EnergySums total;
+  for (const EnergySums& p : partial) {
+    total.Add(p);
+  }
+  return total;
+}
+
+CpuNBody::EnergySums CpuNBody::KineticSums(size_t i, float velocity_dt) const {
+  const float mass = positions[i].w;
+  // The velocities miss the closing half kick of the leapfrog, see
+  // EnergyDiagnostic.
+  const glm::vec3 velocity = velocities[i] + forces[i] * velocity_dt / mass;
+  const glm::vec3 momentum = velocity * mass;
+  EnergySums sums;
+  sums.kinetic = 0.5 * glm::dot(momentum, velocity);
+  for (int d = 0; d < 3; d++) {
+    sums.momentum[d] = momentum[d];
+  }
+  return sums;
+}
+
+void CpuNBody::MeasureEnergy(float velocity_dt) {
+  auto start = std::chrono::steady_clock::now();
+  const EnergySums total = SumEnergy(velocity_dt);
+  const double energy = total.kinetic + total.potential;
+  if (!initial_energy.has_value()) {
+    initial_energy = energy;
+  }
+
+  simulation_results.energyMeasured = true;
+  simulation_results.kineticEnergy = total.kinetic;
+  simulation_results.potentialEnergy = total.potential;
+  simulation_results.energyDrift =
+      *initial_energy != 0
+          ? (energy - *initial_energy) / std::abs(*initial_energy)
+          : 0;
+  for (int d = 0; d < 3; d++) {
+    simulation_results.momentum[d] = total.momentum[d];
+  }
+  simulation_results.energyms = MsSince(start);
+}
+
+void CpuNBody::Calculate() {
+  const std::vector<float> substeps = IntegratorSubsteps(settings.integrator);
+
+  // Summed over the steps and their substeps
+  simulation_results.boundingboxstage1ms = 0;
+  simulation_results.mortonCodesms = 0;
+  simulation_results.radixSortms = 0;
+  simulation_results.reorderms = 0;
+  simulation_results.buildOctreems = 0;
+  simulation_results.barneshutms = 0;
+  simulation_results.interactions = 0;
+  simulation_results.positionupdatems = 0;
+
+  const int steps =
+      settings.steps_per_calculate > 1 ? settings.steps_per_calculate : 1;
+  const float truedt = timer.Tick();
+  float dt = std::min(truedt, settings.max_timestep);
+  if (settings.fixed_timestep > 0) {
+    dt = settings.fixed_timestep;
+  }
+
+  for (int step = 0; step < steps; step++) {
+    for (size_t i = 0; i < substeps.size(); i++) {
+      ComputeForces();
+
+      if (step == 0 && i == 0 && settings.energy_diagnostic_every > 0 &&
+          steps_until_energy <= 0) {
+        MeasureEnergy(pending_kick_dt);
+        steps_until_energy = settings.energy_diagnostic_every;
+      }
+
+      // Same kick merging as NBody::Calculate
+      const bool leapfrog = settings.integrator != Integrator::Euler;
+      const float drift_dt = substeps[i] * dt;
+      const float kick_dt =
+          pending_kick_dt + (leapfrog ? drift_dt * 0.5f : drift_dt);
+      pending_kick_dt = leapfrog ? drift_dt * 0.5f : 0;
+      Integrate(kick_dt, drift_dt);
+    }
+  }
+  steps_until_energy -= steps;
+  frames.Publish();
+
+  simulation_results.deltaTimesecond = truedt;
+  simulation_results.stepsPerSecond = steps / truedt;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <CLPreComp.h>
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <optional>
+#include <vector>
+
+#include "Communication.hpp"
+#include "CpuForceKernels.h"
+#include "ParticleDescription.h"
+#include "SimulationBackend.h"
+#include "ThreadPool.h"
+
+// Barnes-Hut on the CPU, the successor of old/cpunbody. Every force
+// evaluation sorts the particles by their Morton key, then builds the octree
+// from the sorted order with one task per top level cell. The forces are
+// calculated in blocks of neighbouring particles on a work stealing pool.
+// Every block walks the tree once and collects what it interacts with, the
+// interactions themselves run on the widest SIMD kernel of the CPU.
+//
+// Follows distance_threshold, eps, gravitational_constant, the integrator,
+// the timestep settings, steps_per_calculate, energy_diagnostic_every and
+// direct summation (force_kernel or direct_sum_below). The fast multipole
+// method, quadrupole moments and block timesteps are OpenCL only, the other
+// force kernels all map to this traversal.
+class CpuNBody : public ISimulationBackend {
+ public:
+  // 0 threads = one per hardware thread
+  CpuNBody(const SimulationSettings& s, unsigned thread_count = 0);
+  ~CpuNBody() override = default;
+
+  bool Init() override;
+  void RegenerateParticles() override;
+  void ChangeSettings(const SimulationSettings& s) override;
+  void Clean() override;
+  void Calculate() override;
+  void ReadPositions(std::vector<cl_float4>& out) override;
+
+  const SimulationData& GetSimulationData() const override {
+    return simulation_results;
+  }
+  FrameHandoff& GetFrames() override { return frames; }
+
+  const InteractionKernel& GetInteractionKernel() const { return kernel; }
+  void SetInteractionKernel(const InteractionKernel& k) { kernel = k; }
+
+ protected:
+  // Moves the particles into Morton order, keys then holds their sorted keys
+  // and order their original index.
+  void SortParticles();
+  // Fills forces for the current positions.
+  virtual void ComputeForces();
+  // Replaces the particles with set, order counts up from first_index.
+  void LoadParticles(const ParticleSetDescription& set, int first_index);
+
+  struct EnergySums {
+    double kinetic = 0;
+    double potential = 0;
+    double momentum[3] = {0, 0, 0};
+
+    void Add(const EnergySums& other) {
+      kinetic += other.kinetic;
+      potential += other.potential;
+      for (int d = 0; d < 3; d++) {
+        momentum[d] += other.momentum[d];
+      }
+    }
+  };
+  // Sums the energy and the momentum of every particle, the potential by
+  // direct summation. velocity_dt is the kick the velocities still miss.
+  virtual EnergySums SumEnergy(float velocity_dt);
+  // The kinetic energy and the momentum of particle i, without potential.
+  EnergySums KineticSums(size_t i, float velocity_dt) const;
+
+  SimulationSettings settings;
+  SimulationData simulation_results;
+  // Taken while the particles move or change order.
+  FrameHandoff frames;
+  ThreadPool pool;
+
+  // In Morton order after every SortParticles, order holds the original
+  // index. A particle with order -1 only acts as a source, ComputeForces
+  // leaves its force alone.
+  std::vector<glm::vec4> positions;
+  std::vector<glm::vec3> velocities;
+  std::vector<glm::vec3> forces;
+  std::vector<int> order;
+
+  struct KeyIndex {
+    uint64_t key;
+    int index;
+  };
+  std::vector<KeyIndex> keys;
+  // The cube the keys are computed in.
+  glm::vec3 box_min;
+  float box_size = 0;
+
+ private:
+  struct Node {
+    glm::vec3 center_of_mass;
+    float mass;
+    // Side of the cell.
+    float size;
+    // First child of an inner node, first particle of a leaf. The children
+    // of a node are stored next to each other, empty cells are left out.
+    int first;
+    int count;
+    bool leaf;
+  };
+  // Sorts the particles and builds the octree over them.
+  void BuildTree();
+  // Fills keys with the particles in Morton order.
+  void SortKeys();
+  // Builds the node at slot of tree over the sorted particles [begin, end),
+  // which all lie in one cell of the given depth.
+  void BuildNode(std::vector<Node>& tree, int slot, int begin, int end,
+                 int depth) const;
+  // Builds the levels above the bucket subtrees, see BuildTree.
+  void BuildTop(int slot, uint32_t prefix, int depth, int& next_slot,
+                const std::vector<std::vector<Node>>& subtrees,
+                const std::vector<int>& offsets);
+  // Collects the accepted nodes and the particles of the opened leaves for
+  // the sorted particles [begin, end). A node is accepted if it is far
+  // enough from the bounding box of the block, so from every particle.
+  void BuildInteractionList(int begin, int end, PointMasses& list) const;
+  void Integrate(float kick_dt, float drift_dt);
+  void MeasureEnergy(float velocity_dt);
+
+  NBodyTimer timer;
+
+  // Positions and masses copied for the kernels before every force pass.
+  PointMasses particleMasses;
+  InteractionKernel kernel;
+
+  std::vector<KeyIndex> keysScratch;
+  // First sorted particle of every top level cell, see SortKeys.
+  std::vector<int> bucketStart;
+  std::vector<Node> nodes;
+
+  // See NBody
+  float pending_kick_dt = 0;
+  int steps_until_energy = 0;
+  std::optional<double> initial_energy;
+  bool must_regenerate = true;
+};
@@ -0,0 +1,417 @@
+#include "DistributedNBody.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace {
+// Same as CpuNBody
+constexpr int KEY_BITS = 21;
+constexpr size_t BLOCK_SIZE = 4096;
+constexpr size_t ENERGY_BLOCK_SIZE = 64;
+// Keys every rank contributes to the choice of the splitters.
+constexpr int SAMPLES_PER_RANK = 1024;
+// The costs of the split are measured again once the slowest rank takes
+// this much longer than the average.
+constexpr float REBALANCE_THRESHOLD = 1.1f;
+
+// What every rank tells the others at the start of an evaluation.
+struct RankLoad {
+  float lo[3];
+  float hi[3];
+  int count;
+  // Force time of the previous evaluation
+  float force_ms;
+};
+
+struct KeySample {
+  uint64_t key;
+  float weight;
+};
+
+struct DomainBox {
+  float lo[3];
+  float hi[3];
+  int empty;
+};
+
+struct IndexedPosition {
+  glm::vec4 position;
+  int index;
+};
+
+float MsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<float, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+}  // namespace
+
+DistributedNBody::DistributedNBody(const SimulationSettings& s,
+                                   ITransport& transport,
+                                   unsigned thread_count)
+    : CpuNBody(s, thread_count), transport(transport) {}
+
+void DistributedNBody::RegenerateParticles() {
+  const int ranks = transport.Size();
+  const std::vector<DomainRange> ranges = SplitDomains(
+      settings.particle_count, std::vector<float>(ranks, 1.0f));
+  const DomainRange& own = ranges[transport.Rank()];
+
+  ParticleSetDescription set;
+  if (transport.Rank() == 0) {
+    // The layouts draw from one generator per process, so only one rank
+    // may use them.
+    set = settings.layout(settings.particle_count);
+    set.first.resize(settings.particle_count);
+    set.second.resize(settings.particle_count);
+    for (int r = 1; r < ranks; r++) {
+      transport.Send(r, Pack(std::vector<cl_float4>(
+                            set.first.begin() + ranges[r].begin,
+                            set.first.begin() + ranges[r].end)));
+      transport.Send(r, Pack(std::vector<ParticleData>(
+                            set.second.begin() + ranges[r].begin,
+                            set.second.begin() + ranges[r].end)));
+    }
+    set.first.resize(own.end);
+    set.second.resize(own.end);
+  } else {
+    set.first = Unpack<cl_float4>(transport.Receive(0));
+    set.second = Unpack<ParticleData>(transport.Receive(0));
+  }
+  LoadParticles(set, own.begin);
+
+  ownCount = own.size();
+  splitters.clear();
+  costs.assign(ranks, 0.0f);
+  force_ms = 0;
+}
+
+void DistributedNBody::ChangeSettings(const SimulationSettings& s) {
+  SimulationSettings fixed = s;
+  if (fixed.fixed_timestep <= 0) {
+    fixed.fixed_timestep = fixed.max_timestep;
+  }
+  CpuNBody::ChangeSettings(fixed);
+}
+
+void DistributedNBody::Calculate() {
+  // Summed over the steps like the stages of CpuNBody::Calculate
+  simulation_results.rank = transport.Rank();
+  simulation_results.ranks = transport.Size();
+  simulation_results.exchangems = 0;
+  simulation_results.migratems = 0;
+  CpuNBody::Calculate();
+  simulation_results.ownParticles = ownCount;
+}
+
+void DistributedNBody::ReadPositions(std::vector<cl_float4>& out) {
+  out.resize(settings.particle_count);
+  for (size_t i = 0; i < positions.size(); i++) {
+    if (order[i] < 0) continue;
+    cl_float4& p = out[order[i]];
+    for (int d = 0; d < 4; d++) {
+      p.s[d] = positions[i][d];
+    }
+  }
+}
+
+bool DistributedNBody::ExchangeLoad(glm::vec3& cube_min, float& cube_size) {
+  RankLoad own;
+  glm::vec3 lo(std::numeric_limits<float>::max());
+  glm::vec3 hi(-std::numeric_limits<float>::max());
+  for (const glm::vec4& p : positions) {
+    lo = glm::min(lo, glm::vec3(p));
+    hi = glm::max(hi, glm::vec3(p));
+  }
+  for (int d = 0; d < 3; d++) {
+    own.lo[d] = lo[d];
+    own.hi[d] = hi[d];
+  }
+  own.count = static_cast<int>(positions.size());
+  own.force_ms = force_ms;
+
+  std::vector<RankLoad> loads;
+  for (const std::vector<char>& message :
+       AllGather(transport, Pack(std::vector<RankLoad>{own}))) {
+    loads.push_back(Unpack<RankLoad>(message)[0]);
+  }
+
+  int total = 0;
+  float slowest = 0;
+  float sum = 0;
+  for (const RankLoad& load : loads) {
+    total += load.count;
+    slowest = std::max(slowest, load.force_ms);
+    sum += load.force_ms;
+    if (load.count > 0) {
+      for (int d = 0; d < 3; d++) {
+        lo[d] = std::min(lo[d], load.lo[d]);
+        hi[d] = std::max(hi[d], load.hi[d]);
+      }
+    }
+  }
+  if (total == 0) {
+    return false;
+  }
+
+  // Every rank sees the same loads, so they all decide the same.
+  const float mean = sum / loads.size();
+  simulation_results.loadImbalance = mean > 0 ? slowest / mean : 0;
+  if (simulation_results.loadImbalance > REBALANCE_THRESHOLD) {
+    simulation_results.rebalances++;
+    // Smoothed like MultiDeviceNBody, a single slow step should not move
+    // half of the particles. Ranks without particles keep their cost.
+    for (size_t r = 0; r < loads.size(); r++) {
+      if (loads[r].count == 0 || loads[r].force_ms <= 0) continue;
+      const float cost = loads[r].force_ms / loads[r].count;
+      costs[r] = costs[r] > 0 ? 0.5f * (costs[r] + cost) : cost;
+    }
+  }
+
+  // Same cube as CpuNBody::SortKeys
+  const glm::vec3 extent = hi - lo;
+  cube_min = lo;
+  cube_size = glm::max(glm::max(extent.x, extent.y), extent.z) * 1.0001f;
+  if (cube_size <= 0) {
+    cube_size = 1;
+  }
+  return true;
+}
+
+void DistributedNBody::UpdateSplitters(const std::vector<uint64_t>& own_keys) {
+  std::vector<KeySample> own;
+  if (!own_keys.empty()) {
+    std::vector<uint64_t> sorted = own_keys;
+    std::sort(sorted.begin(), sorted.end());
+    const size_t samples =
+        std::min(sorted.size(), static_cast<size_t>(SAMPLES_PER_RANK));
+    // Until every rank was measured all particles weigh the same.
+    const bool measured =
+        std::all_of(costs.begin(), costs.end(), [](float c) { return c > 0; });
+    const float weight = (measured ? costs[transport.Rank()] : 1.0f) *
+                         sorted.size() / static_cast<float>(samples);
+    for (size_t s = 0; s < samples; s++) {
+      own.push_back({sorted[s * sorted.size() / samples], weight});
+    }
+  }
+
+  std::vector<KeySample> samples;
+  for (const std::vector<char>& message : AllGather(transport, Pack(own))) {
+    const std::vector<KeySample> received = Unpack<KeySample>(message);
+    samples.insert(samples.end(), received.begin(), received.end());
+  }
+  std::sort(samples.begin(), samples.end(),
+            [](const KeySample& a, const KeySample& b) {
+              return a.key != b.key ? a.key < b.key : a.weight < b.weight;
+            });
+
+  double total = 0;
+  for (const KeySample& sample : samples) {
+    total += sample.weight;
+  }
+  // A rank starts at the sample where the weight before it reaches its
+  // share.
+  const int ranks = transport.Size();
+  splitters.assign(ranks - 1, std::numeric_limits<uint64_t>::max());
+  double sum = 0;
+  int next = 0;
+  for (const KeySample& sample : samples) {
+    while (next < ranks - 1 && sum >= total * (next + 1) / ranks) {
+      splitters[next++] = sample.key;
+    }
+    sum += sample.weight;
+  }
+}
+
+void DistributedNBody::Migrate(const std::vector<uint64_t>& own_keys) {
+  const int ranks = transport.Size();
+  std::vector<std::vector<Migrant>> outgoing(ranks);
+  for (size_t i = 0; i < positions.size(); i++) {
+    const int to = static_cast<int>(
+        std::upper_bound(splitters.begin(), splitters.end(), own_keys[i]) -
+        splitters.begin());
+    outgoing[to].push_back({positions[i], velocities[i], order[i]});
+  }
+  std::vector<std::vector<char>> messages(ranks);
+  for (int r = 0; r < ranks; r++) {
+    messages[r] = Pack(outgoing[r]);
+  }
+
+  std::vector<Migrant> incoming;
+  for (const std::vector<char>& message :
+       AllToAll(transport, std::move(messages))) {
+    const std::vector<Migrant> received = Unpack<Migrant>(message);
+    incoming.insert(incoming.end(), received.begin(), received.end());
+  }
+
+  std::lock_guard lock(frames);
+  const size_t n = incoming.size();
+  positions.resize(n);
+  velocities.resize(n);
+  forces.assign(n, glm::vec3(0));
+  order.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    positions[i] = incoming[i].position;
+    velocities[i] = incoming[i].velocity;
+    order[i] = incoming[i].index;
+  }
+  ownCount = static_cast<int>(n);
+}
+
+void DistributedNBody::ImportEssential() {
+  const size_t n = positions.size();
+  if (n > 0) {
+    SortParticles();
+    sortedKeys.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      sortedKeys[i] = keys[i].key;
+    }
+  }
+  tree.Build(positions, sortedKeys, {0, static_cast<int>(n)}, box_size);
+
+  DomainBox own;
+  own.empty = tree.Empty();
+  for (int d = 0; d < 3; d++) {
+    own.lo[d] = own.empty ? 0 : tree.Min()[d];
+    own.hi[d] = own.empty ? 0 : tree.Max()[d];
+  }
+  std::vector<DomainBox> boxes;
+  for (const std::vector<char>& message :
+       AllGather(transport, Pack(std::vector<DomainBox>{own}))) {
+    boxes.push_back(Unpack<DomainBox>(message)[0]);
+  }
+
+  // CpuNBody sums directly over every particle, so nothing may be
+  // approximated.
+  const bool direct_sum = settings.force_kernel == ForceKernel::DirectSum ||
+                          settings.particle_count < settings.direct_sum_below;
+  const float theta = direct_sum ? 0 : settings.distance_threshold;
+  const int ranks = transport.Size();
+  std::vector<std::vector<char>> messages(ranks);
+  for (int r = 0; r < ranks; r++) {
+    if (r == transport.Rank() || boxes[r].empty) continue;
+    std::vector<glm::vec4> essential;
+    tree.AppendEssential(
+        glm::vec3(boxes[r].lo[0], boxes[r].lo[1], boxes[r].lo[2]),
+        glm::vec3(boxes[r].hi[0], boxes[r].hi[1], boxes[r].hi[2]), theta,
+        settings.eps, essential);
+    messages[r] = Pack(essential);
+  }
+
+  std::vector<glm::vec4> imported;
+  for (const std::vector<char>& message :
+       AllToAll(transport, std::move(messages))) {
+    const std::vector<glm::vec4> received = Unpack<glm::vec4>(message);
+    imported.insert(imported.end(), received.begin(), received.end());
+  }
+  simulation_results.importedParticles = static_cast<int>(imported.size());
+
+  std::lock_guard lock(frames);
+  positions.insert(positions.end(), imported.begin(), imported.end());
+  velocities.resize(positions.size(), glm::vec3(0));
+  forces.resize(positions.size(), glm::vec3(0));
+  order.resize(positions.size(), -1);
+}
+
+void DistributedNBody::RemoveImported() {
+  std::lock_guard lock(frames);
+  size_t kept = 0;
+  for (size_t i = 0; i < positions.size(); i++) {
+    if (order[i] < 0) continue;
+    positions[kept] = positions[i];
+    velocities[kept] = velocities[i];
+    forces[kept] = forces[i];
+    order[kept] = order[i];
+    kept++;
+  }
+  positions.resize(kept);
+  velocities.resize(kept);
+  forces.resize(kept);
+  order.resize(kept);
+}
+
+void DistributedNBody::ComputeForces() {
+  glm::vec3 cube_min;
+  float cube_size;
+  if (!ExchangeLoad(cube_min, cube_size)) {
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  // The keys of CpuNBody::SortKeys, but in the cube of every rank.
+  const size_t n = positions.size();
+  std::vector<uint64_t> own_keys(n);
+  const float scale = static_cast<float>(1 << KEY_BITS) / cube_size;
+  const float max_cell = static_cast<float>((1 << KEY_BITS) - 1);
+  pool.ParallelFor(n, BLOCK_SIZE, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const glm::vec3 cell = glm::clamp(
+          (glm::vec3(positions[i]) - cube_min) * scale, 0.0f, max_cell);
+      own_keys[i] = MortonKey(static_cast<uint32_t>(cell.x),
+                              static_cast<uint32_t>(cell.y),
+                              static_cast<uint32_t>(cell.z));
+    }
+  });
+  UpdateSplitters(own_keys);
+  Migrate(own_keys);
+  simulation_results.migratems += MsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  ImportEssential();
+  simulation_results.exchangems += MsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  CpuNBody::ComputeForces();
+  force_ms = MsSince(start);
+  RemoveImported();
+}
+
+CpuNBody::EnergySums DistributedNBody::SumEnergy(float velocity_dt) {
+  std::vector<IndexedPosition> own(positions.size());
+  for (size_t i = 0; i < positions.size(); i++) {
+    own[i] = {positions[i], order[i]};
+  }
+  std::vector<IndexedPosition> all;
+  for (const std::vector<char>& message : AllGather(transport, Pack(own))) {
+    const std::vector<IndexedPosition> received =
+        Unpack<IndexedPosition>(message);
+    all.insert(all.end(), received.begin(), received.end());
+  }
+
+  // Like CpuNBody::SumEnergy, the own particles against every other.
+  const size_t n = positions.size();
+  const float eps2 = settings.eps * settings.eps;
+  std::vector<EnergySums> partial((n + ENERGY_BLOCK_SIZE - 1) /
+                                  ENERGY_BLOCK_SIZE);
+  pool.ParallelFor(n, ENERGY_BLOCK_SIZE, [&](size_t begin, size_t end) {
+    EnergySums& sums = partial[begin / ENERGY_BLOCK_SIZE];
+    for (size_t i = begin; i < end; i++) {
+      const glm::vec3 pos(positions[i]);
+      double potential = 0;
+      for (const IndexedPosition& other : all) {
+        if (other.index == order[i]) continue;
+        const glm::vec3 d = glm::vec3(other.position) - pos;
+        potential -= other.position.w / std::sqrt(glm::dot(d, d) + eps2);
+      }
+      sums.Add(KineticSums(i, velocity_dt));
+      // Every pair is counted twice
+      sums.potential +=
+          0.5 * static_cast<double>(settings.gravitational_constant) *
+          positions[i].w * potential;
+    }
+  });
+  EnergySums local;
+  for (const EnergySums& p : partial) {
+    local.Add(p);
+  }
+
+  EnergySums total;
+  for (const std::vector<char>& message :
+       AllGather(transport, Pack(std::vector<EnergySums>{local}))) {
+    total.Add(Unpack<EnergySums>(message)[0]);
+  }
+  return total;
+}
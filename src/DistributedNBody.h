@@ -0,0 +1,85 @@
+#pragma once
+
+#include <CLPreComp.h>
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "CpuNBody.h"
+#include "DomainDecomposition.h"
+#include "Transport.h"
+
+// Barnes-Hut over several ranks, for systems that do not fit into one
+// process. Every rank only holds the particles of its own domain, a
+// contiguous range of keys of the global Morton order like the domains of
+// MultiDeviceNBody. Every force evaluation
+//  - computes the keys in the bounding box of all ranks and migrates the
+//    particles that left the domain to their new owner,
+//  - builds a DomainTree over the own particles and sends every other rank
+//    its locally essential part: the top nodes as point masses and the
+//    boundary particles it cannot approximate,
+//  - calculates the forces on the own particles with CpuNBody, the imported
+//    ones only act as sources.
+// The domains are bounded by splitter keys, taken every evaluation from a
+// sample of the keys of every rank. A sampled key weighs as much as the
+// force time per particle of its rank, those costs are only measured again
+// once the slowest rank falls behind the average by REBALANCE_THRESHOLD.
+//
+// Every call is collective, all ranks have to change the settings,
+// regenerate and calculate together. Rank 0 generates the particles and
+// hands out the rest. The timestep is always fixed (max_timestep unless
+// fixed_timestep is set), so every rank takes the same steps.
+class DistributedNBody : public CpuNBody {
+ public:
+  // thread_count is per rank, see CpuNBody.
+  DistributedNBody(const SimulationSettings& s, ITransport& transport,
+                   unsigned thread_count = 0);
+
+  void RegenerateParticles() override;
+  void ChangeSettings(const SimulationSettings& s) override;
+  void Calculate() override;
+  // Resizes out to every particle but only writes the own ones, at their
+  // original index.
+  void ReadPositions(std::vector<cl_float4>& out) override;
+
+  int GetRank() const { return transport.Rank(); }
+
+ protected:
+  void ComputeForces() override;
+  EnergySums SumEnergy(float velocity_dt) override;
+
+ private:
+  // A particle on its way to another rank.
+  struct Migrant {
+    glm::vec4 position;
+    glm::vec3 velocity;
+    int index;
+  };
+
+  // Agrees on the bounding cube of every particle and on the costs of the
+  // split. False if there are no particles at all.
+  bool ExchangeLoad(glm::vec3& cube_min, float& cube_size);
+  // Chooses the splitters from the own keys and the samples of the others.
+  void UpdateSplitters(const std::vector<uint64_t>& own_keys);
+  // Sends every particle to the rank whose keys it falls into.
+  void Migrate(const std::vector<uint64_t>& own_keys);
+  // Appends the locally essential trees of the other ranks to the particles,
+  // with order -1.
+  void ImportEssential();
+  // Drops the imported particles again.
+  void RemoveImported();
+
+  ITransport& transport;
+  // Rank r owns the keys [splitters[r - 1], splitters[r]), the first and
+  // the last rank are open ended.
+  std::vector<uint64_t> splitters;
+  // Smoothed force time per particle of every rank, 0 until measured.
+  std::vector<float> costs;
+  float force_ms = 0;
+
+  DomainTree tree;
+  // The keys of CpuNBody without the indices, for DomainTree.
+  std::vector<uint64_t> sortedKeys;
+  int ownCount = 0;
+};
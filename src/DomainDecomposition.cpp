@@ -0,0 +1,160 @@
+#include "DomainDecomposition.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+constexpr int KEY_BITS = 21;
+// Leaves hold up to this many particles. They are sent whole once opened,
+// so larger leaves mean fewer nodes but more imported particles.
+constexpr int LEAF_SIZE = 16;
+// 8 children per level
+constexpr int STACK_SIZE = 8 * KEY_BITS + 8;
+
+// Spreads the low 21 bits of v out to every third bit.
+uint64_t SpreadBits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+}  // namespace
+
+uint64_t MortonKey(uint32_t x, uint32_t y, uint32_t z) {
+  return SpreadBits(x) | SpreadBits(y) << 1 | SpreadBits(z) << 2;
+}
+
+std::vector<DomainRange> SplitDomains(int count,
+                                      const std::vector<float>& weights) {
+  std::vector<DomainRange> result(weights.size());
+  double total = 0;
+  for (float w : weights) {
+    total += std::max(w, 0.0f);
+  }
+  double sum = 0;
+  int begin = 0;
+  for (size_t d = 0; d < weights.size(); d++) {
+    sum += total > 0 ? std::max(weights[d], 0.0f) : 1.0;
+    const double share = total > 0 ? sum / total : sum / weights.size();
+    int end = d + 1 == weights.size()
+                  ? count
+                  : static_cast<int>(std::lround(share * count));
+    end = std::clamp(end, begin, count);
+    result[d] = {begin, end};
+    begin = end;
+  }
+  return result;
+}
+
+void DomainTree::Build(const std::vector<glm::vec4>& positions,
+                       const std::vector<uint64_t>& keys, DomainRange range,
+                       float box_size) {
+  this->positions = &positions;
+  this->keys = &keys;
+  this->box_size = box_size;
+  nodes.clear();
+  if (range.size() <= 0) {
+    return;
+  }
+
+  box_lo = glm::vec3(positions[range.begin]);
+  box_hi = box_lo;
+  for (int i = range.begin + 1; i < range.end; i++) {
+    box_lo = glm::min(box_lo, glm::vec3(positions[i]));
+    box_hi = glm::max(box_hi, glm::vec3(positions[i]));
+  }
+  nodes.resize(1);
+  BuildNode(0, range.begin, range.end, 0);
+}
+
+void DomainTree::BuildNode(int slot, int begin, int end, int depth) {
+  Node node;
+  node.size = box_size / static_cast<float>(1 << depth);
+  node.mass = 0;
+  node.center_of_mass = glm::vec3(0);
+
+  if (end - begin <= LEAF_SIZE || depth == KEY_BITS) {
+    for (int i = begin; i < end; i++) {
+      const glm::vec4& p = (*positions)[i];
+      node.mass += p.w;
+      node.center_of_mass += glm::vec3(p) * p.w;
+    }
+    node.first = begin;
+    node.count = end - begin;
+    node.leaf = true;
+  } else {
+    // Same split as CpuNBody::BuildNode
+    const int shift = 3 * (KEY_BITS - 1 - depth);
+    int bounds[9];
+    bounds[0] = begin;
+    int children = 0;
+    for (int digit = 0; digit < 8; digit++) {
+      auto split = std::partition_point(
+          keys->begin() + bounds[digit], keys->begin() + end,
+          [&](uint64_t key) {
+            return static_cast<int>((key >> shift) & 7) <= digit;
+          });
+      bounds[digit + 1] = static_cast<int>(split - keys->begin());
+      if (bounds[digit + 1] != bounds[digit]) {
+        children++;
+      }
+    }
+
+    const int first = static_cast<int>(nodes.size());
+    nodes.resize(first + children);
+    int child = first;
+    for (int digit = 0; digit < 8; digit++) {
+      if (bounds[digit + 1] != bounds[digit]) {
+        BuildNode(child++, bounds[digit], bounds[digit + 1], depth + 1);
+      }
+    }
+    for (int c = first; c < first + children; c++) {
+      node.mass += nodes[c].mass;
+      node.center_of_mass += nodes[c].center_of_mass * nodes[c].mass;
+    }
+    node.first = first;
+    node.count = children;
+    node.leaf = false;
+  }
+  if (node.mass > 0) {
+    node.center_of_mass /= node.mass;
+  }
+  nodes[slot] = node;
+}
+
+void DomainTree::AppendEssential(const glm::vec3& lo, const glm::vec3& hi,
+                                 float theta, float eps,
+                                 std::vector<glm::vec4>& out) const {
+  if (nodes.empty()) {
+    return;
+  }
+  const float eps2 = eps * eps;
+  const float theta2 = theta * theta;
+
+  int stack[STACK_SIZE];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const Node& node = nodes[stack[--stack_size]];
+    if (node.mass <= 0) continue;
+
+    // Closest point of the box, so the node is far enough from every
+    // particle of the other domain, see CpuNBody::BuildInteractionList.
+    const glm::vec3 delta =
+        node.center_of_mass - glm::clamp(node.center_of_mass, lo, hi);
+    const float distance_squared = glm::dot(delta, delta) + eps2;
+    if (node.size * node.size < theta2 * distance_squared) {
+      out.emplace_back(node.center_of_mass, node.mass);
+    } else if (node.leaf) {
+      out.insert(out.end(), positions->begin() + node.first,
+                 positions->begin() + node.first + node.count);
+    } else {
+      for (int c = 0; c < node.count; c++) {
+        stack[stack_size++] = node.first + c;
+      }
+    }
+  }
+}
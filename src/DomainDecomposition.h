@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Host side of the domain decomposition of MultiDeviceNBody. The particles
+// are sorted by their Morton key, so every domain is a contiguous range of
+// keys and holds a compact region of space. Every domain only keeps its own
+// particles, the rest of the system reaches it as a locally essential tree:
+// the nodes of the other domains that are far enough from it as point
+// masses, and the particles of the leaves that are not.
+
+// Interleaves the low 21 bits of the cell coordinates, x in the lowest bit
+// like the child index of the octree.
+uint64_t MortonKey(uint32_t x, uint32_t y, uint32_t z);
+
+// The particles [begin, end) of the Morton order.
+struct DomainRange {
+  int begin;
+  int end;
+
+  int size() const { return end - begin; }
+};
+
+// Splits count particles into weights.size() contiguous ranges, the share of
+// every range is proportional to its weight.
+std::vector<DomainRange> SplitDomains(int count,
+                                      const std::vector<float>& weights);
+
+// Octree over the particles of one domain, built from their sorted keys like
+// CpuNBody::BuildNode. Only its nodes are exchanged, a domain is never opened
+// deeper than the others need it.
+class DomainTree {
+ public:
+  // keys are the sorted Morton keys of every particle (21 bits per axis) in
+  // the cube of side box_size. Keeps a pointer to positions.
+  void Build(const std::vector<glm::vec4>& positions,
+             const std::vector<uint64_t>& keys, DomainRange range,
+             float box_size);
+
+  // Appends what a domain with the bounding box [lo, hi] needs from this
+  // one, with the acceptance test of the Barnes-Hut traversal: a node whose
+  // side is below theta times its distance to the box is one point mass,
+  // the particles of the other leaves are appended as they are.
+  void AppendEssential(const glm::vec3& lo, const glm::vec3& hi, float theta,
+                       float eps, std::vector<glm::vec4>& out) const;
+
+  // Bounding box of the particles of the domain.
+  const glm::vec3& Min() const { return box_lo; }
+  const glm::vec3& Max() const { return box_hi; }
+  bool Empty() const { return nodes.empty(); }
+
+ private:
+  struct Node {
+    glm::vec3 center_of_mass;
+    float mass;
+    float size;
+    // First child of an inner node, first particle of a leaf.
+    int first;
+    int count;
+    bool leaf;
+  };
+
+  void BuildNode(int slot, int begin, int end, int depth);
+
+  const std::vector<glm::vec4>* positions = nullptr;
+  const std::vector<uint64_t>* keys = nullptr;
+  float box_size = 0;
+  std::vector<Node> nodes;
+  glm::vec3 box_lo;
+  glm::vec3 box_hi;
+};
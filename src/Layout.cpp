@@ -1,6 +1,8 @@
 #include "Layout.h"
 
+#ifndef NBODY_HEADLESS
 #include <imgui.h>
+#endif
 
 #include <exception>
 #include <glm/ext/matrix_transform.hpp>
@@ -148,6 +150,7 @@ LayoutResultFunction GalaxiesClashing::GetResult() const {
                                       g_center, g1_velocity, g2_velocity);
   };
 }
+#ifndef NBODY_HEADLESS
 void Galaxy::RenderAndHandleUserInput(std::optional<Galaxy> prev) {
   ImGui::InputFloat3("Galaxy center", glm::value_ptr(center));
 
@@ -286,6 +289,13 @@ void Uniform::RenderAndHandleUserInput(std::optional<Uniform> prev) {
     ImGui::EndDisabled();
   }
 }
+#else
+// The headless runner has no user interface.
+void Galaxy::RenderAndHandleUserInput(std::optional<Galaxy> prev) {}
+void GalaxiesClashing::RenderAndHandleUserInput(
+    std::optional<GalaxiesClashing> prev) {}
+void Uniform::RenderAndHandleUserInput(std::optional<Uniform> prev) {}
+#endif
 LayoutSelector::LayoutSelector() {
   data_variant = Galaxy();
   simulation_type = SimulationMode::Galaxy;
@@ -307,6 +317,7 @@ LayoutSelector::LayoutSelector(const SimulationMode &s) {
       break;
   }
 }
+#ifndef NBODY_HEADLESS
 
 template <typename T>
 std::optional<T> LayoutSelector::TryAndParse(LayoutSelector &prev,
@@ -377,6 +388,7 @@ void LayoutSelector::RenderAndHandleUserInput(LayoutSelector &prev) {
   }
   ImGui::SameLine();
 }
+#endif
 LayoutResultFunction LayoutSelector::GetResult() const {
   switch (simulation_type) {
     case SimulationMode::Galaxy:
@@ -0,0 +1,447 @@
+#include "MultiDeviceNBody.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <utility>
+
+#include "NBody.h"
+
+namespace {
+// Same as in CalculateMortonCodes
+constexpr int MORTON_BITS_PER_AXIS = 21;
+
+cl_float4 ToCL(const glm::vec4& v) {
+  cl_float4 result;
+  for (int d = 0; d < 4; d++) {
+    result.s[d] = v[d];
+  }
+  return result;
+}
+
+cl_float3 ToCL(const glm::vec3& v) {
+  cl_float3 result;
+  for (int d = 0; d < 3; d++) {
+    result.s[d] = v[d];
+  }
+  result.s[3] = 0;
+  return result;
+}
+
+float MsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<float, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+}  // namespace
+
+MultiDeviceNBody::MultiDeviceNBody(const SimulationSettings& s,
+                                   const std::vector<cl::Device>& devices,
+                                   unsigned thread_count)
+    : CpuNBody(s, thread_count), domains(devices.size()) {
+  for (size_t d = 0; d < devices.size(); d++) {
+    domains[d].device = devices[d];
+  }
+}
+
+bool MultiDeviceNBody::Init() {
+  if (domains.empty() || domains.size() > SimulationData::maxDevices) {
+    std::cout << "The domain decomposition needs 1 to "
+              << SimulationData::maxDevices << " devices" << std::endl;
+    return false;
+  }
+  try {
+    for (Domain& domain : domains) {
+      domain.context = cl::Context(std::vector<cl::Device>{domain.device});
+      domain.command_queue = cl::CommandQueue(domain.context, domain.device,
+                                              CL_QUEUE_PROFILING_ENABLE);
+    }
+  } catch (cl::Error error) {
+    std::cout << error.what() << "(" << oclErrorString(error.err()) << ")"
+              << std::endl;
+    return false;
+  }
+  trees.resize(domains.size());
+  return true;
+}
+
+void MultiDeviceNBody::ChangeSettings(const SimulationSettings& s) {
+  CpuNBody::ChangeSettings(s);
+  try {
+    BuildPrograms();
+  } catch (cl::Error error) {
+    throw CustomCLError(error);
+  }
+}
+
+void MultiDeviceNBody::BuildPrograms() {
+  for (Domain& domain : domains) {
+    domain.program =
+        BuildNBodyProgram(domain.context, {domain.device}, settings);
+    domain.createOctree = cl::Kernel(domain.program, "CreateOctree");
+    domain.initOctree = cl::Kernel(domain.program, "InitOctree");
+    domain.buildOctreeMorton = cl::Kernel(domain.program, "BuildOctreeMorton");
+    domain.centerofMass = cl::Kernel(domain.program, "CalculateCenterOfMass");
+    domain.barneshutCompact = cl::Kernel(domain.program, "BarnesHutCompact");
+
+    // The next force evaluation allocates them for the new settings.
+    domain.capacity = 0;
+    domain.allocatedNodes = 0;
+    domain.ms_per_particle = 0;
+  }
+}
+
+void MultiDeviceNBody::Clean() {
+  CpuNBody::Clean();
+  for (Domain& domain : domains) {
+    domain.capacity = 0;
+    domain.allocatedNodes = 0;
+    domain.particlepos = cl::Buffer();
+    domain.particledata = cl::Buffer();
+    domain.mortonKeys = cl::Buffer();
+    domain.mortonIndices = cl::Buffer();
+    domain.particleLeaf = cl::Buffer();
+    domain.Nodes = cl::Buffer();
+    domain.nodeCom = cl::Buffer();
+    domain.nodeInfo = cl::Buffer();
+    domain.nodeRadius = cl::Buffer();
+    domain.nodeQuadrupole = cl::Buffer();
+    domain.sources = std::vector<cl_float4>();
+    domain.keys = std::vector<cl_ulong>();
+    domain.indices = std::vector<cl_int>();
+    domain.results = std::vector<ParticleData>();
+  }
+  trees.assign(domains.size(), DomainTree());
+  sortedKeys = std::vector<uint64_t>();
+}
+
+void MultiDeviceNBody::Reserve(Domain& domain, int count) {
+  if (count <= domain.capacity) {
+    return;
+  }
+  // Grows geometrically, the imported part changes every step.
+  domain.capacity = std::max(count, domain.capacity + domain.capacity / 2);
+  // The nodes are a share of allocatedNodes like the particles are a share
+  // of particle_count, on top of the static levels.
+  const size_t static_nodes = add8powers(settings.start_depth);
+  const size_t share = static_cast<size_t>(settings.allocatedNodes) *
+                       domain.capacity /
+                       std::max(settings.particle_count, 1);
+  domain.allocatedNodes = static_cast<int>(
+      std::min<size_t>(settings.allocatedNodes, static_nodes + share));
+
+  const cl::Context& context = domain.context;
+  const size_t particles = domain.capacity;
+  const size_t nodes = domain.allocatedNodes;
+  domain.particlepos =
+      cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_float4) * particles);
+  domain.particledata =
+      cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(ParticleData) * particles);
+  domain.mortonKeys =
+      cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_ulong) * particles);
+  domain.mortonIndices =
+      cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * particles);
+  domain.particleLeaf =
+      cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * particles);
+  domain.Nodes =
+      cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(::Node) * nodes);
+  domain.nodeCom =
+      cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * nodes);
+  domain.nodeInfo =
+      cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(NodeInfo) * nodes);
+  // Only BarnesHutCompact runs here, so the radii of the fast multipole
+  // method are never read. The kernels get a single element instead.
+  domain.nodeRadius = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float));
+  domain.nodeQuadrupole = cl::Buffer(
+      context, CL_MEM_READ_WRITE,
+      sizeof(cl_float8) * (settings.quadrupole_moments ? nodes : 1));
+  if (domain.itrBuffer() == nullptr) {
+    domain.globalMinBuffer =
+        cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
+    domain.globalMaxBuffer =
+        cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
+    domain.itrBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+  }
+
+  domain.createOctree.setArg(0, domain.Nodes);
+  domain.createOctree.setArg(1, settings.start_depth);
+
+  domain.initOctree.setArg(0, domain.Nodes);
+  domain.initOctree.setArg(1, settings.start_depth);
+  domain.initOctree.setArg(2, domain.globalMinBuffer);
+  domain.initOctree.setArg(3, domain.globalMaxBuffer);
+  domain.initOctree.setArg(4, domain.itrBuffer);
+  domain.initOctree.setArg(5, domain.allocatedNodes);
+
+  domain.buildOctreeMorton.setArg(0, domain.particlepos);
+  domain.buildOctreeMorton.setArg(1, domain.mortonKeys);
+  domain.buildOctreeMorton.setArg(2, domain.mortonIndices);
+  domain.buildOctreeMorton.setArg(3, domain.Nodes);
+  domain.buildOctreeMorton.setArg(5, settings.start_depth);
+  domain.buildOctreeMorton.setArg(6, domain.itrBuffer);
+  domain.buildOctreeMorton.setArg(7, settings.max_depth);
+  domain.buildOctreeMorton.setArg(8, domain.allocatedNodes);
+  domain.buildOctreeMorton.setArg(9, domain.particleLeaf);
+
+  domain.centerofMass.setArg(0, domain.Nodes);
+  domain.centerofMass.setArg(1, domain.itrBuffer);
+  domain.centerofMass.setArg(2, domain.allocatedNodes);
+  domain.centerofMass.setArg(3, domain.nodeCom);
+  domain.centerofMass.setArg(4, domain.nodeInfo);
+  domain.centerofMass.setArg(5, domain.nodeRadius);
+  domain.centerofMass.setArg(6, domain.nodeQuadrupole);
+  domain.centerofMass.setArg(7, cl_int(0));
+  domain.centerofMass.setArg(8,
+                             static_cast<cl_int>(settings.quadrupole_moments));
+
+  domain.barneshutCompact.setArg(0, domain.particlepos);
+  domain.barneshutCompact.setArg(1, domain.particledata);
+  domain.barneshutCompact.setArg(2, domain.nodeCom);
+  domain.barneshutCompact.setArg(3, domain.nodeInfo);
+  domain.barneshutCompact.setArg(5, settings.distance_threshold);
+  domain.barneshutCompact.setArg(6, settings.eps);
+  domain.barneshutCompact.setArg(7, settings.gravitational_constant);
+  domain.barneshutCompact.setArg(8, settings.barneshut_items_per_thread);
+  domain.barneshutCompact.setArg(9, domain.nodeQuadrupole);
+
+  domain.command_queue.enqueueNDRangeKernel(
+      domain.createOctree, cl::NullRange, cl::NDRange(static_nodes),
+      cl::NullRange);
+  domain.command_queue.finish();
+}
+
+void MultiDeviceNBody::StageDomain(int d) {
+  Domain& domain = domains[d];
+  domain.sources.clear();
+  domain.keys.clear();
+  domain.indices.clear();
+  if (domain.range.size() == 0) {
+    return;
+  }
+
+  std::vector<glm::vec4> imported;
+  for (size_t other = 0; other < trees.size(); other++) {
+    if (other == static_cast<size_t>(d)) continue;
+    trees[other].AppendEssential(trees[d].Min(), trees[d].Max(),
+                                 settings.distance_threshold, settings.eps,
+                                 imported);
+  }
+
+  domain.sources.reserve(domain.range.size() + imported.size());
+  glm::vec3 lo(positions[domain.range.begin]);
+  glm::vec3 hi = lo;
+  for (int i = domain.range.begin; i < domain.range.end; i++) {
+    domain.sources.push_back(ToCL(positions[i]));
+  }
+  for (const glm::vec4& p : imported) {
+    domain.sources.push_back(ToCL(p));
+    lo = glm::min(lo, glm::vec3(p));
+    hi = glm::max(hi, glm::vec3(p));
+  }
+  lo = glm::min(lo, trees[d].Min());
+  hi = glm::max(hi, trees[d].Max());
+  domain.box_min = ToCL(lo);
+  domain.box_max = ToCL(hi);
+
+  // Same box and cells as InitOctree and CalculateMortonCodes
+  const float eps = 0.001f;
+  const glm::vec3 origin = lo - eps * 0.5f;
+  const glm::vec3 size = hi - lo + eps;
+  const float cells = static_cast<float>(1 << MORTON_BITS_PER_AXIS);
+  const int count = static_cast<int>(domain.sources.size());
+  std::vector<std::pair<cl_ulong, cl_int>> sorted(count);
+  for (int i = 0; i < count; i++) {
+    const cl_float4& p = domain.sources[i];
+    const glm::vec3 cell = glm::clamp(
+        (glm::vec3(p.s[0], p.s[1], p.s[2]) - origin) / size * cells, 0.0f,
+        cells - 1.0f);
+    sorted[i] = {MortonKey(static_cast<uint32_t>(cell.x),
+                           static_cast<uint32_t>(cell.y),
+                           static_cast<uint32_t>(cell.z)),
+                 i};
+  }
+  std::sort(sorted.begin(), sorted.end());
+  domain.keys.resize(count);
+  domain.indices.resize(count);
+  for (int i = 0; i < count; i++) {
+    domain.keys[i] = sorted[i].first;
+    domain.indices[i] = sorted[i].second;
+  }
+}
+
+void MultiDeviceNBody::EnqueueDomain(Domain& domain) {
+  const int count = static_cast<int>(domain.sources.size());
+  const int own = domain.range.size();
+  Reserve(domain, count);
+
+  cl::CommandQueue& queue = domain.command_queue;
+  queue.enqueueWriteBuffer(domain.particlepos, CL_FALSE, 0,
+                           sizeof(cl_float4) * count, domain.sources.data(),
+                           nullptr, &domain.upload[0]);
+  queue.enqueueWriteBuffer(domain.mortonKeys, CL_FALSE, 0,
+                           sizeof(cl_ulong) * count, domain.keys.data(),
+                           nullptr, &domain.upload[1]);
+  queue.enqueueWriteBuffer(domain.mortonIndices, CL_FALSE, 0,
+                           sizeof(cl_int) * count, domain.indices.data(),
+                           nullptr, &domain.upload[2]);
+  queue.enqueueWriteBuffer(domain.globalMinBuffer, CL_FALSE, 0,
+                           sizeof(cl_float3), &domain.box_min, nullptr,
+                           &domain.upload[3]);
+  queue.enqueueWriteBuffer(domain.globalMaxBuffer, CL_FALSE, 0,
+                           sizeof(cl_float3), &domain.box_max, nullptr,
+                           &domain.upload[4]);
+
+  domain.buildOctreeMorton.setArg(4, count);
+  // Only the own particles, the imported ones are just sources.
+  domain.barneshutCompact.setArg(4, own);
+
+  queue.enqueueNDRangeKernel(domain.initOctree, cl::NullRange,
+                             cl::NDRange(add8powers(settings.start_depth)),
+                             cl::NullRange, &domain.upload, &domain.init[0]);
+  queue.enqueueNDRangeKernel(
+      domain.buildOctreeMorton, cl::NullRange,
+      cl::NDRange(1uLL << (3uLL * settings.start_depth)), cl::NullRange,
+      &domain.init, &domain.build[0]);
+  queue.enqueueReadBuffer(domain.itrBuffer, CL_FALSE, 0, sizeof(cl_int),
+                          &domain.usedNodes, &domain.build,
+                          &domain.readback[0]);
+  queue.enqueueNDRangeKernel(
+      domain.centerofMass, cl::NullRange,
+      cl::NDRange(settings.center_of_mass_threads), cl::NullRange,
+      &domain.build, &domain.com[0]);
+
+  const int items = settings.barneshut_items_per_thread;
+  queue.enqueueNDRangeKernel(domain.barneshutCompact, cl::NullRange,
+                             cl::NDRange((own + items - 1) / items),
+                             cl::NullRange, &domain.com, &domain.force[0]);
+  domain.results.resize(own);
+  queue.enqueueReadBuffer(domain.particledata, CL_FALSE, 0,
+                          sizeof(ParticleData) * own, domain.results.data(),
+                          &domain.force, &domain.download[0]);
+  queue.flush();
+}
+
+void MultiDeviceNBody::FinishDomain(int d,
+                                    SimulationData::DeviceTimings& timings) {
+  Domain& domain = domains[d];
+  const int own = domain.range.size();
+  timings.particles = own;
+  timings.imported = static_cast<int>(domain.sources.size()) - own;
+  if (own == 0) {
+    timings.usedNodes = 0;
+    return;
+  }
+  domain.command_queue.finish();
+
+  timings.usedNodes = domain.usedNodes;
+  if (domain.usedNodes > domain.allocatedNodes) {
+    throw cl::Error(CL_OUT_OF_RESOURCES, "Used more nodes than allocated");
+  }
+  for (int i = 0; i < own; i++) {
+    const cl_float3& f = domain.results[i].force;
+    forces[domain.range.begin + i] = glm::vec3(f.s[0], f.s[1], f.s[2]);
+  }
+
+  float upload = 0;
+  for (cl::Event& ev : domain.upload) {
+    upload += getMSTime(ev);
+  }
+  const float build = getMSTime(domain.init[0]) + getMSTime(domain.build[0]);
+  const float com = getMSTime(domain.com[0]);
+  const float force = getMSTime(domain.force[0]);
+  timings.uploadms += upload;
+  timings.buildOctreems += build;
+  timings.centerofMassms += com;
+  timings.barneshutms += force;
+  timings.downloadms += getMSTime(domain.download[0]);
+
+  // Smoothed, a single slow step should not move half of the particles.
+  const float ms_per_particle = (build + com + force) / own;
+  domain.ms_per_particle =
+      domain.ms_per_particle > 0
+          ? 0.5f * (domain.ms_per_particle + ms_per_particle)
+          : ms_per_particle;
+}
+
+void MultiDeviceNBody::ComputeForces() {
+  const size_t n = positions.size();
+  if (n == 0) {
+    return;
+  }
+  SortParticles();
+
+  auto start = std::chrono::steady_clock::now();
+  sortedKeys.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    sortedKeys[i] = keys[i].key;
+  }
+
+  // Every device gets a share proportional to its speed. Until all of them
+  // were measured the shares are equal.
+  const int device_count = GetDeviceCount();
+  std::vector<float> weights(device_count, 1.0f);
+  bool measured = true;
+  for (const Domain& domain : domains) {
+    measured = measured && domain.ms_per_particle > 0;
+  }
+  if (measured) {
+    for (int d = 0; d < device_count; d++) {
+      weights[d] = 1.0f / domains[d].ms_per_particle;
+    }
+  }
+  const std::vector<DomainRange> ranges =
+      SplitDomains(static_cast<int>(n), weights);
+  for (int d = 0; d < device_count; d++) {
+    domains[d].range = ranges[d];
+  }
+
+  pool.ParallelFor(device_count, [&](size_t d) {
+    trees[d].Build(positions, sortedKeys, ranges[d], box_size);
+  });
+  pool.ParallelFor(device_count,
+                   [&](size_t d) { StageDomain(static_cast<int>(d)); });
+  simulation_results.exchangems += MsSince(start);
+
+  for (Domain& domain : domains) {
+    if (domain.range.size() > 0) {
+      EnqueueDomain(domain);
+    }
+  }
+
+  // The devices ran side by side, so the slowest one is what the step took.
+  float build = 0;
+  float com = 0;
+  float force = 0;
+  int used_nodes = 0;
+  int allocated_nodes = 0;
+  for (int d = 0; d < device_count; d++) {
+    SimulationData::DeviceTimings& timings = simulation_results.devices[d];
+    const SimulationData::DeviceTimings before = timings;
+    FinishDomain(d, timings);
+    build = std::max(build, timings.buildOctreems - before.buildOctreems);
+    com = std::max(com, timings.centerofMassms - before.centerofMassms);
+    force = std::max(force, timings.barneshutms - before.barneshutms);
+    used_nodes += timings.usedNodes;
+    allocated_nodes += domains[d].allocatedNodes;
+  }
+  simulation_results.buildOctreems += build;
+  simulation_results.centerofMassms += com;
+  simulation_results.barneshutms += force;
+  simulation_results.usedNodes = used_nodes;
+  simulation_results.allocatedNodes = allocated_nodes;
+}
+
+void MultiDeviceNBody::Calculate() {
+  // Summed over the steps like the stages of CpuNBody::Calculate
+  simulation_results.deviceCount = GetDeviceCount();
+  for (int d = 0; d < GetDeviceCount(); d++) {
+    simulation_results.devices[d] = SimulationData::DeviceTimings();
+  }
+  simulation_results.exchangems = 0;
+  simulation_results.centerofMassms = 0;
+  try {
+    CpuNBody::Calculate();
+  } catch (cl::Error error) {
+    throw CustomCLError(error);
+  }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <CLPreComp.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "CpuNBody.h"
+#include "DomainDecomposition.h"
+#include "ParticleDescription.h"
+
+// Barnes-Hut over several OpenCL devices, for systems that do not fit into
+// the memory of one (see GetVRAMFromSettings). The particles stay on the host
+// like in CpuNBody, which also sorts and integrates them. Every force
+// evaluation splits the Morton order into one contiguous domain per device,
+// sized by how fast every device was the last time. A device only receives
+// its own particles and the locally essential tree of the other domains,
+// builds its octree over both with BuildOctreeMorton and calculates the
+// forces on its own particles with BarnesHutCompact. The devices run
+// concurrently, each on its own context.
+//
+// Follows the settings of CpuNBody, the force kernel is always the compact
+// traversal. Sub-devices of one device (SplitCLDevice) work too.
+class MultiDeviceNBody : public CpuNBody {
+ public:
+  // At most SimulationData::maxDevices devices. thread_count is for the host
+  // side, see CpuNBody.
+  MultiDeviceNBody(const SimulationSettings& s,
+                   const std::vector<cl::Device>& devices,
+                   unsigned thread_count = 0);
+
+  // Creates a context and a command queue on every device.
+  bool Init() override;
+  void ChangeSettings(const SimulationSettings& s) override;
+  void Clean() override;
+  void Calculate() override;
+
+  int GetDeviceCount() const { return static_cast<int>(domains.size()); }
+  const cl::Device& GetDevice(int d) const { return domains[d].device; }
+
+ protected:
+  void ComputeForces() override;
+
+ private:
+  struct Domain {
+    cl::Device device;
+    cl::Context context;
+    cl::CommandQueue command_queue;
+    cl::Program program;
+
+    cl::Kernel createOctree;
+    cl::Kernel initOctree;
+    cl::Kernel buildOctreeMorton;
+    cl::Kernel centerofMass;
+    cl::Kernel barneshutCompact;
+
+    // Grown by Reserve, hold capacity particles and allocatedNodes nodes.
+    int capacity = 0;
+    int allocatedNodes = 0;
+    cl::Buffer particlepos;
+    cl::Buffer particledata;
+    cl::Buffer mortonKeys;
+    cl::Buffer mortonIndices;
+    cl::Buffer particleLeaf;
+    cl::Buffer Nodes;
+    cl::Buffer nodeCom;
+    cl::Buffer nodeInfo;
+    cl::Buffer nodeRadius;
+    cl::Buffer nodeQuadrupole;
+    cl::Buffer globalMinBuffer;
+    cl::Buffer globalMaxBuffer;
+    cl::Buffer itrBuffer;
+
+    // The own particles of this evaluation.
+    DomainRange range = {0, 0};
+    // The own particles first, then the imported ones. The keys are sorted,
+    // indices point into sources.
+    std::vector<cl_float4> sources;
+    std::vector<cl_ulong> keys;
+    std::vector<cl_int> indices;
+    cl_float3 box_min;
+    cl_float3 box_max;
+    // Read back for the own particles.
+    std::vector<ParticleData> results;
+    cl_int usedNodes = 0;
+    // Smoothed device time per own particle, the next split gives every
+    // device a share proportional to its inverse.
+    float ms_per_particle = 0;
+
+    std::vector<cl::Event> upload = std::vector<cl::Event>(5);
+    std::vector<cl::Event> init = std::vector<cl::Event>(1);
+    std::vector<cl::Event> build = std::vector<cl::Event>(1);
+    std::vector<cl::Event> readback = std::vector<cl::Event>(1);
+    std::vector<cl::Event> com = std::vector<cl::Event>(1);
+    std::vector<cl::Event> force = std::vector<cl::Event>(1);
+    std::vector<cl::Event> download = std::vector<cl::Event>(1);
+  };
+
+  // Compiles openclkernels.c on every device and drops the buffers.
+  void BuildPrograms();
+  // Grows the buffers of the domain to at least count particles.
+  void Reserve(Domain& domain, int count);
+  // Fills sources, keys and indices of the domain with its own particles
+  // and what it imports from the others. The keys are computed like
+  // CalculateMortonCodes does, in the bounding box of the sources.
+  void StageDomain(int d);
+  // Uploads the staged particles and enqueues the tree build and the forces.
+  void EnqueueDomain(Domain& domain);
+  // Waits for the domain, copies its forces and records its timings.
+  void FinishDomain(int d, SimulationData::DeviceTimings& timings);
+
+  std::vector<Domain> domains;
+  std::vector<DomainTree> trees;
+  // The keys of CpuNBody without the indices, for DomainTree.
+  std::vector<uint64_t> sortedKeys;
+};
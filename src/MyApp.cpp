@@ -278,16 +278,20 @@ void CMyApp::InitGeometry() {
   InitSkyboxGeometry();
 }
 
-void CMyApp::SetParticleCount(int count) {
+void CMyApp::SetParticleCount(int count, bool _half_precision) {
   particle_count = count;
+  half_precision = _half_precision;
+  const GLsizei stride =
+      half_precision ? 4 * sizeof(GLhalf) : sizeof(cl_float4);
+  const GLenum type = half_precision ? GL_HALF_FLOAT : GL_FLOAT;
   for (int i = 0; i < VAOs.size(); i++) {
     glBindVertexArray(VAOs[i]);
 
     // Create and bind a Vertex Buffer Object (VBOs)
     glBindBuffer(GL_ARRAY_BUFFER, VBOs[i]);
-    glBufferData(GL_ARRAY_BUFFER, count * sizeof(cl_float4), NULL,
+    glBufferData(GL_ARRAY_BUFFER, count * stride, NULL,
                  GL_STATIC_DRAW);  // Specify the layout of the vertex data
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(cl_float4),
+    glVertexAttribPointer(0, 3, type, GL_FALSE, stride,
                           reinterpret_cast<const void *>(
                               0));  // a 0. indexű attribútum hol kezdődik a
   }
@@ -41,9 +41,16 @@ class CMyApp {
   void Resize(int, int);
 
   std::array<GLuint, 2> GetVBOAddresses() const { return VBOs; }
+  // The vertex buffer drawn after the next UpdatedParticles.
+  GLuint GetNextVBO() const {
+    return VBOs[(current_VAO_ind + 1) % VAOs.size()];
+  }
   int GetParticleCount() const { return particle_count; }
+  // Whether the vertex buffers hold 4 halves per particle instead of a
+  // cl_float4, see SimulationSettings::half_precision_export.
+  bool GetHalfPrecision() const { return half_precision; }
 
-  void SetParticleCount(int _count);
+  void SetParticleCount(int _count, bool _half_precision);
   void UpdatedParticles();
 
  protected:
@@ -52,6 +59,7 @@ class CMyApp {
   // ── Data ────────────────────────────────────────────────────────────
   float m_ElapsedTimeInSec = 0.0f;
   int particle_count = 0;
+  bool half_precision = false;
   bool needstoupdate = true;
 
   // ── Camera ──────────────────────────────────────────────────────────
@@ -1,6 +1,7 @@
 #include "NBody.h"
 // #define DEBUG
 
+#ifndef NBODY_HEADLESS
 #include <GL/glew.h>
 #include <SDL2/SDL.h>
 #if defined(_WIN32)
@@ -8,7 +9,11 @@
 #elif defined(__linux__)
 #include <GL/glx.h>
 #endif
+#endif
 
+#include <algorithm>
+#include <cmath>
+#include <deque>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -17,14 +22,6 @@ bool ParticleData::operator==(const ParticleData& rhs) {
          velocity.z == rhs.velocity.z && force.x == rhs.force.x &&
          force.y == rhs.force.y && force.z == rhs.force.z;
 }
-float NBodyTimer::Tick() {
-  auto now = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<float> duration = now - prev;
-  prev = now;
-  return duration.count();
-}
-NBodyTimer::NBodyTimer() : prev(std::chrono::high_resolution_clock::now()) {}
-
 constexpr size_t global_work_size_from_item_per_thread(
     const size_t total_work_size, const size_t items_per_thread) {
   return (total_work_size + items_per_thread - 1) / items_per_thread;
@@ -54,11 +51,7 @@ std::ostream& operator<<(std::ostream& os, const Node& n) {
      << " " << n.center_of_mass.z << std::endl;
   os << "Mass: " << n.center_of_mass.w << std::endl;
   os << "Region size: " << n.region_size << std::endl;
-  os << "Children: [ ";
-  for (int i = 0; i < 8; i++) {
-    os << n.children[i] << " ";
-  }
-  os << "]" << std::endl;
+  os << "First child: " << n.first_child << std::endl;
   os << "Type: ";
   switch (n.isLeaf) {
     case 2:
@@ -83,30 +76,76 @@ std::ostream& operator<<(std::ostream& os, const Node& n) {
 
 using namespace cl;
 
-NBody::NBody(const SimulationSettings& s) : settings(s) {}
+cl::Program BuildNBodyProgram(const cl::Context& context,
+                              const std::vector<cl::Device>& devices,
+                              const SimulationSettings& settings) {
+  // Read source file
+  std::ifstream sourceFile("openclkernels.c");
+  std::string sourceCode(std::istreambuf_iterator<char>(sourceFile),
+                         (std::istreambuf_iterator<char>()));
+
+  cl::Program::Sources source;
+  source.push_back({sourceCode.c_str(), sourceCode.length()});
+
+  // Make program of the source code in the context
+  std::stringstream buildOptions;
+  buildOptions << "-D BARNESHUT_STACK_SIZE=" << settings.barneshut_stack_size
+               << " -D BUILD_OCTREE_STACK_SIZE="
+               << settings.build_octree_stack_size
+               << " -D BOUNDINGBOX_WORK_GROUP_SIZE="
+               << settings.boundingbox_work_group_size
+               << " -D RADIX_SORT_WORK_GROUP_SIZE="
+               << settings.radix_sort_work_group_size
+               << " -D BARNESHUT_GROUP_SIZE=" << settings.barneshut_group_size
+               << " -D BARNESHUT_GROUP_STACK_SIZE="
+               << settings.BarnesHutGroupStackSize()
+               << " -D DIRECT_SUM_TILE_SIZE=" << settings.direct_sum_tile_size
+               << " -D FMM_ORDER=" << settings.fmm_order
+               << " -D FMM_LIST_SIZE=" << settings.fmm_list_size;
+  if (settings.quadrupole_moments) {
+    buildOptions << " -D QUADRUPOLE_MOMENTS";
+  }
+  if (settings.half_precision_export) {
+    buildOptions << " -D HALF_PRECISION_EXPORT";
+  }
+
+  cl::Program program(context, source);
+  try {
+    program.build(devices, buildOptions.str().c_str());
+  } catch (cl::Error error) {
+    throw CustomCLError(
+        error, program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]));
+  }
+  return program;
+}
+
+NBody::NBody(const SimulationSettings& s, const CLDeviceSelection& target)
+    : settings(s), target(target) {}
 
-bool NBody::InitCL(const std::array<GLuint, 2>& VBOIndex) {
+bool NBody::Init() {
   try {
     ///////////////////////////
     // Initialize OpenCL API //
     ///////////////////////////
 
+    const std::vector<CLDeviceDescription> candidates =
+        CandidateCLDevices(target.platform, target.device);
+    if (candidates.empty())
+      throw cl::Error(CL_DEVICE_NOT_FOUND, "No such OpenCL device");
+
     std::vector<cl::Platform> platforms;
     Platform::get(&platforms);
 
-    // Try to get the sharing platform!
-    bool create_context_success = false;
-    for (auto platform : platforms) {
-      // cl_context_properties contextProperties[] = {
-      //     CL_CONTEXT_PLATFORM,
-      //     (cl_context_properties)(platform)(),
-      //     CL_GL_CONTEXT_KHR,
-      //     (cl_context_properties)SDL_GL_GetCurrentContext(),
-      //     0};
+    gl_shared = false;
+#ifndef NBODY_HEADLESS
+    // Try to get the sharing device!
+    for (const CLDeviceDescription& candidate : candidates) {
+      if (!target.share_gl) break;
+      if (!candidate.gl_sharing) continue;
 
       cl_context_properties contextProperties[] = {
         CL_CONTEXT_PLATFORM,
-        (cl_context_properties)(platform)(),
+        (cl_context_properties)(platforms[candidate.platform])(),
         CL_GL_CONTEXT_KHR,
         (cl_context_properties)SDL_GL_GetCurrentContext(),
 #if defined(_WIN32)
@@ -122,27 +161,31 @@ bool NBody::InitCL(const std::array<GLuint, 2>& VBOIndex) {
         0
       };
 
-      // Create Context
+      // Create Context, fails if the device does not drive the OpenGL
+      // context.
       try {
-        context = cl::Context(CL_DEVICE_TYPE_GPU, contextProperties);
-        create_context_success = true;
+        devices = {GetCLDevice(candidate)};
+        context = cl::Context(devices, contextProperties);
+        gl_shared = true;
         break;
       } catch (Error error) {
         oclPrintError(error);
       }
     }
-
-    if (!create_context_success)
-      throw cl::Error(CL_INVALID_CONTEXT,
-                      "Failed to create CL/GL shared context");
+    if (target.share_gl && !gl_shared) {
+      std::cout << "No OpenCL device shares the OpenGL context, the positions "
+                   "are copied through the host"
+                << std::endl;
+    }
+#endif
+    if (!gl_shared) {
+      devices = {GetCLDevice(candidates[0])};
+      context = cl::Context(devices);
+    }
 
     // Create Command Queue
-
-    devices = context.getInfo<CL_CONTEXT_DEVICES>();
     command_queue =
         cl::CommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE);
-    copy_command_queue = cl::CommandQueue(context, devices[0]);
-    VBOs = VBOIndex;
   } catch (cl::Error error) {
     std::cout << error.what() << "(" << oclErrorString(error.err()) << ")"
               << std::endl;
@@ -152,55 +195,46 @@ bool NBody::InitCL(const std::array<GLuint, 2>& VBOIndex) {
   return true;
 }
 
+
 void NBody::ChangeSettings(const SimulationSettings& s) {
-  static bool must_reset_all = true;
   try {
     bool recreate_buffers =
         must_reset_all || settings.allocatedNodes != s.allocatedNodes ||
         settings.particle_count != s.particle_count ||
-        settings.boundingbox_work_group_size != s.boundingbox_work_group_size;
+        settings.boundingbox_work_group_size != s.boundingbox_work_group_size ||
+        settings.direct_sum_tile_size != s.direct_sum_tile_size;
     bool recompile_program =
         must_reset_all ||
         settings.barneshut_stack_size != s.barneshut_stack_size ||
         settings.build_octree_stack_size != s.build_octree_stack_size ||
-        settings.boundingbox_work_group_size != s.boundingbox_work_group_size;
+        settings.boundingbox_work_group_size != s.boundingbox_work_group_size ||
+        settings.radix_sort_work_group_size != s.radix_sort_work_group_size ||
+        settings.barneshut_group_size != s.barneshut_group_size ||
+        settings.max_depth != s.max_depth ||
+        settings.fmm_order != s.fmm_order ||
+        settings.fmm_list_size != s.fmm_list_size ||
+        settings.quadrupole_moments != s.quadrupole_moments ||
+        settings.direct_sum_tile_size != s.direct_sum_tile_size ||
+        settings.half_precision_export != s.half_precision_export;
     bool requires_restart =
         recreate_buffers || recompile_program || s.layoutchanged;
     if (must_reset_all) {
       must_reset_all = false;
     }
 
+    // The renderer copies with the kernels and buffers replaced here.
+    std::unique_lock frames_lock(frames);
     settings = s;
+    // G and eps change the energy, measure it again from here
+    initial_energy.reset();
+    block_forces_current = false;
 
     if (recompile_program) {
       /////////////////////////////////
       // Load, then build the kernel //
       /////////////////////////////////
 
-      // Read source file
-      std::ifstream sourceFile("openclkernels.c");
-      std::string sourceCode(std::istreambuf_iterator<char>(sourceFile),
-                             (std::istreambuf_iterator<char>()));
-
-      cl::Program::Sources source;
-      source.push_back({sourceCode.c_str(), sourceCode.length()});
-
-      // Make program of the source code in the context
-      std::stringstream buildOptions;
-      buildOptions << "-D BARNESHUT_STACK_SIZE="
-                   << settings.barneshut_stack_size
-                   << " -D BUILD_OCTREE_STACK_SIZE="
-                   << settings.build_octree_stack_size
-                   << " -D BOUNDINGBOX_WORK_GROUP_SIZE="
-                   << settings.boundingbox_work_group_size;
-
-      program = cl::Program(context, source);
-      try {
-        program.build(devices, buildOptions.str().c_str());
-      } catch (cl::Error error) {
-        throw CustomCLError(
-            error, program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]));
-      }
+      program = BuildNBodyProgram(context, devices, settings);
 
       // Make kernel
       boundingbox = cl::Kernel(program, "BoundingBoxStage1");
@@ -208,26 +242,88 @@ void NBody::ChangeSettings(const SimulationSettings& s) {
       createOctree = cl::Kernel(program, "CreateOctree");
       initOctree = cl::Kernel(program, "InitOctree");
       buildOctree = cl::Kernel(program, "BuildOctree");
-      DivideByMass = cl::Kernel(program, "DivideCentersByMass");
+      mortonCodes = cl::Kernel(program, "CalculateMortonCodes");
+      radixSortHistogram = cl::Kernel(program, "RadixSortHistogram");
+      radixSortScan = cl::Kernel(program, "RadixSortScan");
+      radixSortScatter = cl::Kernel(program, "RadixSortScatter");
+      buildOctreeMorton = cl::Kernel(program, "BuildOctreeMorton");
+      reorderParticles = cl::Kernel(program, "ReorderParticles");
+      unpermutePositions = cl::Kernel(program, "UnpermutePositions");
+      exportPositions = cl::Kernel(program, "ExportPositions");
       centerofMass = cl::Kernel(program, "CalculateCenterOfMass");
       barneshut = cl::Kernel(program, "BarnesHut");
+      barneshutCompact = cl::Kernel(program, "BarnesHutCompact");
+      threadOctree = cl::Kernel(program, "ThreadOctree");
+      barneshutStackless = cl::Kernel(program, "BarnesHutStackless");
+      barneshutGroup = cl::Kernel(program, "BarnesHutGroup");
+      fmmInteractions = cl::Kernel(program, "FmmInteractions");
+      fmmEvaluate = cl::Kernel(program, "FmmEvaluate");
+      directSum = cl::Kernel(program, "DirectSum");
+      energyDiagnostic = cl::Kernel(program, "EnergyDiagnostic");
+      barneshutActive = cl::Kernel(program, "BarnesHutActive");
+      assignRungs = cl::Kernel(program, "AssignRungs");
+      compactActive = cl::Kernel(program, "CompactActive");
+      kickActive = cl::Kernel(program, "KickActive");
       positionupdate = cl::Kernel(program, "AddForces");
     }
     if (recreate_buffers) {
-      std::lock_guard lock(m_writing_mutex);
       // Clear the buffers.
       Nodes = cl::Buffer();
+      nodeCom = cl::Buffer();
+      nodeInfo = cl::Buffer();
+      nodeNext = cl::Buffer();
+      nodeRadius = cl::Buffer();
+      nodeQuadrupole = cl::Buffer();
+      nodeLocals = cl::Buffer();
+      particleLeaf = cl::Buffer();
+      unpermutedPositions = cl::Buffer();
+      overflowBuffer = cl::Buffer();
+      energyPartials = cl::Buffer();
+      particleRung = cl::Buffer();
+      activeIndices = cl::Buffer();
+      activeCountBuffer = cl::Buffer();
+      deepestRungBuffer = cl::Buffer();
       particledata = cl::Buffer();
       particlepos = cl::Buffer();
       minValuesBuffer = cl::Buffer();
       maxValuesBuffer = cl::Buffer();
+      mortonKeys = std::array<cl::Buffer, 2>();
+      mortonIndices = std::array<cl::Buffer, 2>();
+      radixHistogram = cl::Buffer();
+      particleposScratch = cl::Buffer();
+      particledataScratch = cl::Buffer();
+      particleOrder = std::array<cl::Buffer, 2>();
 
       globalMinBuffer = cl::Buffer();
       globalMaxBuffer = cl::Buffer();
       itrBuffer = cl::Buffer();
-      openGLparticlepos = std::array<cl::BufferGL, 2>();
+      interactionsBuffer = cl::Buffer();
+      abortedBuffer = cl::Buffer();
       Nodes = cl::Buffer(context, CL_MEM_READ_WRITE,
                          sizeof(Node) * settings.allocatedNodes);
+      nodeCom = cl::Buffer(context, CL_MEM_READ_WRITE,
+                           sizeof(cl_float4) * settings.allocatedNodes);
+      nodeInfo = cl::Buffer(context, CL_MEM_READ_WRITE,
+                            sizeof(NodeInfo) * settings.allocatedNodes);
+      particleLeaf = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                sizeof(cl_int) * settings.particle_count);
+      unpermutedPositions =
+          cl::Buffer(context, CL_MEM_WRITE_ONLY,
+                     sizeof(cl_float4) * settings.particle_count);
+      overflowBuffer =
+          cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+      energyPartials = cl::Buffer(
+          context, CL_MEM_READ_WRITE,
+          sizeof(cl_float8) *
+              (settings.particle_count / settings.direct_sum_tile_size + 1));
+      particleRung = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                sizeof(cl_int) * settings.particle_count);
+      activeIndices = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                 sizeof(cl_int) * settings.particle_count);
+      activeCountBuffer =
+          cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+      deepestRungBuffer =
+          cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
       particledata = cl::Buffer(context, CL_MEM_READ_WRITE,
                                 sizeof(ParticleData) * settings.particle_count);
 
@@ -241,17 +337,36 @@ void NBody::ChangeSettings(const SimulationSettings& s) {
       maxValuesBuffer = cl::Buffer(
           context, CL_MEM_READ_WRITE,
           sizeof(cl_float3) * settings.boundingbox_work_group_size, NULL);
+      for (size_t i = 0; i < mortonKeys.size(); i++) {
+        mortonKeys[i] = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                   sizeof(cl_ulong) * settings.particle_count);
+        mortonIndices[i] = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                      sizeof(cl_int) * settings.particle_count);
+      }
+      radixHistogram = cl::Buffer(
+          context, CL_MEM_READ_WRITE,
+          sizeof(cl_int) * RADIX_SORT_BUCKETS * RADIX_SORT_MAX_WORK_GROUPS);
+      particleposScratch =
+          cl::Buffer(context, CL_MEM_READ_WRITE,
+                     sizeof(cl_float4) * settings.particle_count);
+      particledataScratch =
+          cl::Buffer(context, CL_MEM_READ_WRITE,
+                     sizeof(ParticleData) * settings.particle_count);
+      for (size_t i = 0; i < particleOrder.size(); i++) {
+        particleOrder[i] = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                      sizeof(cl_int) * settings.particle_count);
+      }
       // This generates the large buffers
       globalMinBuffer =
           cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float3));
       globalMaxBuffer =
           cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float3));
       itrBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
-      for (int i = 0; i < VBOs.size(); i++) {
-        openGLparticlepos[i] =
-            cl::BufferGL(context, CL_MEM_WRITE_ONLY, VBOs[i]);
-      }
+      interactionsBuffer =
+          cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * 2);
+      abortedBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
     }
+    AllocateOptionalNodeBuffers(recreate_buffers);
 
     boundingbox.setArg(0, particlepos);
     boundingbox.setArg(1, minValuesBuffer);
@@ -282,13 +397,61 @@ void NBody::ChangeSettings(const SimulationSettings& s) {
     buildOctree.setArg(6, itrBuffer);
     buildOctree.setArg(7, (settings.min_enter_depth - settings.start_depth));
     buildOctree.setArg(8, (settings.max_depth - settings.start_depth));
-
-    DivideByMass.setArg(0, Nodes);
-    DivideByMass.setArg(1, itrBuffer);
+    buildOctree.setArg(9, particleLeaf);
+
+    mortonCodes.setArg(0, particlepos);
+    mortonCodes.setArg(1, mortonKeys[0]);
+    mortonCodes.setArg(2, mortonIndices[0]);
+    mortonCodes.setArg(3, globalMinBuffer);
+    mortonCodes.setArg(4, globalMaxBuffer);
+    mortonCodes.setArg(5, settings.particle_count);
+
+    radixSortHistogram.setArg(1, radixHistogram);
+    radixSortHistogram.setArg(2, settings.particle_count);
+
+    radixSortScan.setArg(0, radixHistogram);
+
+    radixSortScatter.setArg(4, radixHistogram);
+    radixSortScatter.setArg(5, settings.particle_count);
+
+    buildOctreeMorton.setArg(0, particlepos);
+    buildOctreeMorton.setArg(1, mortonKeys[0]);
+    buildOctreeMorton.setArg(2, mortonIndices[0]);
+    buildOctreeMorton.setArg(3, Nodes);
+    buildOctreeMorton.setArg(4, settings.particle_count);
+    buildOctreeMorton.setArg(5, settings.start_depth);
+    buildOctreeMorton.setArg(6, itrBuffer);
+    buildOctreeMorton.setArg(7, settings.max_depth);
+    buildOctreeMorton.setArg(8, settings.allocatedNodes);
+    buildOctreeMorton.setArg(9, particleLeaf);
+
+    reorderParticles.setArg(0, particlepos);
+    reorderParticles.setArg(1, particledata);
+    reorderParticles.setArg(2, particleOrder[0]);
+    reorderParticles.setArg(3, mortonIndices[0]);
+    reorderParticles.setArg(4, particleposScratch);
+    reorderParticles.setArg(5, particledataScratch);
+    reorderParticles.setArg(6, particleOrder[1]);
+    reorderParticles.setArg(7, settings.particle_count);
+
+    unpermutePositions.setArg(0, particlepos);
+    unpermutePositions.setArg(1, particleOrder[0]);
+    unpermutePositions.setArg(3, settings.particle_count);
+
+    exportPositions.setArg(0, particlepos);
+    exportPositions.setArg(1, particleOrder[0]);
+    exportPositions.setArg(3, settings.particle_count);
 
     centerofMass.setArg(0, Nodes);
-    centerofMass.setArg(1, settings.start_depth);
-    centerofMass.setArg(2, itrBuffer);
+    centerofMass.setArg(1, itrBuffer);
+    centerofMass.setArg(2, settings.allocatedNodes);
+    centerofMass.setArg(3, nodeCom);
+    centerofMass.setArg(4, nodeInfo);
+    centerofMass.setArg(5, nodeRadius);
+    centerofMass.setArg(6, nodeQuadrupole);
+    centerofMass.setArg(7, static_cast<cl_int>(settings.NeedsFmmNodes()));
+    centerofMass.setArg(
+        8, static_cast<cl_int>(settings.NeedsNodeQuadrupoles()));
 
     barneshut.setArg(0, particlepos);
     barneshut.setArg(1, particledata);
@@ -298,16 +461,143 @@ void NBody::ChangeSettings(const SimulationSettings& s) {
     barneshut.setArg(5, settings.eps);
     barneshut.setArg(6, settings.gravitational_constant);
     barneshut.setArg(7, settings.barneshut_items_per_thread);
+    barneshut.setArg(8, nodeQuadrupole);
+
+    barneshutCompact.setArg(0, particlepos);
+    barneshutCompact.setArg(1, particledata);
+    barneshutCompact.setArg(2, nodeCom);
+    barneshutCompact.setArg(3, nodeInfo);
+    barneshutCompact.setArg(4, settings.particle_count);
+    barneshutCompact.setArg(5, settings.distance_threshold);
+    barneshutCompact.setArg(6, settings.eps);
+    barneshutCompact.setArg(7, settings.gravitational_constant);
+    barneshutCompact.setArg(8, settings.barneshut_items_per_thread);
+    barneshutCompact.setArg(9, nodeQuadrupole);
+
+    threadOctree.setArg(0, Nodes);
+    threadOctree.setArg(1, itrBuffer);
+    threadOctree.setArg(2, settings.allocatedNodes);
+    threadOctree.setArg(3, nodeNext);
+
+    barneshutStackless.setArg(0, particlepos);
+    barneshutStackless.setArg(1, particledata);
+    barneshutStackless.setArg(2, nodeCom);
+    barneshutStackless.setArg(3, nodeInfo);
+    barneshutStackless.setArg(4, nodeNext);
+    barneshutStackless.setArg(5, settings.particle_count);
+    barneshutStackless.setArg(6, settings.distance_threshold);
+    barneshutStackless.setArg(7, settings.eps);
+    barneshutStackless.setArg(8, settings.gravitational_constant);
+    barneshutStackless.setArg(9, settings.barneshut_items_per_thread);
+    barneshutStackless.setArg(10, nodeQuadrupole);
+
+    barneshutGroup.setArg(0, particlepos);
+    barneshutGroup.setArg(1, particledata);
+    barneshutGroup.setArg(2, nodeCom);
+    barneshutGroup.setArg(3, nodeInfo);
+    barneshutGroup.setArg(4, settings.particle_count);
+    barneshutGroup.setArg(5, settings.distance_threshold);
+    barneshutGroup.setArg(6, settings.eps);
+    barneshutGroup.setArg(7, settings.gravitational_constant);
+    barneshutGroup.setArg(8, interactionsBuffer);
+    barneshutGroup.setArg(9, nodeQuadrupole);
+    barneshutGroup.setArg(10, overflowBuffer);
+
+    fmmInteractions.setArg(0, Nodes);
+    fmmInteractions.setArg(1, nodeCom);
+    fmmInteractions.setArg(2, nodeInfo);
+    fmmInteractions.setArg(3, nodeRadius);
+    fmmInteractions.setArg(4, nodeQuadrupole);
+    fmmInteractions.setArg(5, itrBuffer);
+    fmmInteractions.setArg(6, settings.allocatedNodes);
+    fmmInteractions.setArg(7, nodeLocals);
+    fmmInteractions.setArg(8, settings.fmm_theta);
+    fmmInteractions.setArg(9, settings.eps);
+    fmmInteractions.setArg(10, settings.gravitational_constant);
+    fmmInteractions.setArg(11, overflowBuffer);
+
+    fmmEvaluate.setArg(0, particlepos);
+    fmmEvaluate.setArg(1, particledata);
+    fmmEvaluate.setArg(2, particleLeaf);
+    fmmEvaluate.setArg(3, Nodes);
+    fmmEvaluate.setArg(4, nodeCom);
+    fmmEvaluate.setArg(5, nodeLocals);
+    fmmEvaluate.setArg(6, settings.particle_count);
+
+    directSum.setArg(0, particlepos);
+    directSum.setArg(1, particledata);
+    directSum.setArg(2, settings.particle_count);
+    directSum.setArg(3, settings.eps);
+    directSum.setArg(4, settings.gravitational_constant);
+
+    energyDiagnostic.setArg(0, particlepos);
+    energyDiagnostic.setArg(1, particledata);
+    energyDiagnostic.setArg(2, settings.particle_count);
+    energyDiagnostic.setArg(3, settings.eps);
+    energyDiagnostic.setArg(4, settings.gravitational_constant);
+    energyDiagnostic.setArg(5, 0.0f);
+    energyDiagnostic.setArg(6, energyPartials);
+
+    barneshutActive.setArg(0, particlepos);
+    barneshutActive.setArg(1, particledata);
+    barneshutActive.setArg(2, nodeCom);
+    barneshutActive.setArg(3, nodeInfo);
+    barneshutActive.setArg(4, activeIndices);
+    barneshutActive.setArg(5, activeCountBuffer);
+    barneshutActive.setArg(6, settings.distance_threshold);
+    barneshutActive.setArg(7, settings.eps);
+    barneshutActive.setArg(8, settings.gravitational_constant);
+    barneshutActive.setArg(9, settings.barneshut_items_per_thread);
+    barneshutActive.setArg(10, nodeQuadrupole);
+
+    assignRungs.setArg(0, particlepos);
+    assignRungs.setArg(1, particledata);
+    assignRungs.setArg(2, particleOrder[0]);
+    assignRungs.setArg(3, particleRung);
+    assignRungs.setArg(4, settings.particle_count);
+    assignRungs.setArg(5, settings.max_timestep);
+    assignRungs.setArg(6, settings.timestep_accuracy);
+    assignRungs.setArg(7, settings.eps);
+    assignRungs.setArg(8, settings.max_rung);
+    assignRungs.setArg(9, 0.0f);
+    assignRungs.setArg(10, deepestRungBuffer);
+
+    compactActive.setArg(0, particleOrder[0]);
+    compactActive.setArg(1, particleRung);
+    compactActive.setArg(2, settings.particle_count);
+    compactActive.setArg(3, 0);
+    compactActive.setArg(4, activeIndices);
+    compactActive.setArg(5, activeCountBuffer);
+
+    kickActive.setArg(0, particlepos);
+    kickActive.setArg(1, particledata);
+    kickActive.setArg(2, particleOrder[0]);
+    kickActive.setArg(3, particleRung);
+    kickActive.setArg(4, activeIndices);
+    kickActive.setArg(5, activeCountBuffer);
+    kickActive.setArg(6, settings.max_timestep);
+    kickActive.setArg(7, 0);
 
     positionupdate.setArg(0, particlepos);
     positionupdate.setArg(1, particledata);
     positionupdate.setArg(2, settings.particle_count);
     positionupdate.setArg(3, settings.position_update_items_per_thread);
-    positionupdate.setArg(4, settings.max_timestep);
+    // The step times are set by ReserveStepTimes
+    positionupdate.setArg(5, 0);
+    positionupdate.setArg(6, particleOrder[0]);
+    // Calculate sets the render copy, until then it is never written.
+    positionupdate.setArg(7, cl::Buffer());
+    positionupdate.setArg(8, -1);
+    positionupdate.setArg(9, itrBuffer);
+    positionupdate.setArg(10, settings.allocatedNodes);
+    positionupdate.setArg(11, overflowBuffer);
+    positionupdate.setArg(12, abortedBuffer);
 
-    command_queue.enqueueNDRangeKernel(createOctree, cl::NullRange,
-                                       cl::NDRange(1), cl::NDRange(1));
+    command_queue.enqueueNDRangeKernel(
+        createOctree, cl::NullRange,
+        cl::NDRange(add8powers(settings.start_depth)), cl::NullRange);
     command_queue.finish();
+    frames_lock.unlock();
     if (requires_restart) {
       RegenerateParticles();
     }
@@ -320,16 +610,25 @@ void NBody::ChangeSettings(const SimulationSettings& s) {
   }
 }
 
-// Initialise OpenCL, attach OpenGL Buffers
-
-constexpr size_t add8powers(const size_t exp) {
-  size_t res = 0;
-  for (size_t i = 0; i <= exp; i++) {
-    res += 1uLL << (3uLL * i);
-  }
-  return res;
+void NBody::AllocateOptionalNodeBuffers(bool reallocate) {
+  const auto allocate = [&](cl::Buffer& buffer, bool needed,
+                            size_t element_size) {
+    const size_t size = element_size * (needed ? settings.allocatedNodes : 1);
+    if (!reallocate && buffer() && buffer.getInfo<CL_MEM_SIZE>() == size) {
+      return;
+    }
+    // Released before the new one is allocated.
+    buffer = cl::Buffer();
+    buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+  };
+  allocate(nodeNext, settings.NeedsNodeNext(), sizeof(cl_int));
+  allocate(nodeRadius, settings.NeedsFmmNodes(), sizeof(cl_float));
+  allocate(nodeLocals, settings.NeedsFmmNodes(), sizeof(LocalExpansion));
+  allocate(nodeQuadrupole, settings.NeedsNodeQuadrupoles(), sizeof(cl_float8));
 }
 
+// Initialise OpenCL, attach OpenGL Buffers
+
 void NBody::doTesting() {
   std::ofstream File("test.txt");
   std::vector<Node> nodes(settings.allocatedNodes);
@@ -389,116 +688,633 @@ void NBody::doTesting() {
   }
 }
 
-inline float getMSTime(cl::Event& ev) {
-  cl_ulong start, end;
-  ev.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
-  ev.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
-  return (float)((end - start) / 1e+06);
+void NBody::EnqueueMortonSort(const std::vector<cl::Event>* wait,
+                              cl::Event* codes_event,
+                              std::vector<cl::Event>& sort_events) {
+  static constexpr int key_bits = 63;
+  static constexpr int bits_per_axis = key_bits / 3;
+  static constexpr int radix_bits = 4;
+
+  const size_t work_group_size = settings.radix_sort_work_group_size;
+  command_queue.enqueueNDRangeKernel(
+      mortonCodes, cl::NullRange,
+      cl::NDRange(global_work_size_from_work_groups(settings.particle_count,
+                                                    work_group_size)),
+      cl::NDRange(work_group_size), wait, codes_event);
+
+  // Only the levels the octree can reach have to be sorted. The number of
+  // passes is kept even so that the result lands back in the first buffer.
+  const int levels = std::min<int>(settings.max_depth, bits_per_axis);
+  int low_bit = (key_bits - 3 * levels) / radix_bits * radix_bits;
+  int passes = (key_bits - low_bit + radix_bits - 1) / radix_bits;
+  if (passes % 2 != 0) {
+    low_bit -= radix_bits;
+    passes++;
+  }
+
+  const size_t groups = std::min<size_t>(
+      RADIX_SORT_MAX_WORK_GROUPS,
+      global_work_size_from_item_per_thread(settings.particle_count,
+                                            work_group_size));
+  radixSortScan.setArg(1, static_cast<cl_int>(RADIX_SORT_BUCKETS * groups));
+
+  sort_events.clear();
+  sort_events.reserve(passes * 3);
+  std::vector<cl::Event> prev = {*codes_event};
+  for (int pass = 0; pass < passes; pass++) {
+    const int src = pass % 2;
+    const int dst = 1 - src;
+    const cl_int shift = low_bit + pass * radix_bits;
+
+    radixSortHistogram.setArg(0, mortonKeys[src]);
+    radixSortHistogram.setArg(3, shift);
+
+    radixSortScatter.setArg(0, mortonKeys[src]);
+    radixSortScatter.setArg(1, mortonIndices[src]);
+    radixSortScatter.setArg(2, mortonKeys[dst]);
+    radixSortScatter.setArg(3, mortonIndices[dst]);
+    radixSortScatter.setArg(6, shift);
+
+    sort_events.emplace_back();
+    command_queue.enqueueNDRangeKernel(
+        radixSortHistogram, cl::NullRange,
+        cl::NDRange(groups * work_group_size), cl::NDRange(work_group_size),
+        &prev, &sort_events.back());
+    prev = {sort_events.back()};
+
+    sort_events.emplace_back();
+    command_queue.enqueueNDRangeKernel(
+        radixSortScan, cl::NullRange, cl::NDRange(work_group_size),
+        cl::NDRange(work_group_size), &prev, &sort_events.back());
+    prev = {sort_events.back()};
+
+    sort_events.emplace_back();
+    command_queue.enqueueNDRangeKernel(
+        radixSortScatter, cl::NullRange,
+        cl::NDRange(groups * work_group_size), cl::NDRange(work_group_size),
+        &prev, &sort_events.back());
+    prev = {sort_events.back()};
+  }
 }
 
-void NBody::Calculate() {
-  std::vector<cl::Event> ev1(1);
-  std::vector<cl::Event> ev2(1);
-  std::vector<cl::Event> ev3(1);
-  std::vector<cl::Event> ev4(1);
-  std::vector<cl::Event> ev51(1);
-  std::vector<cl::Event> ev5(1);
-  std::vector<cl::Event> ev6(1);
-  std::vector<cl::Event> ev7(1);
-  std::vector<cl::Event> evread(1);
-  float truedt;
-  try {
+void NBody::ReorderParticles(const std::vector<cl::Event>& wait,
+                             std::vector<cl::Event>& reorder_events) {
+  reorder_events.resize(4);
+  command_queue.enqueueNDRangeKernel(
+      reorderParticles, cl::NullRange, cl::NDRange(settings.particle_count),
+      cl::NullRange, &wait, &reorder_events[0]);
+
+  // The copy back is what the renderer can observe.
+  HoldFrames();
+  std::vector<cl::Event> gathered = {reorder_events[0]};
+  command_queue.enqueueCopyBuffer(particleposScratch, particlepos, 0, 0,
+                                  sizeof(cl_float4) * settings.particle_count,
+                                  &gathered, &reorder_events[1]);
+  command_queue.enqueueCopyBuffer(
+      particledataScratch, particledata, 0, 0,
+      sizeof(ParticleData) * settings.particle_count, &gathered,
+      &reorder_events[2]);
+  command_queue.enqueueCopyBuffer(particleOrder[1], particleOrder[0], 0, 0,
+                                  sizeof(cl_int) * settings.particle_count,
+                                  &gathered, &reorder_events[3]);
+}
+
+void NBody::ComputeForces(std::vector<cl::Event>& force_event,
+                          int active_count) {
+  ForcePass pass;
+  EnqueueForces(pass, active_count);
+  FinishForces(pass);
+  ReleaseFrames();
+  force_event = pass.force_event;
+}
+
+void NBody::EnqueueForces(ForcePass& pass, int active_count,
+                          const std::vector<cl::Event>* wait) {
+  // Small systems skip the tree entirely.
+  const bool direct_sum = settings.force_kernel == ForceKernel::DirectSum ||
+                          settings.particle_count < settings.direct_sum_below;
+  // The active particles always use the compact traversal.
+  const bool active_only = active_count >= 0;
+  pass.direct_sum = direct_sum;
+  pass.active_only = active_only;
+  if (direct_sum) {
+    command_queue.enqueueNDRangeKernel(
+        directSum, cl::NullRange,
+        cl::NDRange(global_work_size_from_work_groups(
+            settings.particle_count, settings.direct_sum_tile_size)),
+        cl::NDRange(settings.direct_sum_tile_size), wait,
+        &pass.force_event[0]);
+  } else {
     command_queue.enqueueNDRangeKernel(
         boundingbox, cl::NullRange,
         cl::NDRange(global_work_size_from_work_groups(
             settings.particle_count, settings.boundingbox_work_group_size)),
-        cl::NDRange(settings.boundingbox_work_group_size), nullptr, &ev1[0]);
+        cl::NDRange(settings.boundingbox_work_group_size), wait,
+        &pass.ev1[0]);
 
     command_queue.enqueueNDRangeKernel(
         boundingboxstage2, cl::NullRange,
         cl::NDRange(global_work_size_from_work_groups(
             settings.particle_count, settings.boundingbox_work_group_size)),
-        cl::NDRange(settings.boundingbox_work_group_size), &ev1, &ev2[0]);
-
-    command_queue.enqueueNDRangeKernel(initOctree, cl::NullRange,
-                                       cl::NDRange(1), cl::NDRange(1), &ev2,
-                                       &ev3[0]);
+        cl::NDRange(settings.boundingbox_work_group_size), &pass.ev1,
+        &pass.ev2[0]);
+
+    // Sorting the particles also leaves the keys of the reordered particles
+    // in mortonKeys[0], so the Morton build can skip its own sort.
+    // The active list holds slot indices, so it must not be reordered.
+    const bool reorder = !active_only &&
+                         settings.reorder_particles_every > 0 &&
+                         steps_until_reorder <= 0;
+    if (reorder) {
+      EnqueueMortonSort(&pass.ev2, &pass.evmorton[0], pass.evsort);
+      ReorderParticles({pass.evsort.back()}, pass.evreorder);
+      steps_until_reorder = settings.reorder_particles_every;
+    }
+    if (!active_only) {
+      steps_until_reorder--;
+    }
 
     command_queue.enqueueNDRangeKernel(
-        buildOctree, cl::NullRange,
-        cl::NDRange((1uLL << (3uLL * settings.start_depth))),
+        initOctree, cl::NullRange,
+        cl::NDRange(add8powers(settings.start_depth)), cl::NullRange, &pass.ev2,
+        &pass.ev3[0]);
 
-        cl::NullRange, &ev3, &ev4[0]);
-    int usedNodes;
+    if (settings.octree_build_method == OctreeBuildMethod::Morton) {
+      if (!reorder) {
+        EnqueueMortonSort(&pass.ev2, &pass.evmorton[0], pass.evsort);
+      }
+      std::vector<cl::Event> build_wait = {pass.ev3[0], pass.evsort.back()};
+      command_queue.enqueueNDRangeKernel(
+          buildOctreeMorton, cl::NullRange,
+          cl::NDRange((1uLL << (3uLL * settings.start_depth))), cl::NullRange,
+          &build_wait, &pass.ev4[0]);
+    } else {
+      command_queue.enqueueNDRangeKernel(
+          buildOctree, cl::NullRange,
+          cl::NDRange((1uLL << (3uLL * settings.start_depth))),
+
+          cl::NullRange, &pass.ev3, &pass.ev4[0]);
+    }
     command_queue.enqueueReadBuffer(itrBuffer, CL_FALSE, 0, sizeof(cl_int),
-                                    &usedNodes, &ev4, &evread[0]);
+                                    &pass.usedNodes, &pass.ev4,
+                                    &pass.evread[0]);
 
-    command_queue.enqueueNDRangeKernel(centerofMass, cl::NullRange,
-                                       cl::NDRange(1), cl::NDRange(1), &ev4,
-                                       &ev51[0]);
     command_queue.enqueueNDRangeKernel(
-        DivideByMass, cl::NullRange,
-        cl::NDRange(settings.divide_by_mass_threads), cl::NullRange, &ev51,
-        &ev5[0]);
+        centerofMass, cl::NullRange,
+        cl::NDRange(settings.center_of_mass_threads), cl::NullRange, &pass.ev4,
+        &pass.ev5[0]);
+
+    cl::Kernel* force_kernel = &barneshut;
+    std::vector<cl::Event>* force_wait = &pass.ev5;
+    cl::NDRange force_global(global_work_size_from_item_per_thread(
+        settings.particle_count, settings.barneshut_items_per_thread));
+    cl::NDRange force_local = cl::NullRange;
+    if (active_only) {
+      force_kernel = &barneshutActive;
+      force_global = cl::NDRange(global_work_size_from_item_per_thread(
+          active_count, settings.barneshut_items_per_thread));
+    } else {
+      switch (settings.force_kernel) {
+        case ForceKernel::BarnesHut:
+          break;
+        case ForceKernel::BarnesHutCompact:
+          force_kernel = &barneshutCompact;
+          break;
+        case ForceKernel::BarnesHutStackless:
+          command_queue.enqueueNDRangeKernel(
+              threadOctree, cl::NullRange,
+              cl::NDRange(settings.center_of_mass_threads), cl::NullRange,
+              &pass.ev5, &pass.evforceprep[0]);
+          force_kernel = &barneshutStackless;
+          force_wait = &pass.evforceprep;
+          break;
+        case ForceKernel::BarnesHutGroup:
+          pass.evforceprep.resize(2);
+          command_queue.enqueueFillBuffer(interactionsBuffer, cl_uint(0), 0,
+                                          sizeof(cl_uint) * 2, &pass.ev5,
+                                          &pass.evforceprep[0]);
+          command_queue.enqueueFillBuffer(overflowBuffer, cl_int(0), 0,
+                                          sizeof(cl_int), &pass.ev5,
+                                          &pass.evforceprep[1]);
+          force_kernel = &barneshutGroup;
+          force_wait = &pass.evforceprep;
+          force_global = cl::NDRange(global_work_size_from_work_groups(
+              settings.particle_count, settings.barneshut_group_size));
+          force_local = cl::NDRange(settings.barneshut_group_size);
+          break;
+        case ForceKernel::FastMultipole:
+          command_queue.enqueueFillBuffer(overflowBuffer, cl_int(0), 0,
+                                          sizeof(cl_int), &pass.ev5,
+                                          &pass.evforceprep[0]);
+          command_queue.enqueueNDRangeKernel(
+              fmmInteractions, cl::NullRange,
+              cl::NDRange(settings.center_of_mass_threads), cl::NullRange,
+              &pass.evforceprep, &pass.evfmm[0]);
+          force_kernel = &fmmEvaluate;
+          force_wait = &pass.evfmm;
+          force_global = cl::NDRange(settings.particle_count);
+          break;
+        case ForceKernel::DirectSum:
+          break;
+      }
+    }
 
-    command_queue.enqueueNDRangeKernel(
-        barneshut, cl::NullRange,
-        cl::NDRange(global_work_size_from_item_per_thread(
-            settings.particle_count, settings.barneshut_items_per_thread)),
-        cl::NullRange, &ev5, &ev6[0]);
-    cl::WaitForEvents(ev6);
+    command_queue.enqueueNDRangeKernel(*force_kernel, cl::NullRange,
+                                       force_global, force_local, force_wait,
+                                       &pass.force_event[0]);
+  }
+  if (active_only || direct_sum) {
+    return;
+  }
+  // Read back without waiting, FinishForces checks them.
+  if (settings.force_kernel == ForceKernel::BarnesHutGroup) {
+    command_queue.enqueueReadBuffer(interactionsBuffer, CL_FALSE, 0,
+                                    sizeof(pass.interactions),
+                                    pass.interactions, &pass.force_event);
+  }
+  if (settings.force_kernel == ForceKernel::FastMultipole ||
+      settings.force_kernel == ForceKernel::BarnesHutGroup) {
+    command_queue.enqueueReadBuffer(overflowBuffer, CL_FALSE, 0,
+                                    sizeof(cl_int), &pass.overflow,
+                                    &pass.force_event);
+  }
+}
+
+void NBody::FinishForces(ForcePass& pass) {
+  const bool direct_sum = pass.direct_sum;
+  const bool active_only = pass.active_only;
+  // In order queue, the readbacks were enqueued after the force kernel.
+  command_queue.finish();
+
+  if (direct_sum) {
+    simulation_results.interactions +=
+        static_cast<unsigned long long>(settings.particle_count) *
+        settings.particle_count;
+  } else if (!active_only &&
+             settings.force_kernel == ForceKernel::BarnesHutGroup) {
+    simulation_results.interactions +=
+        (static_cast<unsigned long long>(pass.interactions[1]) << 32) |
+        pass.interactions[0];
+  }
+  if (!direct_sum && !active_only && pass.overflow) {
+    if (settings.force_kernel == ForceKernel::FastMultipole) {
+      throw cl::Error(CL_OUT_OF_RESOURCES,
+                      "FMM interaction list too small or tree too deep");
+    }
+    if (settings.force_kernel == ForceKernel::BarnesHutGroup) {
+      throw cl::Error(CL_OUT_OF_RESOURCES,
+                      "Barnes-Hut stack too small for the tree depth");
+    }
+  }
+
+  simulation_results.usedNodes = pass.usedNodes;
+  simulation_results.allocatedNodes = settings.allocatedNodes;
+  if (pass.usedNodes > settings.allocatedNodes) {
+    throw cl::Error(CL_OUT_OF_RESOURCES, "Used more nodes than allocated");
+  }
+
+  if (!direct_sum) {
+    simulation_results.boundingboxstage1ms += getMSTime(pass.ev1[0]);
+    simulation_results.boundingboxstage2ms += getMSTime(pass.ev2[0]);
+    simulation_results.initOctreems += getMSTime(pass.ev3[0]);
+    if (!pass.evsort.empty()) {
+      simulation_results.mortonCodesms += getMSTime(pass.evmorton[0]);
+      for (cl::Event& ev : pass.evsort) {
+        simulation_results.radixSortms += getMSTime(ev);
+      }
+    }
+    for (cl::Event& ev : pass.evreorder) {
+      simulation_results.reorderms += getMSTime(ev);
+    }
+    simulation_results.buildOctreems += getMSTime(pass.ev4[0]);
+    simulation_results.centerofMassms += getMSTime(pass.ev5[0]);
+    if (!active_only &&
+        settings.force_kernel == ForceKernel::BarnesHutStackless) {
+      simulation_results.threadOctreems += getMSTime(pass.evforceprep[0]);
+    }
+    if (!active_only && settings.force_kernel == ForceKernel::FastMultipole) {
+      simulation_results.fmmInteractionsms += getMSTime(pass.evfmm[0]);
+      simulation_results.fmmEvaluatems += getMSTime(pass.force_event[0]);
+    }
+  }
+  simulation_results.barneshutms += getMSTime(pass.force_event[0]);
+}
 
-    m_writing_mutex.lock();
+void NBody::Calculate() {
+  const std::vector<float> substeps = IntegratorSubsteps(settings.integrator);
+
+  // Summed over the steps and their substeps
+  simulation_results.boundingboxstage1ms = 0;
+  simulation_results.boundingboxstage2ms = 0;
+  simulation_results.initOctreems = 0;
+  simulation_results.mortonCodesms = 0;
+  simulation_results.radixSortms = 0;
+  simulation_results.reorderms = 0;
+  simulation_results.buildOctreems = 0;
+  simulation_results.centerofMassms = 0;
+  simulation_results.threadOctreems = 0;
+  simulation_results.barneshutms = 0;
+  simulation_results.fmmInteractionsms = 0;
+  simulation_results.fmmEvaluatems = 0;
+  simulation_results.interactions = 0;
+  simulation_results.positionupdatems = 0;
+  simulation_results.deepestRung = 0;
+  simulation_results.activeUpdates = 0;
+
+  const int steps =
+      settings.steps_per_calculate > 1 ? settings.steps_per_calculate : 1;
+  const bool batch = steps > 1;
+  float truedt;
+  try {
     truedt = timer.Tick();
 #if defined(_WIN32)
     float dt = min(truedt, settings.max_timestep);
 #elif defined(__linux__)
     float dt = std::min(truedt, settings.max_timestep);
 #endif
+    if (settings.fixed_timestep > 0) {
+      dt = settings.fixed_timestep;
+    }
 
-    positionupdate.setArg(4, dt);
-    command_queue.enqueueNDRangeKernel(
-        positionupdate, cl::NullRange,
-        cl::NDRange(global_work_size_from_item_per_thread(
-            settings.particle_count,
-            settings.position_update_items_per_thread)),
-        cl::NullRange, &ev6, &ev7[0]);
-
-    cl::WaitForEvents(ev7);
-    m_writing_mutex.unlock();
-
-    m_done_mutex.lock();
-    m_newdata = true;
-    m_done_mutex.unlock();
-
-    cl::WaitForEvents(evread);
-#
-    simulation_results.usedNodes = usedNodes;
-    simulation_results.allocatedNodes = settings.allocatedNodes;
-    if (usedNodes > settings.allocatedNodes) {
-      throw cl::Error(CL_OUT_OF_RESOURCES, "Used more nodes than allocated");
+    if (batch) {
+      // The renderer only copies published frames, so it stays out once a
+      // copy already in progress is finished.
+      frames.Withdraw();
+      std::lock_guard writing_lock(frames);
+    }
+
+    // The kicks and drifts only depend on dt, so the whole schedule is known
+    // up front. The leapfrog integrators finish the previous substep with
+    // the closing half kick, then start this one with the opening half kick.
+    const bool leapfrog = settings.integrator != Integrator::Euler;
+    const float energy_kick_dt = pending_kick_dt;
+    stepSchedule.clear();
+    if (settings.max_rung <= 0) {
+      for (int step = 0; step < steps; step++) {
+        for (float substep : substeps) {
+          const float drift_dt = substep * dt;
+          const float kick_dt =
+              pending_kick_dt + (leapfrog ? drift_dt * 0.5f : drift_dt);
+          pending_kick_dt = leapfrog ? drift_dt * 0.5f : 0;
+          stepSchedule.push_back({{kick_dt, drift_dt}});
+        }
+      }
+      ReserveStepTimes(stepSchedule.size());
+    }
+    // AddForces stops the batch once a force evaluation overflows, see
+    // there. A direct sum pass does not touch the counters, so they must not
+    // be left over from an earlier Calculate.
+    command_queue.enqueueFillBuffer(abortedBuffer, cl_int(0), 0,
+                                    sizeof(cl_int));
+    command_queue.enqueueFillBuffer(overflowBuffer, cl_int(0), 0,
+                                    sizeof(cl_int));
+    command_queue.enqueueFillBuffer(itrBuffer, cl_int(0), 0, sizeof(cl_int));
+
+    // The last update writes the frame for the renderer, block steps copy it
+    // afterwards.
+    const bool fused_export = export_frames && !stepSchedule.empty();
+    if (fused_export) {
+      positionupdate.setArg(7, ExportSlot().positions);
+    }
+    positionupdate.setArg(
+        8, fused_export ? static_cast<cl_int>(stepSchedule.size() - 1) : -1);
+
+    // Every command waits for the one before it, the host only waits for
+    // the queue at the end (and for the energy diagnostic). The renderer is
+    // kept out from the first update on, see HoldFrames.
+    std::vector<cl::Event> chain;
+    if (!stepSchedule.empty()) {
+      chain.emplace_back();
+      command_queue.enqueueWriteBuffer(
+          stepTimes, CL_FALSE, 0, stepSchedule.size() * sizeof(cl_float2),
+          stepSchedule.data(), nullptr, &chain[0]);
+    }
+
+    // Stable addresses for the asynchronous readbacks
+    std::deque<ForcePass> passes;
+    std::vector<cl::Event> updates;
+    for (int step = 0; step < steps; step++) {
+      if (settings.max_rung > 0) {
+        BlockStep(dt);
+        continue;
+      }
+      block_forces_current = false;
+      for (size_t i = 0; i < substeps.size(); i++) {
+        ForcePass& pass = passes.emplace_back();
+        EnqueueForces(pass, -1, chain.empty() ? nullptr : &chain);
+
+        // The forces match the positions now, so the velocities can be
+        // synchronised for the diagnostic.
+        if (step == 0 && i == 0 && settings.energy_diagnostic_every > 0 &&
+            steps_until_energy <= 0) {
+          MeasureEnergy(energy_kick_dt);
+          steps_until_energy = settings.energy_diagnostic_every;
+        }
+
+        HoldFrames();
+        cl::Event update;
+        positionupdate.setArg(5, static_cast<cl_int>(updates.size()));
+        command_queue.enqueueNDRangeKernel(
+            positionupdate, cl::NullRange,
+            cl::NDRange(global_work_size_from_item_per_thread(
+                settings.particle_count,
+                settings.position_update_items_per_thread)),
+            cl::NullRange, &pass.force_event, &update);
+        chain = {update};
+        updates.push_back(update);
+      }
+    }
+
+    if (fused_export) {
+      ExportSlot().ready = chain[0];
+      ReadExport();
+    } else if (export_frames) {
+      WriteExport(chain.empty() ? nullptr : &chain);
+      ReadExport();
+    }
+
+    for (ForcePass& pass : passes) {
+      FinishForces(pass);
     }
+    ReleaseFrames();
+    for (cl::Event& ev : updates) {
+      simulation_results.positionupdatems += getMSTime(ev);
+    }
+    steps_until_energy -= steps;
+
+    if (export_frames) {
+      PublishExport();
+    }
+    frames.Publish();
   } catch (cl::Error error) {
+    ReleaseFrames();
     throw CustomCLError(error);
   }
-
-  simulation_results.boundingboxstage1ms = getMSTime(ev1[0]);
-  simulation_results.boundingboxstage2ms = getMSTime(ev2[0]);
-  simulation_results.initOctreems = getMSTime(ev3[0]);
-  simulation_results.buildOctreems = getMSTime(ev4[0]);
-  simulation_results.centerofMassms = getMSTime(ev5[0]);
-  simulation_results.dividecenterofmassms = getMSTime(ev51[0]);
-  simulation_results.barneshutms = getMSTime(ev6[0]);
-  simulation_results.positionupdatems = getMSTime(ev7[0]);
   simulation_results.deltaTimesecond = truedt;
+  simulation_results.stepsPerSecond = steps / truedt;
 }
 
-void NBody::Clean() {}
+void NBody::BlockStep(float dt) {
+  std::vector<cl::Event> evforce(1);
+  if (!block_forces_current) {
+    ComputeForces(evforce);
+  }
+  // Every particle finished its step, the velocities are synchronised.
+  if (settings.energy_diagnostic_every > 0 && steps_until_energy <= 0) {
+    MeasureEnergy(pending_kick_dt);
+    steps_until_energy = settings.energy_diagnostic_every;
+  }
+
+  std::vector<cl::Event> evrungs(1);
+  cl_int deepest = 0;
+  command_queue.enqueueFillBuffer(deepestRungBuffer, cl_int(0), 0,
+                                  sizeof(cl_int));
+  assignRungs.setArg(5, dt);
+  assignRungs.setArg(9, pending_kick_dt);
+  command_queue.enqueueNDRangeKernel(assignRungs, cl::NullRange,
+                                     cl::NDRange(settings.particle_count),
+                                     cl::NullRange, nullptr, &evrungs[0]);
+  command_queue.enqueueReadBuffer(deepestRungBuffer, CL_TRUE, 0,
+                                  sizeof(cl_int), &deepest, &evrungs);
+  pending_kick_dt = 0;
+
+  // Only as many substeps as the deepest occupied rung needs, so none of
+  // them is empty.
+  const int substeps = 1 << deepest;
+  const float fine_dt = std::ldexp(dt, -deepest);
+  kickActive.setArg(6, dt);
+  // Every drift of the block step is the same
+  const cl_float2 drift_times = {{0.0f, fine_dt}};
+  ReserveStepTimes(1);
+  command_queue.enqueueWriteBuffer(stepTimes, CL_TRUE, 0, sizeof(cl_float2),
+                                   &drift_times);
+  positionupdate.setArg(5, 0);
+  for (int k = 1; k <= substeps; k++) {
+    std::vector<cl::Event> evdrift(1);
+    std::vector<cl::Event> evkick(1);
+    {
+      std::lock_guard lock(frames);
+      command_queue.enqueueNDRangeKernel(
+          positionupdate, cl::NullRange,
+          cl::NDRange(global_work_size_from_item_per_thread(
+              settings.particle_count,
+              settings.position_update_items_per_thread)),
+          cl::NullRange, nullptr, &evdrift[0]);
+      cl::WaitForEvents(evdrift);
+    }
+    simulation_results.positionupdatems += getMSTime(evdrift[0]);
+
+    // A particle of rung r finishes its step every 2^(deepest - r)
+    // substeps. Everyone finishes at the end, then the tree is built with
+    // reordering allowed and the next block step assigns new rungs.
+    const bool last = k == substeps;
+    int finished = 0;
+    while (!((k >> finished) & 1)) {
+      finished++;
+    }
+    int active_count;
+    if (last) {
+      ComputeForces(evforce);
+      active_count = CompactActive(0);
+    } else {
+      active_count = CompactActive(deepest - finished);
+      ComputeForces(evforce, active_count);
+    }
+    simulation_results.activeUpdates += active_count;
+
+    kickActive.setArg(7, last ? 1 : 0);
+    command_queue.enqueueNDRangeKernel(kickActive, cl::NullRange,
+                                       cl::NDRange(active_count),
+                                       cl::NullRange, &evforce, &evkick[0]);
+    cl::WaitForEvents(evkick);
+    simulation_results.positionupdatems += getMSTime(evkick[0]);
+  }
+  block_forces_current = true;
+  simulation_results.deepestRung = deepest;
+}
 
-void NBody::UpdateCommunication(Communication& comm) {
-  comm.SetSimulationData(simulation_results);
+int NBody::CompactActive(int min_rung) {
+  std::vector<cl::Event> evcompact(1);
+  cl_int active_count;
+  command_queue.enqueueFillBuffer(activeCountBuffer, cl_int(0), 0,
+                                  sizeof(cl_int));
+  compactActive.setArg(3, min_rung);
+  command_queue.enqueueNDRangeKernel(compactActive, cl::NullRange,
+                                     cl::NDRange(settings.particle_count),
+                                     cl::NullRange, nullptr, &evcompact[0]);
+  command_queue.enqueueReadBuffer(activeCountBuffer, CL_TRUE, 0,
+                                  sizeof(cl_int), &active_count, &evcompact);
+  return active_count;
 }
 
+void NBody::ReserveStepTimes(size_t count) {
+  if (stepTimesCapacity < count) {
+    stepTimes =
+        cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_float2) * count);
+    stepTimesCapacity = count;
+  }
+  // Also after the program was rebuilt
+  positionupdate.setArg(4, stepTimes);
+}
+
+void NBody::HoldFrames() {
+  if (!frames_held.owns_lock()) {
+    frames_held.lock();
+  }
+}
+
+void NBody::ReleaseFrames() {
+  if (frames_held.owns_lock()) {
+    frames_held.unlock();
+  }
+}
+
+void NBody::MeasureEnergy(float velocity_dt) {
+  std::vector<cl::Event> ev(1);
+  std::vector<cl_float8> partial(
+      (settings.particle_count + settings.direct_sum_tile_size - 1) /
+      settings.direct_sum_tile_size);
+
+  energyDiagnostic.setArg(5, velocity_dt);
+  command_queue.enqueueNDRangeKernel(
+      energyDiagnostic, cl::NullRange,
+      cl::NDRange(global_work_size_from_work_groups(
+          settings.particle_count, settings.direct_sum_tile_size)),
+      cl::NDRange(settings.direct_sum_tile_size), nullptr, &ev[0]);
+  command_queue.enqueueReadBuffer(energyPartials, CL_TRUE, 0,
+                                  partial.size() * sizeof(cl_float8),
+                                  partial.data(), &ev);
+
+  double kinetic = 0;
+  double potential = 0;
+  double momentum[3] = {0, 0, 0};
+  for (const cl_float8& p : partial) {
+    kinetic += p.s[0];
+    potential += p.s[1];
+    for (int d = 0; d < 3; d++) {
+      momentum[d] += p.s[2 + d];
+    }
+  }
+  const double energy = kinetic + potential;
+  if (!initial_energy.has_value()) {
+    initial_energy = energy;
+  }
+
+  simulation_results.energyMeasured = true;
+  simulation_results.kineticEnergy = kinetic;
+  simulation_results.potentialEnergy = potential;
+  simulation_results.energyDrift =
+      *initial_energy != 0
+          ? (energy - *initial_energy) / std::abs(*initial_energy)
+          : 0;
+  for (int d = 0; d < 3; d++) {
+    simulation_results.momentum[d] = momentum[d];
+  }
+  simulation_results.energyms = getMSTime(ev[0]);
+}
+
+void NBody::Clean() {}
+
 void NBody::RegenerateParticles(
 
 ) {
@@ -508,12 +1324,17 @@ void NBody::RegenerateParticles(
   pos.resize(settings.particle_count);
   std::vector<ParticleData> data = set.second;
   data.resize(settings.particle_count);
+  std::vector<cl_int> order(settings.particle_count);
+  for (int i = 0; i < settings.particle_count; i++) {
+    order[i] = i;
+  }
 
   try {
-    // These have to be done here since we will transfer these over to openGL
+    // The renderer copies from particlepos, so it must not see a half
+    // written frame.
 
     {
-      std::lock_guard m_writing_mut(m_writing_mutex);
+      std::lock_guard frames_lock(frames);
       command_queue.enqueueWriteBuffer(
           particlepos, CL_FALSE, 0, pos.size() * sizeof(cl_float4), pos.data());
 
@@ -521,71 +1342,96 @@ void NBody::RegenerateParticles(
                                        data.size() * sizeof(ParticleData),
                                        data.data());
 
+      command_queue.enqueueWriteBuffer(particleOrder[0], CL_FALSE, 0,
+                                       order.size() * sizeof(cl_int),
+                                       order.data());
+      steps_until_reorder = 0;
+      steps_until_energy = 0;
+      pending_kick_dt = 0;
+      initial_energy.reset();
+      block_forces_current = false;
+      if (export_frames) {
+        WriteExport(nullptr);
+        ReadExport();
+      }
+
       // This may include the create Octree call
       command_queue.finish();
+      if (export_frames) {
+        PublishExport();
+      }
     }
-    WriteToAllNonUsedVBOs();
-    std::lock_guard m_done_lock(m_done_mutex);
-    m_newdata = true;
+    frames.Publish();
   } catch (cl::Error error) {
     throw CustomCLError(error);
   }
 }
 
-void NBody::WriteToAllNonUsedVBOs() {
-  std::lock_guard<std::mutex> done_lock(m_done_mutex);
-  std::lock_guard<std::mutex> writing_lock(m_writing_mutex);
+void NBody::EnqueueCopyPositions(const cl::Memory& target,
+                                 const std::vector<cl::Event>* wait,
+                                 cl::Event* done) {
+  unpermutePositions.setArg(2, target);
+  command_queue.enqueueNDRangeKernel(unpermutePositions, cl::NullRange,
+                                     cl::NDRange(settings.particle_count),
+                                     cl::NullRange, wait, done);
+}
+
+NBody::ExportedFrame& NBody::ExportSlot() {
+  // The back slot belongs to this thread, so it can be resized right away.
+  ExportedFrame& frame = host_export ? hostStaging : exported.Back();
+  if (frame.particle_count != settings.particle_count ||
+      frame.half_precision != settings.half_precision_export) {
+    frame.positions = cl::Buffer(
+        context, CL_MEM_READ_WRITE,
+        RenderPositionSize(settings.half_precision_export) *
+            settings.particle_count);
+    frame.particle_count = settings.particle_count;
+    frame.half_precision = settings.half_precision_export;
+  }
+  return frame;
+}
+
+void NBody::WriteExport(const std::vector<cl::Event>* wait) {
+  ExportedFrame& frame = ExportSlot();
+  exportPositions.setArg(2, frame.positions);
+  command_queue.enqueueNDRangeKernel(exportPositions, cl::NullRange,
+                                     cl::NDRange(settings.particle_count),
+                                     cl::NullRange, wait, &frame.ready);
+}
+
+void NBody::ReadExport() {
+  if (!host_export) {
+    return;
+  }
+  HostFrame& frame = hostExported.Back();
+  frame.particle_count = hostStaging.particle_count;
+  frame.half_precision = hostStaging.half_precision;
+  frame.positions.resize(RenderPositionSize(frame.half_precision) *
+                         frame.particle_count);
+  const std::vector<cl::Event> wait = {hostStaging.ready};
+  command_queue.enqueueReadBuffer(hostStaging.positions, CL_FALSE, 0,
+                                  frame.positions.size(),
+                                  frame.positions.data(), &wait, &hostRead);
+}
+
+void NBody::PublishExport() {
+  if (host_export) {
+    // Usually complete already, the queue was finished.
+    hostRead.wait();
+    hostExported.Publish();
+  } else {
+    exported.Publish();
+  }
+}
+
+void NBody::ReadPositions(std::vector<cl_float4>& positions) {
   try {
-    for (int i = 0; i < VBOs.size(); i++) {
-      if (i == current_VBO_ind) {
-        continue;
-      }
-      std::vector<cl::Event> ev1(1);
-      std::vector<cl::Event> ev2(1);
-      std::vector<cl::Event> ev3(1);
-      std::vector<cl::Memory> buff = {openGLparticlepos[i]};
-      copy_command_queue.enqueueAcquireGLObjects(&buff, nullptr, &ev1[0]);
-      copy_command_queue.enqueueCopyBuffer(
-          particlepos, openGLparticlepos[i], 0, 0,
-          settings.particle_count * sizeof(cl_float4), &ev1, &ev2[0]);
-      copy_command_queue.enqueueReleaseGLObjects(&buff, &ev2, &ev3[0]);
-      cl::WaitForEvents(ev3);
-    }
+    positions.resize(settings.particle_count);
+    EnqueueCopyPositions(unpermutedPositions, nullptr, nullptr);
+    command_queue.enqueueReadBuffer(unpermutedPositions, CL_TRUE, 0,
+                                    sizeof(cl_float4) * settings.particle_count,
+                                    positions.data());
   } catch (cl::Error error) {
     throw CustomCLError(error);
   }
 }
-
-bool NBody::TryAndWriteData() {
-  bool update = false;
-  {
-    std::lock_guard<std::mutex> done_lock(m_done_mutex);
-    if (m_newdata && m_writing_mutex.try_lock()) {
-      m_newdata = false;
-      update = true;
-    }
-    // Let go of the lock as early as possible
-  }
-  // We have new data and successfully locked m_writing_mutex
-  if (update) {
-    try {
-      std::vector<cl::Event> ev1(1);
-      std::vector<cl::Event> ev2(1);
-      std::vector<cl::Event> ev3(1);
-      std::vector<cl::Memory> buff = {openGLparticlepos[current_VBO_ind]};
-      copy_command_queue.enqueueAcquireGLObjects(&buff, nullptr, &ev1[0]);
-      copy_command_queue.enqueueCopyBuffer(
-          particlepos, openGLparticlepos[current_VBO_ind], 0, 0,
-          settings.particle_count * sizeof(cl_float4), &ev1, &ev2[0]);
-      copy_command_queue.enqueueReleaseGLObjects(&buff, &ev2, &ev3[0]);
-      current_VBO_ind += 1;
-      current_VBO_ind %= VBOs.size();
-      cl::WaitForEvents(ev3);
-    } catch (cl::Error error) {
-      m_writing_mutex.unlock();
-      throw CustomCLError(error);
-    }
-    m_writing_mutex.unlock();
-  }
-  return update;
-}
\ No newline at end of file
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <CLPreComp.h>
-#include <GL/glew.h>
 
 #include <array>
 #include <chrono>
@@ -9,50 +8,203 @@
 #include <exception>
 #include <functional>
 #include <mutex>
+#include <optional>
 #include <vector>
 
+#include "CLDevices.h"
 #include "Communication.hpp"
 #include "ParticleDescription.h"
+#include "SimulationBackend.h"
 
-class NBodyTimer {
- public:
-  float Tick();
-  NBodyTimer();
+// Number of nodes in a full octree of the given depth
+constexpr size_t add8powers(const size_t exp) {
+  size_t res = 0;
+  for (size_t i = 0; i <= exp; i++) {
+    res += 1uLL << (3uLL * i);
+  }
+  return res;
+}
 
- private:
-  std::chrono::high_resolution_clock::time_point prev;
+inline float getMSTime(cl::Event& ev) {
+  cl_ulong start, end;
+  ev.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+  ev.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+  return (float)((end - start) / 1e+06);
+}
+
+// Compiles openclkernels.c with the sizes of the settings. Throws
+// CustomCLError with the build log.
+cl::Program BuildNBodyProgram(const cl::Context& context,
+                              const std::vector<cl::Device>& devices,
+                              const SimulationSettings& settings);
+
+// Which OpenCL device NBody::Init creates its context on, indices of
+// ListCLDevices. -1 = any, see CandidateCLDevices.
+struct CLDeviceSelection {
+  int platform = -1;
+  int device = -1;
+#ifndef NBODY_HEADLESS
+  // Shares the context with the current OpenGL context on the first
+  // candidate that can, so the renderer copies the positions on the device.
+  // Falls back to the first candidate without sharing, see SharesGL.
+  bool share_gl = false;
+#endif
 };
 
-class NBody {
+class NBody : public ISimulationBackend {
  public:
-  NBody(const SimulationSettings& s);
-  ~NBody() = default;
+  NBody(const SimulationSettings& s, const CLDeviceSelection& target = {});
+  ~NBody() override = default;
 
-  // Initialise OpenCL, attach OpenGL Buffers
-  bool InitCL(const std::array<GLuint, 2>& VBOIndex);
+  // Initialise OpenCL on the selected device
+  bool Init() override;
 
   /// Generates the particles and moves them to the GPU.
-  void RegenerateParticles();
+  void RegenerateParticles() override;
 
   // Returns whether it has should be restarted
   // Giving nullopt will apply the current settings again.
-  void ChangeSettings(const SimulationSettings& s);
+  void ChangeSettings(const SimulationSettings& s) override;
 
-  void Clean();
+  void Clean() override;
 
   // Update the simulationstate
-  void Calculate();
+  void Calculate() override;
+
+  void ReadPositions(std::vector<cl_float4>& positions) override;
 
-  /// Attempts to write to the given OpenGL buffer
-  bool TryAndWriteData();
+  const SimulationData& GetSimulationData() const override {
+    return simulation_results;
+  }
+  FrameHandoff& GetFrames() override { return frames; }
 
-  // Writes simulation results to the given buffer
-  void UpdateCommunication(Communication& comm);
+  // Whether Init managed to share the context with OpenGL.
+  bool SharesGL() const { return gl_shared; }
+  const cl::Context& GetContext() const { return context; }
+  const cl::Device& GetDevice() const { return devices[0]; }
+  int GetParticleCount() const { return settings.particle_count; }
+
+  // Copies the positions in their original order into target, a buffer of
+  // GetParticleCount() cl_float4s. Simulation thread only.
+  void EnqueueCopyPositions(const cl::Memory& target,
+                            const std::vector<cl::Event>* wait,
+                            cl::Event* done);
+
+  // A finished frame on the device, see EnableExport.
+  struct ExportedFrame {
+    // In their original order, RenderPositionSize(half_precision) bytes each
+    cl::Buffer positions;
+    int particle_count = 0;
+    bool half_precision = false;
+    // Completes once positions is written.
+    cl::Event ready;
+  };
+  // Writes the positions into a TripleBuffer of device buffers at the end of
+  // every Calculate, so a renderer on another queue of GetContext() can take
+  // them without GetFrames(). The last update of a step writes them itself,
+  // there is no separate copy. Call before the simulation thread starts.
+  void EnableExport() { export_frames = true; }
+  // Render thread, the newest frame if it was not taken yet. Stays valid
+  // until the next call.
+  const ExportedFrame* AcquireExport() {
+    return exported.Update() ? &exported.Front() : nullptr;
+  }
+
+  // A finished frame in host memory, see EnableHostExport.
+  struct HostFrame {
+    // In their original order, RenderPositionSize(half_precision) bytes each
+    std::vector<char> positions;
+    int particle_count = 0;
+    bool half_precision = false;
+  };
+  // Like EnableExport, for a renderer without a shared context. The frame is
+  // read back without waiting at the end of every Calculate and published
+  // once the read completed, the renderer never uses the command queue.
+  // Call instead of EnableExport, before the simulation thread starts.
+  void EnableHostExport() {
+    export_frames = true;
+    host_export = true;
+  }
+  // Render thread, like AcquireExport.
+  const HostFrame* AcquireHostExport() {
+    return hostExported.Update() ? &hostExported.Front() : nullptr;
+  }
 
  private:
-  // Write to all non currently active VBOs. The current VBO will be updated
-  // after setting m_newdata;
-  void WriteToAllNonUsedVBOs();
+  // Computes the Morton key of every particle and radix sorts the keys
+  // together with the particle indices. The sorted result ends up in
+  // mortonKeys[0] and mortonIndices[0].
+  void EnqueueMortonSort(const std::vector<cl::Event>* wait,
+                         cl::Event* codes_event,
+                         std::vector<cl::Event>& sort_events);
+  // Gathers the particles into the order of mortonIndices[0] and copies them
+  // back. Holds frames from here on, see HoldFrames.
+  void ReorderParticles(const std::vector<cl::Event>& wait,
+                        std::vector<cl::Event>& reorder_events);
+  // Events and readbacks of one force evaluation. The readbacks are written
+  // asynchronously, so a pass must not move until FinishForces.
+  struct ForcePass {
+    std::vector<cl::Event> ev1 = std::vector<cl::Event>(1);
+    std::vector<cl::Event> ev2 = std::vector<cl::Event>(1);
+    std::vector<cl::Event> ev3 = std::vector<cl::Event>(1);
+    std::vector<cl::Event> ev4 = std::vector<cl::Event>(1);
+    std::vector<cl::Event> evmorton = std::vector<cl::Event>(1);
+    std::vector<cl::Event> evsort;
+    std::vector<cl::Event> evreorder;
+    std::vector<cl::Event> ev5 = std::vector<cl::Event>(1);
+    std::vector<cl::Event> evforceprep = std::vector<cl::Event>(1);
+    std::vector<cl::Event> evfmm = std::vector<cl::Event>(1);
+    std::vector<cl::Event> evread = std::vector<cl::Event>(1);
+    std::vector<cl::Event> force_event = std::vector<cl::Event>(1);
+    bool direct_sum = false;
+    bool active_only = false;
+    cl_int usedNodes = 0;
+    cl_uint interactions[2] = {0, 0};
+    cl_int overflow = 0;
+  };
+  // Builds the tree if needed and enqueues the force kernel without waiting.
+  // With active_count >= 0 only the first active_count particles of
+  // activeIndices are updated and the particles are not reordered. The pass
+  // starts after wait.
+  void EnqueueForces(ForcePass& pass, int active_count = -1,
+                     const std::vector<cl::Event>* wait = nullptr);
+  // Waits for the queue, checks the readbacks of the pass and adds its
+  // timings to simulation_results.
+  void FinishForces(ForcePass& pass);
+  // EnqueueForces followed by FinishForces.
+  void ComputeForces(std::vector<cl::Event>& force_event,
+                     int active_count = -1);
+  // One step of dt with block timesteps.
+  void BlockStep(float dt);
+  // Fills activeIndices with the particles of rung >= min_rung, returns their
+  // count.
+  int CompactActive(int min_rung);
+  // Sums the energy and momentum on the device, the velocities are advanced
+  // by velocity_dt first.
+  void MeasureEnergy(float velocity_dt);
+  // Grows stepTimes to at least count entries.
+  void ReserveStepTimes(size_t count);
+  // Keeps the renderer out of particlepos from the first enqueued command
+  // that changes it, without waiting for that command. ReleaseFrames lets it
+  // back in once the queue finished.
+  void HoldFrames();
+  void ReleaseFrames();
+  // Where the render copy goes: the back of exported, or hostStaging for
+  // the host export. Reallocated for the current particle count and layout
+  // if necessary.
+  ExportedFrame& ExportSlot();
+  // Enqueues ExportPositions into ExportSlot() after wait, for the frames
+  // whose last update did not write it.
+  void WriteExport(const std::vector<cl::Event>* wait);
+  // Once ExportSlot().ready is set. The host export enqueues the read into
+  // the back of hostExported, without waiting.
+  void ReadExport();
+  // Hands the frame to the renderer, once the queue is through.
+  void PublishExport();
+  // nodeNext, nodeRadius, nodeLocals and nodeQuadrupole, with every node
+  // only if the settings need them, see SimulationSettings::NeedsNodeNext.
+  // Only replaces the buffers whose size changes, unless reallocate.
+  void AllocateOptionalNodeBuffers(bool reallocate);
   // Tests
   void doTesting();
 
@@ -66,15 +218,23 @@ class NBody {
   //          ╰─────────────────────────────────────────────────────────╯
 
   SimulationData simulation_results;
-  std::mutex m_writing_mutex;
-  std::mutex m_done_mutex;
-  bool m_newdata = false;
+  FrameHandoff frames;
+  // See HoldFrames
+  std::unique_lock<FrameHandoff> frames_held{frames, std::defer_lock};
+  bool export_frames = false;
+  TripleBuffer<ExportedFrame> exported;
+  bool host_export = false;
+  ExportedFrame hostStaging;
+  cl::Event hostRead;
+  TripleBuffer<HostFrame> hostExported;
 
   //          ╭─────────────────────────────────────────────────────────╮
   //          │                           CL                            │
   //          ╰─────────────────────────────────────────────────────────╯
-  std::array<GLuint, 2> VBOs;
-  int current_VBO_ind = 1;
+  CLDeviceSelection target;
+  bool gl_shared = false;
+  // The first ChangeSettings compiles the program and creates the buffers.
+  bool must_reset_all = true;
 
   NBodyTimer timer;
 
@@ -85,31 +245,100 @@ class NBody {
   cl::Kernel initOctree;
   cl::Kernel buildOctree;
 
+  cl::Kernel mortonCodes;
+  cl::Kernel radixSortHistogram;
+  cl::Kernel radixSortScan;
+  cl::Kernel radixSortScatter;
+  cl::Kernel buildOctreeMorton;
+
+  cl::Kernel reorderParticles;
+  cl::Kernel unpermutePositions;
+  cl::Kernel exportPositions;
+
   cl::Kernel centerofMass;
-  cl::Kernel DivideByMass;
 
   cl::Kernel barneshut;
+  cl::Kernel barneshutCompact;
+  cl::Kernel threadOctree;
+  cl::Kernel barneshutStackless;
+  cl::Kernel barneshutGroup;
+  cl::Kernel fmmInteractions;
+  cl::Kernel fmmEvaluate;
+  cl::Kernel directSum;
+  cl::Kernel energyDiagnostic;
+  cl::Kernel barneshutActive;
+  cl::Kernel assignRungs;
+  cl::Kernel compactActive;
+  cl::Kernel kickActive;
   cl::Kernel positionupdate;
 
   cl::Context context;
   cl::vector<cl::Device> devices;
   // Simulation command_queue
   cl::CommandQueue command_queue;
-  //// Copy command_queue
-  cl::CommandQueue copy_command_queue;
   cl::Program program;
 
   // CL buffers
 
   // Cannot change size
-  std::array<cl::BufferGL, 2> openGLparticlepos;
   cl::Buffer itrBuffer;
   cl::Buffer globalMinBuffer;
   cl::Buffer globalMaxBuffer;
+  // Two uints, the low and high half of the interaction count.
+  cl::Buffer interactionsBuffer;
   // Can change
   cl::Buffer particlepos;
   cl::Buffer particledata;
   cl::Buffer Nodes;
+  // Compact copy of the tree for the traversal, see NodeInfo.
+  cl::Buffer nodeCom;
+  cl::Buffer nodeInfo;
+  // Where the stackless traversal continues after a node, see ThreadOctree.
+  cl::Buffer nodeNext;
+  // Fast multipole, see FmmInteractions.
+  cl::Buffer nodeRadius;
+  cl::Buffer nodeQuadrupole;
+  cl::Buffer nodeLocals;
+  // Index of the leaf every particle ended up in.
+  cl::Buffer particleLeaf;
+  // ReadPositions
+  cl::Buffer unpermutedPositions;
+  // Set by FmmInteractions and BarnesHutGroup when a list or stack is full.
+  cl::Buffer overflowBuffer;
+  // Set by AddForces once it stopped a batch, see there.
+  cl::Buffer abortedBuffer;
+  // One float8 per work group of EnergyDiagnostic.
+  cl::Buffer energyPartials;
+  // Block timesteps, see AssignRungs.
+  cl::Buffer particleRung;
+  cl::Buffer activeIndices;
+  cl::Buffer activeCountBuffer;
+  cl::Buffer deepestRungBuffer;
   cl::Buffer minValuesBuffer;
   cl::Buffer maxValuesBuffer;
+  std::array<cl::Buffer, 2> mortonKeys;
+  std::array<cl::Buffer, 2> mortonIndices;
+  cl::Buffer radixHistogram;
+  // Targets of the reorder gather, copied back into particlepos/particledata.
+  cl::Buffer particleposScratch;
+  cl::Buffer particledataScratch;
+  // Original index of the particle in every slot, [0] is the current one.
+  std::array<cl::Buffer, 2> particleOrder;
+  // Kick and drift of every AddForces of a Calculate call, written once
+  // before the first of them. stepSchedule is the host copy, the write does
+  // not block so it has to outlive the call.
+  cl::Buffer stepTimes;
+  size_t stepTimesCapacity = 0;
+  std::vector<cl_float2> stepSchedule;
+  // The particles are sorted when this reaches zero
+  int steps_until_reorder = 0;
+  // Closing half kick of the last leapfrog substep, applied together with the
+  // opening half kick of the next one.
+  float pending_kick_dt = 0;
+  int steps_until_energy = 0;
+  // Energy at the first measurement, the drift is relative to it.
+  std::optional<double> initial_energy;
+  // The last block step ended with a full force evaluation at the current
+  // positions.
+  bool block_forces_current = false;
 };
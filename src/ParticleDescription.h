@@ -18,12 +18,31 @@ typedef struct {
   cl_float4 center_of_mass;
   cl_float3 region_size;
   cl_int isLeaf;  // 0 = isLeaf, 1 = Parent, 2 = Empty
-  cl_int children[8];
-  // Size is 68 bytes :c
-  cl_int padding[3];
-  // This way size is 80, which matches the alignment of the largest member
-  // float3(float4) of 16 bytes.
+  // The 8 children are always allocated next to each other.
+  cl_int first_child;
+  // -1 for the root. Used by CalculateCenterOfMass to walk back up.
+  cl_int parent;
+  // Number of children whose center of mass is already final.
+  cl_int finished_children;
+  // Size is 48, a multiple of the float3(float4) alignment of 16 bytes.
 } Node;
 
+// Compact traversal layout, the center of mass lives in a separate float4
+// buffer.
+typedef struct {
+  // Largest side of the cell.
+  cl_float size;
+  // -1 if the node has no children.
+  cl_int first_child;
+} NodeInfo;
+
+// First order expansion of the acceleration around the center of mass of a
+// node, see FmmInteractions.
+typedef struct {
+  cl_float4 acc;
+  cl_float4 jacobian_diagonal;
+  cl_float4 jacobian_off_diagonal;
+} LocalExpansion;
+
 using ParticleSetDescription =
     std::pair<std::vector<cl_float4>, std::vector<ParticleData>>;
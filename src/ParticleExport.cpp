@@ -0,0 +1,140 @@
+#include "ParticleExport.h"
+
+#include <glm/gtc/packing.hpp>
+
+namespace {
+GLint BufferSize(GLuint VBO) {
+  GLint size = 0;
+  glBindBuffer(GL_ARRAY_BUFFER, VBO);
+  glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &size);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return size;
+}
+}  // namespace
+
+CLGLParticleExport::CLGLParticleExport(NBody& nbody)
+    : nbody(nbody),
+      copy_command_queue(nbody.GetContext(), nbody.GetDevice()) {
+  nbody.EnableExport();
+}
+
+CLGLParticleExport::~CLGLParticleExport() {
+  if (drawn) {
+    glDeleteSync(drawn);
+  }
+  // The copies must not outlive the shared buffers.
+  copy_command_queue.finish();
+}
+
+bool CLGLParticleExport::TryAndWriteData(GLuint VBO, bool half_precision) {
+  try {
+    SharedBuffer& shared = openGLparticlepos[VBO];
+    if (shared.copying) {
+      if (shared.copied.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() !=
+          CL_COMPLETE) {
+        return false;
+      }
+      shared.copying = false;
+      // VBO is drawn from now on, the other one becomes the next target.
+      drawn = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      return true;
+    }
+
+    // OpenCL may only take the buffer once OpenGL stopped drawing from it.
+    if (drawn) {
+      if (glClientWaitSync(drawn, GL_SYNC_FLUSH_COMMANDS_BIT, 0) ==
+          GL_TIMEOUT_EXPIRED) {
+        return false;
+      }
+      glDeleteSync(drawn);
+      drawn = nullptr;
+    }
+
+    const NBody::ExportedFrame* frame = nbody.AcquireExport();
+    if (!frame) {
+      return false;
+    }
+    // The renderer resizes the buffers before the simulation applies the new
+    // particle count or layout, such a frame is skipped.
+    const GLint size = BufferSize(VBO);
+    const GLint needed =
+        RenderPositionSize(frame->half_precision) * frame->particle_count;
+    if (needed == 0 || size < needed ||
+        frame->half_precision != half_precision) {
+      return false;
+    }
+    if (shared.size != size) {
+      shared.buffer = cl::BufferGL(nbody.GetContext(), CL_MEM_WRITE_ONLY, VBO);
+      shared.size = size;
+    }
+
+    // The frame stays ours until the next AcquireExport, which only happens
+    // once this copy is complete.
+    std::vector<cl::Event> acquired(1);
+    std::vector<cl::Event> written(1);
+    std::vector<cl::Memory> buff = {shared.buffer};
+    copy_command_queue.enqueueAcquireGLObjects(&buff, nullptr, &acquired[0]);
+    acquired.push_back(frame->ready);
+    copy_command_queue.enqueueCopyBuffer(frame->positions, shared.buffer, 0,
+                                         0, needed, &acquired, &written[0]);
+    copy_command_queue.enqueueReleaseGLObjects(&buff, &written,
+                                               &shared.copied);
+    copy_command_queue.flush();
+    shared.copying = true;
+  } catch (cl::Error error) {
+    throw CustomCLError(error);
+  }
+  return false;
+}
+
+CLHostParticleExport::CLHostParticleExport(NBody& nbody) : nbody(nbody) {
+  nbody.EnableHostExport();
+}
+
+bool CLHostParticleExport::TryAndWriteData(GLuint VBO, bool half_precision) {
+  const NBody::HostFrame* frame = nbody.AcquireHostExport();
+  if (!frame) {
+    return false;
+  }
+  // Skipped like in CLGLParticleExport
+  const GLint size = frame->positions.size();
+  if (size == 0 || BufferSize(VBO) < size ||
+      frame->half_precision != half_precision) {
+    return false;
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, VBO);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, size, frame->positions.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return true;
+}
+
+HostParticleExport::HostParticleExport(ISimulationBackend& backend)
+    : backend(backend) {}
+
+bool HostParticleExport::TryAndWriteData(GLuint VBO, bool half_precision) {
+  {
+    std::unique_lock<FrameHandoff> frame =
+        backend.GetFrames().TryAcquireFrame();
+    if (!frame) {
+      return false;
+    }
+    backend.ReadPositions(positions);
+  }
+  const GLint size = RenderPositionSize(half_precision) * positions.size();
+  if (size == 0 || BufferSize(VBO) < size) {
+    return false;
+  }
+  const void* data = positions.data();
+  if (half_precision) {
+    packed.resize(positions.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+      const cl_float4& p = positions[i];
+      packed[i] = glm::packHalf4x16(glm::vec4(p.s[0], p.s[1], p.s[2], p.s[3]));
+    }
+    data = packed.data();
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, VBO);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return true;
+}
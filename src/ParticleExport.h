@@ -0,0 +1,82 @@
+#pragma once
+
+#include <CLPreComp.h>
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "NBody.h"
+#include "SimulationBackend.h"
+
+// Copies the newest frame of a backend into a vertex buffer of the renderer,
+// on the render thread. The vertex buffers hold cl_float4s or 4 halves per
+// particle (SimulationSettings::half_precision_export) and are resized by
+// CMyApp::SetParticleCount.
+class IParticleExport {
+ public:
+  virtual ~IParticleExport() = default;
+
+  // Returns whether a new frame was written into VBO, the renderer then
+  // draws it. Called every frame with the same VBO until it returns true.
+  // half_precision is the layout of VBO, frames in the other one are skipped
+  // or converted.
+  virtual bool TryAndWriteData(GLuint VBO, bool half_precision) = 0;
+};
+
+// For NBody on a context shared with OpenGL, the positions never leave the
+// device. Takes the frames NBody exports (NBody::EnableExport), already in
+// the layout of the vertex buffers, and copies them on its own queue.
+// Nothing blocks: the copy starts once OpenGL is done with the vertex buffer
+// (a sync object) and the frame is drawn once the copy finished (its event),
+// both are polled on the next calls.
+class CLGLParticleExport : public IParticleExport {
+ public:
+  CLGLParticleExport(NBody& nbody);
+  ~CLGLParticleExport() override;
+
+  bool TryAndWriteData(GLuint VBO, bool half_precision) override;
+
+ private:
+  struct SharedBuffer {
+    cl::BufferGL buffer;
+    // Recreated whenever the vertex buffer is reallocated.
+    GLint size = -1;
+    // Released to OpenGL once complete.
+    cl::Event copied;
+    bool copying = false;
+  };
+  NBody& nbody;
+  std::unordered_map<GLuint, SharedBuffer> openGLparticlepos;
+  cl::CommandQueue copy_command_queue;
+  // Signaled once OpenGL finished the commands issued before the last new
+  // frame, the draws from the buffer written next included.
+  GLsync drawn = nullptr;
+};
+
+// For NBody without a shared context. Takes the host copies NBody reads
+// back itself (NBody::EnableHostExport), so the renderer never waits for the
+// simulation's command queue.
+class CLHostParticleExport : public IParticleExport {
+ public:
+  CLHostParticleExport(NBody& nbody);
+
+  bool TryAndWriteData(GLuint VBO, bool half_precision) override;
+
+ private:
+  NBody& nbody;
+};
+
+// For the host backends, the positions are read and uploaded.
+class HostParticleExport : public IParticleExport {
+ public:
+  HostParticleExport(ISimulationBackend& backend);
+
+  bool TryAndWriteData(GLuint VBO, bool half_precision) override;
+
+ private:
+  ISimulationBackend& backend;
+  std::vector<cl_float4> positions;
+  std::vector<uint64_t> packed;
+};
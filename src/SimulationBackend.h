@@ -0,0 +1,114 @@
+#pragma once
+
+#include <CLPreComp.h>
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "Communication.hpp"
+#include "TripleBuffer.h"
+
+class NBodyTimer {
+ public:
+  float Tick() {
+    auto now = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<float> duration = now - prev;
+    prev = now;
+    return duration.count();
+  }
+  NBodyTimer() : prev(std::chrono::high_resolution_clock::now()) {}
+
+ private:
+  std::chrono::high_resolution_clock::time_point prev;
+};
+
+// Drift weights of the substeps of one step. Yoshida's fourth order method
+// composes three leapfrog substeps.
+inline std::vector<float> IntegratorSubsteps(Integrator integrator) {
+  static constexpr float yoshida_w1 = 1.3512071919596578f;
+  static constexpr float yoshida_w0 = -1.7024143839193153f;
+  if (integrator == Integrator::Yoshida4) {
+    return {yoshida_w1, yoshida_w0, yoshida_w1};
+  }
+  return {1.0f};
+}
+
+// Bytes per particle in the vertex buffers of the renderer, see
+// SimulationSettings::half_precision_export.
+inline constexpr size_t RenderPositionSize(bool half_precision) {
+  return half_precision ? 4 * sizeof(cl_half) : sizeof(cl_float4);
+}
+
+// Hands finished frames from the simulation thread to the renderer. The
+// simulation holds the lock while it moves the particles and publishes a
+// frame once they are consistent again. The renderer only takes a frame
+// that is not being written, so neither of them waits for the other.
+class FrameHandoff {
+ public:
+  // Simulation thread, held while the positions change.
+  void lock() { m_writing.lock(); }
+  void unlock() { m_writing.unlock(); }
+
+  void Publish() {
+    std::lock_guard lock(m_done);
+    newdata = true;
+  }
+  // Keeps the renderer out until the next Publish.
+  void Withdraw() {
+    std::lock_guard lock(m_done);
+    newdata = false;
+  }
+
+  // Renderer, owns the lock if a new frame is ready and nobody writes it.
+  std::unique_lock<FrameHandoff> TryAcquireFrame() {
+    std::lock_guard lock(m_done);
+    if (!newdata || !m_writing.try_lock()) return {};
+    newdata = false;
+    return std::unique_lock<FrameHandoff>(*this, std::adopt_lock);
+  }
+
+ private:
+  std::mutex m_writing;
+  std::mutex m_done;
+  bool newdata = false;
+};
+
+// What the simulation thread drives. The OpenCL engine (NBody) and the CPU
+// engine (CpuNBody) both start from the same ParticleSetDescription and
+// report through the same SimulationData, so the application and the
+// headless runner can swap them. Everything specific to a device or to the
+// renderer stays in the implementation.
+class ISimulationBackend {
+ public:
+  virtual ~ISimulationBackend() = default;
+
+  // Acquires the device, returns whether it succeeded. Called once, before
+  // the first ChangeSettings.
+  virtual bool Init() = 0;
+
+  /// Generates the particles of the current settings.
+  virtual void RegenerateParticles() = 0;
+
+  // Applies the settings, regenerating the particles if they require it.
+  virtual void ChangeSettings(const SimulationSettings& s) = 0;
+
+  virtual void Clean() = 0;
+
+  // Advances the simulation by steps_per_calculate steps.
+  virtual void Calculate() = 0;
+
+  /// Reads the positions in their original order, the mass is in w. Hold
+  /// GetFrames() if the simulation runs on another thread.
+  virtual void ReadPositions(std::vector<cl_float4>& positions) = 0;
+
+  // Timings and diagnostics of the last Calculate.
+  virtual const SimulationData& GetSimulationData() const = 0;
+
+  virtual FrameHandoff& GetFrames() = 0;
+
+  // Writes simulation results to the given buffer
+  void UpdateCommunication(Communication& comm) {
+    comm.SetSimulationData(GetSimulationData());
+  }
+};
@@ -1,11 +1,15 @@
 #include "SimulationSettings.h"
 
 #include <CLPreComp.h>
+#ifndef NBODY_HEADLESS
 #include <imgui.h>
+#endif
 
 #include <functional>
 #include <sstream>
 
+#include "CLDevices.h"
+
 bool SimulationSettings::operator==(const SimulationSettings& other) const {
   return particle_count == other.particle_count &&
          distance_threshold == other.distance_threshold && eps == other.eps &&
@@ -19,10 +23,28 @@ bool SimulationSettings::operator==(const SimulationSettings& other) const {
          position_update_items_per_thread ==
              other.position_update_items_per_thread &&
          barneshut_items_per_thread == other.barneshut_items_per_thread &&
-         divide_by_mass_threads == other.divide_by_mass_threads &&
+         center_of_mass_threads == other.center_of_mass_threads &&
          center_of_mass_items_per_thread ==
              other.center_of_mass_items_per_thread &&
-         allocatedNodes == other.allocatedNodes;
+         allocatedNodes == other.allocatedNodes &&
+         octree_build_method == other.octree_build_method &&
+         radix_sort_work_group_size == other.radix_sort_work_group_size &&
+         reorder_particles_every == other.reorder_particles_every &&
+         force_kernel == other.force_kernel &&
+         barneshut_group_size == other.barneshut_group_size &&
+         fmm_order == other.fmm_order && fmm_list_size == other.fmm_list_size &&
+         fmm_theta == other.fmm_theta &&
+         quadrupole_moments == other.quadrupole_moments &&
+         direct_sum_tile_size == other.direct_sum_tile_size &&
+         direct_sum_below == other.direct_sum_below &&
+         integrator == other.integrator &&
+         energy_diagnostic_every == other.energy_diagnostic_every &&
+         max_rung == other.max_rung &&
+         timestep_accuracy == other.timestep_accuracy &&
+         fixed_timestep == other.fixed_timestep &&
+         steps_per_calculate == other.steps_per_calculate &&
+         half_precision_export == other.half_precision_export &&
+         cl_device == other.cl_device;
 }
 SimulationSettingsEditor::SimulationSettingsEditor()
     : currlayout(DEFAULT_LAYOUT),
@@ -31,11 +53,20 @@ SimulationSettingsEditor::SimulationSettingsEditor()
            DEFAULT_GRAVITATION_CONSTANT, DEFAULT_START_DEPTH,
            DEFAULT_MIN_ENTER_DEPTH, DEFAULT_MAX_DEPTH,
            DEFAULT_POSITION_UPDATE_ITEMS_PER_THREAD,
-           DEFAULT_BARNES_HUT_ITEMS_PER_THREAD, DEFAULT_DIVIDE_BY_MASS_THREADS,
+           DEFAULT_BARNES_HUT_ITEMS_PER_THREAD, DEFAULT_CENTER_OF_MASS_THREADS,
            DEFAULT_CENTER_OF_MASS_ITEMS_PER_THREAD,
            DEFAULT_ALLOCATED_NODES_COUNT, DEFAULT_BOUNDING_BOX_WORK_GROUP_SIZE,
            DEFAULT_MAX_TIME_STEP, DEFAULT_BARNESHUT_STACK_SIZE,
-           DEFAULT_BUILD_OCTREE_STACK_SIZE),
+           DEFAULT_BUILD_OCTREE_STACK_SIZE, DEFAULT_OCTREE_BUILD_METHOD,
+           DEFAULT_RADIX_SORT_WORK_GROUP_SIZE, DEFAULT_REORDER_PARTICLES_EVERY,
+           DEFAULT_FORCE_KERNEL, DEFAULT_BARNESHUT_GROUP_SIZE,
+           DEFAULT_FMM_ORDER, DEFAULT_FMM_LIST_SIZE, DEFAULT_FMM_THETA,
+           DEFAULT_QUADRUPOLE_MOMENTS, DEFAULT_DIRECT_SUM_TILE_SIZE,
+           DEFAULT_DIRECT_SUM_BELOW, DEFAULT_INTEGRATOR,
+           DEFAULT_ENERGY_DIAGNOSTIC_EVERY, DEFAULT_MAX_RUNG,
+           DEFAULT_TIMESTEP_ACCURACY, DEFAULT_FIXED_TIMESTEP,
+           DEFAULT_STEPS_PER_CALCULATE, DEFAULT_HALF_PRECISION_EXPORT,
+           DEFAULT_CL_DEVICE),
       prevlayout(currlayout),
       prev(std::nullopt) {}
 
@@ -45,7 +76,32 @@ size_t SimulationSettings::GetVRAMFromSettings() const {
   ret += particle_count * sizeof(cl_float4) * (1 + 2);
   ret += particle_count * sizeof(ParticleData);
   ret += boundingbox_work_group_size * sizeof(cl_float3) * 2;
+  // 48 bytes per node, was 80 with the 8 child indices.
   ret += allocatedNodes * sizeof(Node);
+  // The compact traversal layout, what the force kernels actually read.
+  ret += allocatedNodes * (sizeof(cl_float4) + sizeof(NodeInfo));
+  // Only what the force kernel needs, see NeedsNodeNext.
+  if (NeedsNodeNext()) {
+    ret += allocatedNodes * sizeof(cl_int);
+  }
+  if (NeedsFmmNodes()) {
+    ret += allocatedNodes * (sizeof(cl_float) + sizeof(LocalExpansion));
+  }
+  if (NeedsNodeQuadrupoles()) {
+    ret += allocatedNodes * sizeof(cl_float8);
+  }
+  // Leaf of every particle
+  ret += particle_count * sizeof(cl_int);
+  // Morton keys and particle indices, double buffered for the radix sort.
+  ret += particle_count * (sizeof(cl_ulong) + sizeof(cl_int)) * 2;
+  ret += RADIX_SORT_BUCKETS * RADIX_SORT_MAX_WORK_GROUPS * sizeof(cl_int);
+  // Reorder scratch buffers and the permutation, also double buffered.
+  ret += particle_count * (sizeof(cl_float4) + sizeof(ParticleData));
+  ret += particle_count * sizeof(cl_int) * 2;
+  // Energy diagnostic sum of every work group
+  ret += (particle_count / direct_sum_tile_size + 1) * sizeof(cl_float8);
+  // Rung of every particle and the active list of the block timesteps
+  ret += particle_count * sizeof(cl_int) * 2;
   return ret;
 }
 
@@ -55,6 +111,23 @@ bool SimulationSettingsEditor::has_anything_changed() const {
   }
   return *prev != curr || prevlayout != currlayout;
 }
+
+std::optional<std::string> SimulationSettingsEditor::rejected_because() const {
+  if (curr.force_kernel == ForceKernel::BarnesHutGroup) {
+    // OpenCL guarantees 32 KB of local memory, the batch takes up to 1 KB.
+    const size_t local_memory = 31 * 1024;
+    const size_t stack_bytes = sizeof(cl_int) * curr.BarnesHutGroupStackSize();
+    if (curr.max_depth < 1 || stack_bytes > local_memory) {
+      std::stringstream s;
+      s << "The Barnes-Hut work group stack for max depth " << curr.max_depth
+        << " does not fit in local memory, the most it holds is "
+        << local_memory / sizeof(cl_int) << " entries.";
+      return s.str();
+    }
+  }
+  return std::nullopt;
+}
+#ifndef NBODY_HEADLESS
 template <typename T>
 inline void ShowResetButton(T& curr, T& prev, const char* id) {
   const bool isDisabled = (prev == curr);
@@ -146,6 +219,94 @@ SimulationSettingsEditor::RenderAndHandleUserInput() {
           return s.gravitational_constant;
         });
 
+    int force_kernel = static_cast<int>(curr.force_kernel);
+    if (ImGui::Combo("Force kernel", &force_kernel, forceKernelNames,
+                     IM_ARRAYSIZE(forceKernelNames))) {
+      curr.force_kernel = static_cast<ForceKernel>(force_kernel);
+    }
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, ForceKernel>(
+        curr, prev, "force kernel",
+        [](SimulationSettings& s) -> ForceKernel& { return s.force_kernel; });
+
+    ImGui::InputFloat("FMM opening angle", &curr.fmm_theta);
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, float>(
+        curr, prev, "fmm opening angle",
+        [](SimulationSettings& s) -> float& { return s.fmm_theta; });
+
+    int integrator = static_cast<int>(curr.integrator);
+    if (ImGui::Combo("Integrator", &integrator, integratorNames,
+                     IM_ARRAYSIZE(integratorNames))) {
+      curr.integrator = static_cast<Integrator>(integrator);
+    }
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, Integrator>(
+        curr, prev, "integrator",
+        [](SimulationSettings& s) -> Integrator& { return s.integrator; });
+
+    ImGui::InputFloat("Fixed timestep (0 = wall clock)", &curr.fixed_timestep,
+                      0.0f, 0.0f, "%g");
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, float>(
+        curr, prev, "fixed timestep",
+        [](SimulationSettings& s) -> float& { return s.fixed_timestep; });
+
+    ImGui::InputInt("Steps per update", &curr.steps_per_calculate);
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, int>(
+        curr, prev, "steps per calculate",
+        [](SimulationSettings& s) -> int& { return s.steps_per_calculate; });
+
+    ImGui::InputInt("Block timestep rungs", &curr.max_rung);
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, int>(
+        curr, prev, "max rung",
+        [](SimulationSettings& s) -> int& { return s.max_rung; });
+
+    ImGui::InputFloat("Timestep accuracy", &curr.timestep_accuracy);
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, float>(
+        curr, prev, "timestep accuracy",
+        [](SimulationSettings& s) -> float& { return s.timestep_accuracy; });
+
+    ImGui::InputInt("Energy diagnostic every N steps",
+                    &curr.energy_diagnostic_every);
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, int>(
+        curr, prev, "energy diagnostic every",
+        [](SimulationSettings& s) -> int& {
+          return s.energy_diagnostic_every;
+        });
+
+    ImGui::InputInt("Direct sum below N particles", &curr.direct_sum_below);
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, int>(
+        curr, prev, "direct sum below",
+        [](SimulationSettings& s) -> int& { return s.direct_sum_below; });
+
+    int build_method = static_cast<int>(curr.octree_build_method);
+    if (ImGui::Combo("Octree build method", &build_method,
+                     octreeBuildMethodNames,
+                     IM_ARRAYSIZE(octreeBuildMethodNames))) {
+      curr.octree_build_method = static_cast<OctreeBuildMethod>(build_method);
+    }
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, OctreeBuildMethod>(
+        curr, prev, "octree build method",
+        [](SimulationSettings& s) -> OctreeBuildMethod& {
+          return s.octree_build_method;
+        });
+
+    ImGui::InputInt("Reorder particles every N steps",
+                    &curr.reorder_particles_every);
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, int>(
+        curr, prev, "reorder particles every",
+        [](SimulationSettings& s) -> int& {
+          return s.reorder_particles_every;
+        });
+
     ImGui::InputInt("Octree minimum depth", &curr.start_depth);
     ImGui::SameLine();
     ShowResetButton<SimulationSettings, int>(
@@ -163,6 +324,31 @@ SimulationSettingsEditor::RenderAndHandleUserInput() {
 
     currlayout.RenderAndHandleUserInput(prevlayout);
 
+    // Enumerated once, "Automatic" is -1.
+    static const std::vector<std::string> device_labels = [] {
+      std::vector<std::string> labels = {"Automatic"};
+      for (const CLDeviceDescription& d : ListCLDevices()) {
+        labels.push_back(d.Label());
+      }
+      return labels;
+    }();
+    static const std::vector<const char*> device_names = [] {
+      std::vector<const char*> names;
+      for (const std::string& label : device_labels) {
+        names.push_back(label.c_str());
+      }
+      return names;
+    }();
+    int device = curr.cl_device + 1;
+    if (ImGui::Combo("OpenCL device", &device, device_names.data(),
+                     static_cast<int>(device_names.size()))) {
+      curr.cl_device = device - 1;
+    }
+    ImGui::SameLine();
+    ShowResetButton<SimulationSettings, int>(
+        curr, prev, "OpenCL device",
+        [](SimulationSettings& s) -> int& { return s.cl_device; });
+
     ImGui::Separator();
     if (ImGui::CollapsingHeader("Super secret settings")) {
       ImGui::InputInt("Barnes-Hut stack size", &curr.barneshut_stack_size);
@@ -171,6 +357,47 @@ SimulationSettingsEditor::RenderAndHandleUserInput() {
           curr, prev, "Barnes-Hut stack size",
           [](SimulationSettings& s) -> int& { return s.barneshut_stack_size; });
 
+      ImGui::InputInt("Barnes-Hut work group size",
+                      &curr.barneshut_group_size);
+      ImGui::SameLine();
+      ShowResetButton<SimulationSettings, int>(
+          curr, prev, "Barnes-Hut work group size",
+          [](SimulationSettings& s) -> int& { return s.barneshut_group_size; });
+
+      ImGui::Checkbox("Barnes-Hut quadrupole moments",
+                      &curr.quadrupole_moments);
+      ImGui::SameLine();
+      ShowResetButton<SimulationSettings, bool>(
+          curr, prev, "Barnes-Hut quadrupole moments",
+          [](SimulationSettings& s) -> bool& { return s.quadrupole_moments; });
+
+      ImGui::InputInt("Direct sum tile size", &curr.direct_sum_tile_size);
+      ImGui::SameLine();
+      ShowResetButton<SimulationSettings, int>(
+          curr, prev, "Direct sum tile size",
+          [](SimulationSettings& s) -> int& { return s.direct_sum_tile_size; });
+
+      ImGui::Checkbox("Half precision render positions",
+                      &curr.half_precision_export);
+      ImGui::SameLine();
+      ShowResetButton<SimulationSettings, bool>(
+          curr, prev, "Half precision render positions",
+          [](SimulationSettings& s) -> bool& {
+            return s.half_precision_export;
+          });
+
+      ImGui::InputInt("FMM order", &curr.fmm_order);
+      ImGui::SameLine();
+      ShowResetButton<SimulationSettings, int>(
+          curr, prev, "FMM order",
+          [](SimulationSettings& s) -> int& { return s.fmm_order; });
+
+      ImGui::InputInt("FMM list size", &curr.fmm_list_size);
+      ImGui::SameLine();
+      ShowResetButton<SimulationSettings, int>(
+          curr, prev, "FMM list size",
+          [](SimulationSettings& s) -> int& { return s.fmm_list_size; });
+
       ImGui::InputInt("Build octree stack size", &curr.build_octree_stack_size);
       ImGui::SameLine();
       ShowResetButton<SimulationSettings, int>(
@@ -188,6 +415,15 @@ SimulationSettingsEditor::RenderAndHandleUserInput() {
             return s.boundingbox_work_group_size;
           });
 
+      ImGui::InputInt("Radix sort work group size",
+                      &curr.radix_sort_work_group_size);
+      ImGui::SameLine();
+      ShowResetButton<SimulationSettings, int>(
+          curr, prev, "Radix sort work group size",
+          [](SimulationSettings& s) -> int& {
+            return s.radix_sort_work_group_size;
+          });
+
       ImGui::InputInt("Min enter depth", &curr.min_enter_depth);
       ImGui::SameLine();
       ShowResetButton<SimulationSettings, int>(
@@ -218,12 +454,13 @@ SimulationSettingsEditor::RenderAndHandleUserInput() {
             return s.barneshut_items_per_thread;
           });
 
-      ImGui::InputInt("Divide by mass threads", &curr.divide_by_mass_threads);
+      ImGui::InputInt("Center of mass threads",
+                      &curr.center_of_mass_threads);
       ImGui::SameLine();
       ShowResetButton<SimulationSettings, int>(
-          curr, prev, "Divide by mass threads",
+          curr, prev, "Center of mass threads",
           [](SimulationSettings& s) -> int& {
-            return s.divide_by_mass_threads;
+            return s.center_of_mass_threads;
           });
 
       ImGui::InputInt("Center of mass items per thread",
@@ -268,9 +505,14 @@ SimulationSettingsEditor::RenderAndHandleUserInput() {
     reset = ImGui::Button("Reset");
     if (!prev.has_value()) ImGui::EndDisabled();
     ImGui::SameLine();
-    if (!has_anything_changed()) ImGui::BeginDisabled();
+    const std::optional<std::string> rejected = rejected_because();
+    if (rejected.has_value()) {
+      ImGui::TextWrapped("%s", rejected->c_str());
+    }
+    const bool can_apply = has_anything_changed() && !rejected.has_value();
+    if (!can_apply) ImGui::BeginDisabled();
     apply = ImGui::Button("Apply");
-    if (!has_anything_changed()) ImGui::EndDisabled();
+    if (!can_apply) ImGui::EndDisabled();
     ImGui::SameLine();
     if (!ison) ImGui::BeginDisabled();
     stop = ImGui::Button("Stop");
@@ -303,6 +545,7 @@ SimulationSettingsEditor::RenderAndHandleUserInput() {
   else
     return std::nullopt;
 }
+#endif
 
 void SimulationSettingsEditor::Apply() {
   crash = std::nullopt;
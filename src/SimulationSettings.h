@@ -1,6 +1,7 @@
 #pragma once
 
 #include <optional>
+#include <string>
 
 #include "Layout.h"
 
@@ -9,12 +10,61 @@ inline constexpr size_t default_allocated_nodes_size_from_start_depth(
   return ((1uLL << (3 * start_depth)) * mult);
 }
 
+// Both build the same octree, the Morton path sorts the particles by their
+// Z-order key first so that every start_depth cell only touches its own
+// particles instead of scanning all of them.
+enum class OctreeBuildMethod { ParticleScan, Morton };
+static constexpr const char* octreeBuildMethodNames[] = {"Particle scan",
+                                                         "Morton codes"};
+
+// Which kernel calculates the forces. The compact one reads the center of
+// mass and a NodeInfo per node instead of the whole Node, the stackless one
+// additionally follows precomputed next indices instead of keeping a stack.
+// The group one walks the tree once per work group with a shared stack.
+// The fast multipole method uses the same octree, but calculates the field
+// once per node instead of once per particle. Direct sum is the exact O(N^2)
+// reference.
+enum class ForceKernel {
+  BarnesHut,
+  BarnesHutCompact,
+  BarnesHutStackless,
+  BarnesHutGroup,
+  FastMultipole,
+  DirectSum
+};
+static constexpr const char* forceKernelNames[] = {
+    "Barnes-Hut", "Barnes-Hut compact", "Barnes-Hut stackless",
+    "Barnes-Hut work group", "Fast multipole", "Direct sum"};
+
+// How the positions and velocities are advanced. The leapfrog (kick-drift-kick)
+// integrator is second order and symplectic, Yoshida4 composes three leapfrog
+// substeps into a fourth order step at the cost of three force evaluations.
+enum class Integrator { Euler, Leapfrog, Yoshida4 };
+static constexpr const char* integratorNames[] = {
+    "Semi-implicit Euler", "Leapfrog (KDK)", "Yoshida 4"};
+
 class SimulationSettingsEditor;
 class NBody;
 struct SimulationSettings {
  public:
   // Will hold invalid data.
   size_t GetVRAMFromSettings() const;
+  // The per node buffers only some force kernels read, NBody allocates a
+  // single element otherwise.
+  // Next index of the stackless traversal
+  bool NeedsNodeNext() const {
+    return force_kernel == ForceKernel::BarnesHutStackless;
+  }
+  // Radius and local expansion of the fast multipole method
+  bool NeedsFmmNodes() const {
+    return force_kernel == ForceKernel::FastMultipole;
+  }
+  bool NeedsNodeQuadrupoles() const {
+    return quadrupole_moments || NeedsFmmNodes();
+  }
+  // Entries of the stack BarnesHutGroup shares per work group. Parents sit
+  // on the levels 0 to max_depth, see the kernel.
+  int BarnesHutGroupStackSize() const { return 56 * max_depth + 8; }
   SimulationSettings() = default;
 
   SimulationSettings(
@@ -23,12 +73,34 @@ struct SimulationSettings {
       const float _gravitational_constant, const int _start_depth,
       const int _min_enter_depth, const int _max_depth,
       const int _position_update_items_per_thread,
-      const int _barneshut_items_per_thread, const int _divide_by_mass_threads,
+      const int _barneshut_items_per_thread, const int _center_of_mass_threads,
       const int _center_of_mass_items_per_thread, const int _allocatedNodes,
       const int _boundingbox_work_group_size, const float _max_timestep,
-      const int _barneshut_stack_size, const int _build_octree_stack_size)
-      : particle_count(_particle_count),
+      const int _barneshut_stack_size, const int _build_octree_stack_size,
+      const OctreeBuildMethod _octree_build_method,
+      const int _radix_sort_work_group_size,
+      const int _reorder_particles_every, const ForceKernel _force_kernel,
+      const int _barneshut_group_size, const int _fmm_order,
+      const int _fmm_list_size, const float _fmm_theta,
+      const bool _quadrupole_moments, const int _direct_sum_tile_size,
+      const int _direct_sum_below, const Integrator _integrator,
+      const int _energy_diagnostic_every, const int _max_rung,
+      const float _timestep_accuracy, const float _fixed_timestep,
+      const int _steps_per_calculate, const bool _half_precision_export,
+      const int _cl_device)
+      : cl_device(_cl_device),
+        particle_count(_particle_count),
         layout(_layout),
+        barneshut_stack_size(_barneshut_stack_size),
+        build_octree_stack_size(_build_octree_stack_size),
+        boundingbox_work_group_size(_boundingbox_work_group_size),
+        radix_sort_work_group_size(_radix_sort_work_group_size),
+        barneshut_group_size(_barneshut_group_size),
+        fmm_order(_fmm_order),
+        fmm_list_size(_fmm_list_size),
+        quadrupole_moments(_quadrupole_moments),
+        direct_sum_tile_size(_direct_sum_tile_size),
+        half_precision_export(_half_precision_export),
         distance_threshold(_distance_threshold),
         eps(_eps),
         gravitational_constant(_gravitational_constant),
@@ -37,13 +109,21 @@ struct SimulationSettings {
         max_depth(_max_depth),
         position_update_items_per_thread(_position_update_items_per_thread),
         barneshut_items_per_thread(_barneshut_items_per_thread),
-        divide_by_mass_threads(_divide_by_mass_threads),
+        center_of_mass_threads(_center_of_mass_threads),
         center_of_mass_items_per_thread(_center_of_mass_items_per_thread),
         allocatedNodes(_allocatedNodes),
-        boundingbox_work_group_size(_boundingbox_work_group_size),
         max_timestep(_max_timestep),
-        barneshut_stack_size(_barneshut_stack_size),
-        build_octree_stack_size(_build_octree_stack_size) {}
+        octree_build_method(_octree_build_method),
+        reorder_particles_every(_reorder_particles_every),
+        force_kernel(_force_kernel),
+        fmm_theta(_fmm_theta),
+        direct_sum_below(_direct_sum_below),
+        integrator(_integrator),
+        energy_diagnostic_every(_energy_diagnostic_every),
+        max_rung(_max_rung),
+        timestep_accuracy(_timestep_accuracy),
+        fixed_timestep(_fixed_timestep),
+        steps_per_calculate(_steps_per_calculate) {}
 
   bool operator==(const SimulationSettings& other) const;
 
@@ -52,6 +132,10 @@ struct SimulationSettings {
   }
 
  public:
+  // Requires a new backend, the application recreates it.
+  // Index into ListCLDevices(), -1 = automatic, see CandidateCLDevices.
+  int cl_device;
+
   // Requires restart
   int particle_count;
   LayoutResultFunction layout;
@@ -62,6 +146,20 @@ struct SimulationSettings {
   int barneshut_stack_size;
   int build_octree_stack_size;
   int boundingbox_work_group_size;
+  int radix_sort_work_group_size;
+  // Work group size of BarnesHutGroup, at least 8.
+  int barneshut_group_size;
+  // 1 = monopoles, 2 = quadrupoles as well
+  int fmm_order;
+  int fmm_list_size;
+  // Barnes-Hut also uses the quadrupoles of the accepted nodes
+  bool quadrupole_moments;
+  // Work group size of DirectSum, also the number of positions in a tile.
+  int direct_sum_tile_size;
+  // The integration writes the positions for the renderer as 4 halves
+  // instead of a float4, the vertex buffers shrink to 8 bytes per particle.
+  // Masses above 65504 saturate, only xyz is drawn.
+  bool half_precision_export;
 
   // Can be changed anytime
   float distance_threshold;
@@ -70,14 +168,40 @@ struct SimulationSettings {
 
   int start_depth;
   int min_enter_depth;
+  // Also sizes the shared stack of BarnesHutGroup, NBody recompiles for it.
   int max_depth;
   int position_update_items_per_thread;
   int barneshut_items_per_thread;
-  int divide_by_mass_threads;
+  int center_of_mass_threads;
   int center_of_mass_items_per_thread;
   int allocatedNodes;
 
   float max_timestep;
+  OctreeBuildMethod octree_build_method;
+  // Sort the particles by their Morton key every this many steps, 0 = never.
+  int reorder_particles_every;
+  ForceKernel force_kernel;
+  // Opening angle of the fast multipole method, at most 1.
+  float fmm_theta;
+  // Below this many particles direct summation replaces the force kernel.
+  int direct_sum_below;
+  Integrator integrator;
+  // Measure the energy and momentum every this many steps, 0 = never. The
+  // potential energy is summed over all pairs.
+  int energy_diagnostic_every;
+  // Block timesteps, particles move with max_timestep / 2^rung where the
+  // rung is at most max_rung. 0 = every particle uses the same step. Always
+  // integrates with the leapfrog, the force of the active particles comes
+  // from the compact Barnes-Hut traversal.
+  int max_rung;
+  // The step of a particle is at most accuracy * sqrt(eps / |a|).
+  float timestep_accuracy;
+  // Every step advances by exactly this much instead of the wall clock delta
+  // time, 0 = use the wall clock clamped to max_timestep.
+  float fixed_timestep;
+  // Steps enqueued back to back per NBody::Calculate, the host only waits at
+  // the end. Meant for benchmarks together with fixed_timestep.
+  int steps_per_calculate;
 
   friend SimulationSettingsEditor;
   friend NBody;
@@ -86,6 +210,16 @@ struct SimulationSettings {
 static constexpr int DEFAULT_BARNESHUT_STACK_SIZE = 512;
 static constexpr int DEFAULT_BUILD_OCTREE_STACK_SIZE = 8;
 static constexpr int DEFAULT_BOUNDING_BOX_WORK_GROUP_SIZE = 256;
+static constexpr int DEFAULT_RADIX_SORT_WORK_GROUP_SIZE = 256;
+static constexpr int DEFAULT_BARNESHUT_GROUP_SIZE = 64;
+static constexpr int DEFAULT_FMM_ORDER = 2;
+static constexpr int DEFAULT_FMM_LIST_SIZE = 512;
+static constexpr bool DEFAULT_QUADRUPOLE_MOMENTS = false;
+static constexpr int DEFAULT_DIRECT_SUM_TILE_SIZE = 256;
+static constexpr bool DEFAULT_HALF_PRECISION_EXPORT = false;
+// Must match RADIX_SORT_BUCKETS in openclkernels.c
+static constexpr int RADIX_SORT_BUCKETS = 16;
+static constexpr int RADIX_SORT_MAX_WORK_GROUPS = 256;
 
 static constexpr int DEFAULT_PARTICLE_COUNT = 100;
 static constexpr float DEFAULT_DISTANCE_THRESHOLD = 0.3f;
@@ -98,9 +232,23 @@ static constexpr float DEFAULT_MAX_TIME_STEP = 0.1f;
 static constexpr size_t DEFAULT_ALLOCATED_NODES_COUNT =
     default_allocated_nodes_size_from_start_depth(DEFAULT_START_DEPTH, 50 * 8);
 static constexpr int DEFAULT_CENTER_OF_MASS_ITEMS_PER_THREAD = 8;
-static constexpr int DEFAULT_DIVIDE_BY_MASS_THREADS = 2048;
+static constexpr int DEFAULT_CENTER_OF_MASS_THREADS = 65536;
 static constexpr int DEFAULT_BARNES_HUT_ITEMS_PER_THREAD = 8;
 static constexpr int DEFAULT_POSITION_UPDATE_ITEMS_PER_THREAD = 16;
+static constexpr OctreeBuildMethod DEFAULT_OCTREE_BUILD_METHOD =
+    OctreeBuildMethod::Morton;
+static constexpr int DEFAULT_REORDER_PARTICLES_EVERY = 16;
+static constexpr ForceKernel DEFAULT_FORCE_KERNEL =
+    ForceKernel::BarnesHutCompact;
+static constexpr float DEFAULT_FMM_THETA = 0.5f;
+static constexpr int DEFAULT_DIRECT_SUM_BELOW = 2048;
+static constexpr Integrator DEFAULT_INTEGRATOR = Integrator::Leapfrog;
+static constexpr int DEFAULT_ENERGY_DIAGNOSTIC_EVERY = 0;
+static constexpr int DEFAULT_MAX_RUNG = 0;
+static constexpr float DEFAULT_TIMESTEP_ACCURACY = 0.025f;
+static constexpr float DEFAULT_FIXED_TIMESTEP = 0.0f;
+static constexpr int DEFAULT_STEPS_PER_CALCULATE = 1;
+static constexpr int DEFAULT_CL_DEVICE = -1;
 static constexpr LayoutSelector::SimulationMode DEFAULT_LAYOUT =
     LayoutSelector::SimulationMode::Galaxy;
 
@@ -123,6 +271,8 @@ class SimulationSettingsEditor {
  private:
   void Apply();
   bool has_anything_changed() const;
+  // Why the current settings cannot be applied, if they cannot.
+  std::optional<std::string> rejected_because() const;
   bool ison = false;
   LayoutSelector currlayout;
   SimulationSettings curr;
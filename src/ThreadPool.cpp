@@ -0,0 +1,126 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <optional>
+
+ThreadPool::ThreadPool(unsigned thread_count) {
+  if (thread_count == 0) {
+    thread_count = std::thread::hardware_concurrency();
+  }
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+  for (unsigned i = 0; i < thread_count; i++) {
+    queues.push_back(std::make_unique<Queue>());
+  }
+  for (unsigned i = 1; i < thread_count; i++) {
+    threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard wake_lock(m_wake);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread& t : threads) {
+    t.join();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t count,
+                             const std::function<void(size_t)>& fun) {
+  if (count == 0) {
+    return;
+  }
+  error = nullptr;
+  remaining = count;
+  // Contiguous runs, so neighbouring tasks stay on the same thread unless
+  // they get stolen.
+  const size_t queue_count = queues.size();
+  for (size_t q = 0; q < queue_count; q++) {
+    const size_t begin = count * q / queue_count;
+    const size_t end = count * (q + 1) / queue_count;
+    std::lock_guard queue_lock(queues[q]->mutex);
+    for (size_t i = begin; i < end; i++) {
+      queues[q]->tasks.push_back({&fun, i});
+    }
+  }
+  {
+    std::lock_guard wake_lock(m_wake);
+    generation++;
+  }
+  wake.notify_all();
+
+  while (TryRunOne(0)) {
+  }
+  {
+    std::unique_lock done_lock(m_done);
+    done.wait(done_lock, [this] { return remaining == 0; });
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t block_size,
+                             const std::function<void(size_t, size_t)>& fun) {
+  const size_t blocks = (count + block_size - 1) / block_size;
+  ParallelFor(blocks, [&](size_t block) {
+    const size_t begin = block * block_size;
+    fun(begin, std::min(begin + block_size, count));
+  });
+}
+
+bool ThreadPool::TryRunOne(unsigned self) {
+  std::optional<Task> task;
+  {
+    std::lock_guard queue_lock(queues[self]->mutex);
+    if (!queues[self]->tasks.empty()) {
+      task = queues[self]->tasks.back();
+      queues[self]->tasks.pop_back();
+    }
+  }
+  for (size_t i = 1; !task && i < queues.size(); i++) {
+    Queue& victim = *queues[(self + i) % queues.size()];
+    std::lock_guard queue_lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.front();
+      victim.tasks.pop_front();
+    }
+  }
+  if (!task) {
+    return false;
+  }
+
+  try {
+    (*task->fun)(task->index);
+  } catch (...) {
+    std::lock_guard done_lock(m_done);
+    if (!error) {
+      error = std::current_exception();
+    }
+  }
+  if (remaining.fetch_sub(1) == 1) {
+    std::lock_guard done_lock(m_done);
+    done.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::WorkerLoop(unsigned self) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock wake_lock(m_wake);
+      wake.wait(wake_lock, [&] { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+    }
+    while (TryRunOne(self)) {
+    }
+  }
+}
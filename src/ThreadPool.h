@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join pool with one task deque per thread. A ParallelFor deals the
+// tasks out in contiguous runs, every thread pops from the back of its own
+// deque and steals from the front of the others once it runs dry, so uneven
+// tasks (dense and sparse regions of the octree) still keep every thread
+// busy. The calling thread works as well.
+class ThreadPool {
+ public:
+  // 0 = one thread per hardware thread
+  explicit ThreadPool(unsigned thread_count = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Including the calling thread.
+  unsigned GetThreadCount() const { return queues.size(); }
+
+  // Runs fun(i) for every i in [0, count) and returns once all of them
+  // finished. Rethrows the first exception of a task. Must not be called
+  // from inside a task.
+  void ParallelFor(size_t count, const std::function<void(size_t)>& fun);
+  // Splits [0, count) into blocks of block_size and runs fun(begin, end) on
+  // every block.
+  void ParallelFor(size_t count, size_t block_size,
+                   const std::function<void(size_t, size_t)>& fun);
+
+ private:
+  struct Task {
+    const std::function<void(size_t)>* fun;
+    size_t index;
+  };
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // Runs one task of its own queue or a stolen one. False if every queue is
+  // empty.
+  bool TryRunOne(unsigned self);
+  void WorkerLoop(unsigned self);
+
+  // queues[0] belongs to the calling thread.
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> threads;
+
+  std::mutex m_wake;
+  std::condition_variable wake;
+  uint64_t generation = 0;
+  bool stopping = false;
+
+  std::atomic<size_t> remaining{0};
+  std::mutex m_done;
+  std::condition_variable done;
+  std::exception_ptr error;
+};
@@ -0,0 +1,77 @@
+#include "Transport.h"
+
+#include <utility>
+
+std::vector<std::vector<char>> AllGather(ITransport& transport,
+                                         std::vector<char> message) {
+  const int rank = transport.Rank();
+  const int size = transport.Size();
+  // Sends never block, so every rank can send before it receives.
+  for (int r = 0; r < size; r++) {
+    if (r != rank) {
+      transport.Send(r, message);
+    }
+  }
+  std::vector<std::vector<char>> result(size);
+  for (int r = 0; r < size; r++) {
+    result[r] = r == rank ? std::move(message) : transport.Receive(r);
+  }
+  return result;
+}
+
+std::vector<std::vector<char>> AllToAll(
+    ITransport& transport, std::vector<std::vector<char>> messages) {
+  const int rank = transport.Rank();
+  const int size = transport.Size();
+  for (int r = 0; r < size; r++) {
+    if (r != rank) {
+      transport.Send(r, std::move(messages[r]));
+    }
+  }
+  std::vector<std::vector<char>> result(size);
+  for (int r = 0; r < size; r++) {
+    result[r] = r == rank ? std::move(messages[r]) : transport.Receive(r);
+  }
+  return result;
+}
+
+LoopbackNetwork::LoopbackNetwork(int size) {
+  for (int i = 0; i < size * size; i++) {
+    mailboxes.push_back(std::make_unique<Mailbox>());
+  }
+  for (int r = 0; r < size; r++) {
+    endpoints.push_back(std::make_unique<Endpoint>(*this, r));
+  }
+}
+
+void LoopbackNetwork::Shutdown() {
+  for (const auto& mailbox : mailboxes) {
+    {
+      std::lock_guard lock(mailbox->mutex);
+      mailbox->closed = true;
+    }
+    mailbox->arrived.notify_all();
+  }
+}
+
+void LoopbackNetwork::Endpoint::Send(int to, std::vector<char> message) {
+  Mailbox& mailbox = network.GetMailbox(rank, to);
+  {
+    std::lock_guard lock(mailbox.mutex);
+    mailbox.messages.push_back(std::move(message));
+  }
+  mailbox.arrived.notify_one();
+}
+
+std::vector<char> LoopbackNetwork::Endpoint::Receive(int from) {
+  Mailbox& mailbox = network.GetMailbox(from, rank);
+  std::unique_lock lock(mailbox.mutex);
+  mailbox.arrived.wait(
+      lock, [&] { return !mailbox.messages.empty() || mailbox.closed; });
+  if (mailbox.messages.empty()) {
+    throw TransportClosed();
+  }
+  std::vector<char> message = std::move(mailbox.messages.front());
+  mailbox.messages.pop_front();
+  return message;
+}
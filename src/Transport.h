@@ -0,0 +1,115 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Message passing between the ranks of DistributedNBody, in the spirit of
+// MPI point to point communication. A message is a byte buffer, the
+// messages from one rank to another arrive in the order they were sent.
+// There are no tags, so every rank has to call the collectives below in the
+// same order.
+class ITransport {
+ public:
+  virtual ~ITransport() = default;
+
+  // This rank, in [0, Size())
+  virtual int Rank() const = 0;
+  virtual int Size() const = 0;
+
+  // Never blocks, the message is buffered until to receives it.
+  virtual void Send(int to, std::vector<char> message) = 0;
+  // Blocks until the next message from from arrives, throws TransportClosed
+  // if it never will.
+  virtual std::vector<char> Receive(int from) = 0;
+};
+
+// Thrown by Receive once the transport was shut down, the sender will never
+// come.
+class TransportClosed : public std::runtime_error {
+ public:
+  TransportClosed() : std::runtime_error("Transport closed") {}
+};
+
+// Every rank sends its message to every other, returns the messages of all
+// ranks indexed by rank, including its own.
+std::vector<std::vector<char>> AllGather(ITransport& transport,
+                                         std::vector<char> message);
+// Sends messages[r] to rank r, returns what every rank sent to this one.
+std::vector<std::vector<char>> AllToAll(
+    ITransport& transport, std::vector<std::vector<char>> messages);
+
+// Byte copies of trivially copyable values, the ranks are assumed to share
+// the same architecture.
+template <class T>
+std::vector<char> Pack(const std::vector<T>& values) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  std::vector<char> message(values.size() * sizeof(T));
+  if (!values.empty()) {
+    std::memcpy(message.data(), values.data(), message.size());
+  }
+  return message;
+}
+
+template <class T>
+std::vector<T> Unpack(const std::vector<char>& message) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  std::vector<T> values(message.size() / sizeof(T));
+  if (!values.empty()) {
+    std::memcpy(values.data(), message.data(), values.size() * sizeof(T));
+  }
+  return values;
+}
+
+// The ranks of one process, every rank runs on its own thread and the
+// messages are handed over in memory. Runs the distributed mode on a single
+// machine without MPI, e.g. in the headless runner.
+class LoopbackNetwork {
+ public:
+  explicit LoopbackNetwork(int size);
+  LoopbackNetwork(const LoopbackNetwork&) = delete;
+  LoopbackNetwork& operator=(const LoopbackNetwork&) = delete;
+
+  int Size() const { return static_cast<int>(endpoints.size()); }
+  // The transport of rank, valid as long as the network.
+  ITransport& Connect(int rank) { return *endpoints[rank]; }
+  // For when a rank failed and the others would wait for it forever. Every
+  // Receive without a message waiting throws TransportClosed from now on.
+  void Shutdown();
+
+ private:
+  struct Mailbox {
+    std::mutex mutex;
+    std::condition_variable arrived;
+    std::deque<std::vector<char>> messages;
+    bool closed = false;
+  };
+
+  class Endpoint : public ITransport {
+   public:
+    Endpoint(LoopbackNetwork& network, int rank)
+        : network(network), rank(rank) {}
+
+    int Rank() const override { return rank; }
+    int Size() const override { return network.Size(); }
+    void Send(int to, std::vector<char> message) override;
+    std::vector<char> Receive(int from) override;
+
+   private:
+    LoopbackNetwork& network;
+    int rank;
+  };
+
+  Mailbox& GetMailbox(int from, int to) {
+    return *mailboxes[from * Size() + to];
+  }
+
+  // One per ordered pair of ranks
+  std::vector<std::unique_ptr<Mailbox>> mailboxes;
+  std::vector<std::unique_ptr<Endpoint>> endpoints;
+};
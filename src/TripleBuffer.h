@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+
+// Lock-free handoff of the newest value from one writer thread to one reader
+// thread. Each of them owns one of the three slots, the third one is shared
+// and swapped with an atomic exchange. The writer always has a slot to fill
+// and the reader keeps its slot until it takes a newer one, so neither of
+// them ever waits for the other. Values the reader missed are overwritten.
+template <class T>
+class TripleBuffer {
+ public:
+  // Writer, the slot it fills.
+  T& Back() { return slots[back]; }
+  // Writer, hands Back() to the reader and continues with another slot.
+  void Publish() {
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  // Reader, takes the newest published slot. False if nothing was published
+  // since the last call, Front() stays the same then.
+  bool Update() {
+    if (!HasNew()) return false;
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+  // Reader, whether Update would take a new value.
+  bool HasNew() const { return middle.load(std::memory_order_relaxed) & FRESH; }
+  // Reader, the slot it took last.
+  const T& Front() const { return slots[front]; }
+
+ private:
+  static constexpr int INDEX = 3;
+  // Set while the shared slot holds a value the reader has not taken.
+  static constexpr int FRESH = 4;
+
+  std::array<T, 3> slots{};
+  int back = 0;
+  std::atomic<int> middle{1};
+  int front = 2;
+};
@@ -0,0 +1,68 @@
+// Drives Communication the way main.cpp's simulation thread does and checks
+// that a paused thread sleeps in WaitForWork, wakes up on SetRunning and on
+// applied settings, and can be joined after SetShutDown. Returns non-zero on
+// failure.
+#include <CLPreComp.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "Communication.hpp"
+
+namespace {
+
+bool Check(bool condition, const char* what) {
+  if (!condition) std::cerr << "FAILED: " << what << std::endl;
+  return condition;
+}
+
+}  // namespace
+
+int main() {
+  using namespace std::chrono_literals;
+  SimulationSettingsEditor editor;
+  Communication comm(editor.GetCurrSettings());
+  std::atomic<int> steps = 0;
+  std::atomic<int> settings_taken = 0;
+
+  std::thread simulation([&] {
+    do {
+      comm.WaitForWork();
+      if (comm.TakeNewSettings()) settings_taken++;
+      if (comm.GetRunning()) {
+        steps++;
+        std::this_thread::sleep_for(1ms);
+      }
+    } while (!comm.GetShutDown());
+  });
+
+  bool ok = true;
+  std::this_thread::sleep_for(100ms);
+  ok &= Check(steps == 0, "the paused thread did not step");
+
+  comm.SetRunning(true);
+  std::this_thread::sleep_for(50ms);
+  comm.SetRunning(false);
+  ok &= Check(steps > 0, "SetRunning(true) woke the thread");
+
+  // Let a step that was already in flight finish.
+  std::this_thread::sleep_for(10ms);
+  const int paused_at = steps;
+  std::this_thread::sleep_for(100ms);
+  ok &= Check(steps == paused_at, "the thread stopped stepping after pause");
+
+  SimulationSettingsEditor::Command apply;
+  apply.apply_changes = true;
+  comm.Handle(editor, apply);
+  std::this_thread::sleep_for(50ms);
+  ok &= Check(settings_taken == 1, "Handle woke the thread for new settings");
+  ok &= Check(steps == paused_at, "new settings did not unpause the thread");
+
+  comm.SetShutDown(true);
+  simulation.join();
+  std::cout << "Communication check " << (ok ? "passed" : "failed")
+            << std::endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,504 @@
+// Runs the simulation without a window or an OpenGL context, on any OpenCL
+// device. The settings start from the defaults of the interactive
+// application and are overridden from the command line.
+#include <CLPreComp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Communication.hpp"
+#include "CpuNBody.h"
+#include "DistributedNBody.h"
+#include "MultiDeviceNBody.h"
+#include "NBody.h"
+#include "Transport.h"
+
+namespace {
+
+// Command line names, in the order of the enums.
+constexpr const char* backendOptions[] = {"opencl", "cpu", "multi",
+                                          "distributed"};
+enum class Backend { OpenCL, Cpu, MultiDevice, Distributed };
+constexpr const char* layoutOptions[] = {"galaxy", "clashing", "uniform"};
+constexpr const char* forceKernelOptions[] = {
+    "barneshut", "compact", "stackless", "group", "fmm", "direct"};
+constexpr const char* integratorOptions[] = {"euler", "leapfrog", "yoshida4"};
+constexpr const char* octreeBuildOptions[] = {"scan", "morton"};
+
+// Timings that are averaged over the calls of NBody::Calculate.
+constexpr std::pair<const char*, float SimulationData::*> stages[] = {
+    {"Bounding box 1", &SimulationData::boundingboxstage1ms},
+    {"Bounding box 2", &SimulationData::boundingboxstage2ms},
+    {"Init octree", &SimulationData::initOctreems},
+    {"Morton codes", &SimulationData::mortonCodesms},
+    {"Radix sort", &SimulationData::radixSortms},
+    {"Reorder", &SimulationData::reorderms},
+    {"Build octree", &SimulationData::buildOctreems},
+    {"Center of mass", &SimulationData::centerofMassms},
+    {"Thread octree", &SimulationData::threadOctreems},
+    {"Force", &SimulationData::barneshutms},
+    {"FMM interactions", &SimulationData::fmmInteractionsms},
+    {"FMM evaluate", &SimulationData::fmmEvaluatems},
+    {"Position update", &SimulationData::positionupdatems},
+    {"Essential tree exchange", &SimulationData::exchangems},
+    {"Migration", &SimulationData::migratems},
+    {"Energy", &SimulationData::energyms}};
+
+// Per device of the multi device backend, averaged like the stages.
+constexpr std::pair<const char*, float SimulationData::DeviceTimings::*>
+    deviceStages[] = {
+        {"upload", &SimulationData::DeviceTimings::uploadms},
+        {"build", &SimulationData::DeviceTimings::buildOctreems},
+        {"center of mass", &SimulationData::DeviceTimings::centerofMassms},
+        {"force", &SimulationData::DeviceTimings::barneshutms},
+        {"download", &SimulationData::DeviceTimings::downloadms}};
+
+struct Options {
+  Backend backend = Backend::OpenCL;
+  // CPU backend, 0 = one per hardware thread. Shared by the ranks of the
+  // distributed backend.
+  unsigned threads = 0;
+  // CPU backend, empty = the widest one the CPU supports
+  std::string simd;
+  // -1 = any, GPUs first
+  int platform = -1;
+  int device = -1;
+  // Multi device backend, the first this many of the devices above, 0 = all
+  int devices = 0;
+  // Multi device backend, splits the first device above instead
+  int sub_devices = 0;
+  // Distributed backend, every rank runs on its own thread of this process
+  int ranks = 2;
+  int steps = 100;
+  // Print the timings of every this many calls, 0 = only the summary.
+  int print_every = 0;
+  bool list_devices = false;
+  // Final positions in their original order, one "x y z" line per particle.
+  std::string output;
+};
+
+void PrintUsage(const char* name) {
+  std::cout
+      << "Usage: " << name << " [options]\n"
+      << "  --list-devices        List the OpenCL devices and exit\n"
+      << "  --backend B           opencl, cpu, multi, distributed\n"
+      << "  --threads N           Threads of the CPU backend (all)\n"
+      << "  --simd S              scalar, avx2, avx512 (the widest supported)\n"
+      << "  --platform P          Platform index (any)\n"
+      << "  --device D            Device index within the platform (any)\n"
+      << "  --devices N           Devices of the multi backend (all)\n"
+      << "  --sub-devices N       Split one device into N for the multi\n"
+      << "                        backend\n"
+      << "  --ranks N             Ranks of the distributed backend, on one\n"
+      << "                        loopback network (2)\n"
+      << "  --steps N             Simulation steps to run (100)\n"
+      << "  --batch K             Steps enqueued per Calculate call (1)\n"
+      << "  --particles N         Particle count\n"
+      << "  --layout L            galaxy, clashing, uniform\n"
+      << "  --force-kernel K      barneshut, compact, stackless, group, fmm,\n"
+      << "                        direct\n"
+      << "  --integrator I        euler, leapfrog, yoshida4\n"
+      << "  --octree M            scan, morton\n"
+      << "  --dt X                Fixed timestep (defaults to the max "
+         "timestep)\n"
+      << "  --theta X             Barnes-Hut distance threshold\n"
+      << "  --fmm-theta X         Opening angle of the fast multipole method\n"
+      << "  --fmm-order N         1 = monopoles, 2 = quadrupoles\n"
+      << "  --quadrupoles         Barnes-Hut uses quadrupole moments\n"
+      << "  --eps X               Softening\n"
+      << "  --G X                 Gravitational constant\n"
+      << "  --nodes N             Allocated octree nodes\n"
+      << "  --reorder-every N     Morton reorder period, 0 = never\n"
+      << "  --direct-below N      Direct summation below this many particles\n"
+      << "  --max-rung N          Block timestep rungs, 0 = off\n"
+      << "  --energy-every N      Energy diagnostic period, 0 = off\n"
+      << "  --print-every N       Print the timings every N calls\n"
+      << "  --output FILE         Write the final positions to FILE\n";
+}
+
+template <std::size_t N>
+int ParseName(const std::string& value, const char* const (&names)[N]) {
+  for (std::size_t i = 0; i < N; i++) {
+    if (value == names[i]) return static_cast<int>(i);
+  }
+  throw std::invalid_argument("Unknown value: " + value);
+}
+
+// Throws std::invalid_argument (or std::out_of_range from std::stoi) on
+// malformed input.
+Options ParseArguments(int argc, char* argv[], SimulationSettings& s) {
+  Options o;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    auto next = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::invalid_argument("Missing value for " + arg);
+      return argv[++i];
+    };
+    if (arg == "--list-devices") {
+      o.list_devices = true;
+    } else if (arg == "--backend") {
+      o.backend = static_cast<Backend>(ParseName(next(), backendOptions));
+    } else if (arg == "--threads") {
+      o.threads = std::stoi(next());
+    } else if (arg == "--simd") {
+      o.simd = next();
+    } else if (arg == "--platform") {
+      o.platform = std::stoi(next());
+    } else if (arg == "--device") {
+      o.device = std::stoi(next());
+    } else if (arg == "--devices") {
+      o.devices = std::stoi(next());
+    } else if (arg == "--sub-devices") {
+      o.sub_devices = std::stoi(next());
+    } else if (arg == "--ranks") {
+      o.ranks = std::stoi(next());
+    } else if (arg == "--steps") {
+      o.steps = std::stoi(next());
+    } else if (arg == "--batch") {
+      s.steps_per_calculate = std::stoi(next());
+    } else if (arg == "--particles") {
+      s.particle_count = std::stoi(next());
+    } else if (arg == "--layout") {
+      s.layout = LayoutSelector(static_cast<LayoutSelector::SimulationMode>(
+                                    ParseName(next(), layoutOptions)))
+                     .GetResult();
+    } else if (arg == "--force-kernel") {
+      s.force_kernel =
+          static_cast<ForceKernel>(ParseName(next(), forceKernelOptions));
+    } else if (arg == "--integrator") {
+      s.integrator =
+          static_cast<Integrator>(ParseName(next(), integratorOptions));
+    } else if (arg == "--octree") {
+      s.octree_build_method =
+          static_cast<OctreeBuildMethod>(ParseName(next(), octreeBuildOptions));
+    } else if (arg == "--dt") {
+      s.fixed_timestep = std::stof(next());
+    } else if (arg == "--theta") {
+      s.distance_threshold = std::stof(next());
+    } else if (arg == "--fmm-theta") {
+      s.fmm_theta = std::stof(next());
+    } else if (arg == "--fmm-order") {
+      s.fmm_order = std::stoi(next());
+    } else if (arg == "--quadrupoles") {
+      s.quadrupole_moments = true;
+    } else if (arg == "--eps") {
+      s.eps = std::stof(next());
+    } else if (arg == "--G") {
+      s.gravitational_constant = std::stof(next());
+    } else if (arg == "--nodes") {
+      s.allocatedNodes = std::stoi(next());
+    } else if (arg == "--reorder-every") {
+      s.reorder_particles_every = std::stoi(next());
+    } else if (arg == "--direct-below") {
+      s.direct_sum_below = std::stoi(next());
+    } else if (arg == "--max-rung") {
+      s.max_rung = std::stoi(next());
+    } else if (arg == "--energy-every") {
+      s.energy_diagnostic_every = std::stoi(next());
+    } else if (arg == "--print-every") {
+      o.print_every = std::stoi(next());
+    } else if (arg == "--output") {
+      o.output = next();
+    } else {
+      throw std::invalid_argument("Unknown option: " + arg);
+    }
+  }
+  if (o.steps < 1) throw std::invalid_argument("--steps must be positive");
+  if (o.ranks < 1) throw std::invalid_argument("--ranks must be positive");
+  if (s.steps_per_calculate < 1)
+    throw std::invalid_argument("--batch must be positive");
+  // The wall clock has nothing to do with the simulated time here.
+  if (s.fixed_timestep <= 0) s.fixed_timestep = s.max_timestep;
+  return o;
+}
+
+void ListDevices() {
+  int platform = -1;
+  for (const CLDeviceDescription& d : ListCLDevices()) {
+    if (d.platform != platform) {
+      platform = d.platform;
+      std::cout << "Platform " << d.platform << ": " << d.platform_name
+                << std::endl;
+    }
+    std::cout << "  Device " << d.device << ": " << d.Label()
+              << (d.gl_sharing ? ", GL sharing" : "") << std::endl;
+  }
+}
+
+void PrintTimings(const SimulationData& data) {
+  for (const auto& [name, field] : stages) {
+    if (data.*field > 0) {
+      std::cout << "  " << name << ": " << data.*field << "ms" << std::endl;
+    }
+  }
+  for (int d = 0; d < data.deviceCount; d++) {
+    const SimulationData::DeviceTimings& t = data.devices[d];
+    std::cout << "  Device " << d << ": " << t.particles << " particles, "
+              << t.imported << " imported";
+    for (const auto& [name, field] : deviceStages) {
+      std::cout << ", " << name << " " << t.*field << "ms";
+    }
+    std::cout << std::endl;
+  }
+}
+
+// The devices of the multi device backend, see Options.
+std::vector<cl::Device> SelectDevices(const Options& o) {
+  const std::vector<CLDeviceDescription> candidates =
+      CandidateCLDevices(o.platform, o.device);
+  if (candidates.empty())
+    throw cl::Error(CL_DEVICE_NOT_FOUND, "No such OpenCL device");
+  if (o.sub_devices > 0) {
+    return SplitCLDevice(GetCLDevice(candidates[0]), o.sub_devices);
+  }
+  std::vector<cl::Device> devices;
+  for (const CLDeviceDescription& d : candidates) {
+    if (o.devices > 0 && devices.size() >= static_cast<size_t>(o.devices))
+      break;
+    devices.push_back(GetCLDevice(d));
+  }
+  return devices;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  SimulationSettingsEditor editor;
+  SimulationSettings settings = editor.GetCurrSettings();
+  Options options;
+  try {
+    options = ParseArguments(argc, argv, settings);
+  } catch (const std::logic_error& e) {
+    std::cerr << e.what() << std::endl;
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  try {
+    if (options.list_devices) {
+      ListDevices();
+      return 0;
+    }
+  } catch (cl::Error error) {
+    std::cerr << error.what() << "(" << oclErrorString(error.err()) << ")"
+              << std::endl;
+    return 1;
+  }
+
+  std::unique_ptr<ISimulationBackend> backend;
+  CpuNBody* cpu = nullptr;
+  NBody* gpu = nullptr;
+  MultiDeviceNBody* multi = nullptr;
+  // Ranks 1 and up of the distributed backend, rank 0 is backend.
+  std::unique_ptr<LoopbackNetwork> network;
+  std::vector<std::unique_ptr<DistributedNBody>> peers;
+  if (options.backend == Backend::Distributed) {
+    network = std::make_unique<LoopbackNetwork>(options.ranks);
+    unsigned threads = options.threads > 0
+                           ? options.threads
+                           : std::thread::hardware_concurrency();
+    threads = std::max(threads / options.ranks, 1u);
+    for (int r = 0; r < options.ranks; r++) {
+      auto rank = std::make_unique<DistributedNBody>(
+          settings, network->Connect(r), threads);
+      if (r == 0) {
+        backend = std::move(rank);
+      } else {
+        peers.push_back(std::move(rank));
+      }
+    }
+  } else if (options.backend == Backend::MultiDevice) {
+    std::vector<cl::Device> devices;
+    try {
+      devices = SelectDevices(options);
+    } catch (cl::Error error) {
+      std::cerr << error.what() << "(" << oclErrorString(error.err()) << ")"
+                << std::endl;
+      return 1;
+    }
+    auto multi_backend =
+        std::make_unique<MultiDeviceNBody>(settings, devices, options.threads);
+    multi = multi_backend.get();
+    backend = std::move(multi_backend);
+  } else if (options.backend == Backend::Cpu) {
+    auto cpu_backend = std::make_unique<CpuNBody>(settings, options.threads);
+    cpu = cpu_backend.get();
+    backend = std::move(cpu_backend);
+    if (!options.simd.empty()) {
+      const auto kernel = FindInteractionKernel(options.simd);
+      if (!kernel) {
+        std::cerr << "Unknown or unsupported SIMD kernel: " << options.simd
+                  << std::endl;
+        return 1;
+      }
+      cpu->SetInteractionKernel(*kernel);
+    }
+  } else {
+    CLDeviceSelection target;
+    target.platform = options.platform;
+    target.device = options.device;
+    auto gpu_backend = std::make_unique<NBody>(settings, target);
+    gpu = gpu_backend.get();
+    backend = std::move(gpu_backend);
+  }
+  if (!backend->Init()) {
+    std::cerr << "Failed to initialise the backend" << std::endl;
+    return 1;
+  }
+
+  const int batch = settings.steps_per_calculate;
+  const int calls = (options.steps + batch - 1) / batch;
+  // The other ranks make the same calls as backend, on their own threads.
+  // A rank that fails shuts the network down, so the others stop waiting
+  // for it.
+  std::vector<std::thread> peer_threads;
+  std::atomic<bool> peer_failed = false;
+  for (const auto& peer : peers) {
+    peer_threads.emplace_back([&, rank = peer.get()] {
+      try {
+        rank->ChangeSettings(settings);
+        for (int call = 0; call < calls; call++) {
+          rank->Calculate();
+        }
+      } catch (const std::exception& ex) {
+        std::cerr << "Rank " << rank->GetRank() << ": " << ex.what()
+                  << std::endl;
+        peer_failed = true;
+        network->Shutdown();
+      }
+    });
+  }
+  const auto join_peers = [&](bool failed) {
+    if (failed && network) {
+      network->Shutdown();
+    }
+    for (std::thread& thread : peer_threads) {
+      if (thread.joinable()) thread.join();
+    }
+  };
+  SimulationData sum;
+  SimulationData last;
+  std::chrono::duration<double> elapsed(0);
+  try {
+    // Builds the program, allocates the buffers and generates the particles.
+    backend->ChangeSettings(settings);
+
+    for (int call = 0; call < calls; call++) {
+      const auto start = std::chrono::steady_clock::now();
+      backend->Calculate();
+      elapsed += std::chrono::steady_clock::now() - start;
+
+      last = backend->GetSimulationData();
+      for (const auto& [name, field] : stages) sum.*field += last.*field;
+      sum.interactions += last.interactions;
+      sum.deviceCount = last.deviceCount;
+      for (int d = 0; d < last.deviceCount; d++) {
+        sum.devices[d].particles = last.devices[d].particles;
+        sum.devices[d].imported = last.devices[d].imported;
+        for (const auto& [name, field] : deviceStages)
+          sum.devices[d].*field += last.devices[d].*field;
+      }
+      sum.activeUpdates += last.activeUpdates;
+      if (last.energyMeasured) sum.energyDrift = last.energyDrift;
+
+      if (options.print_every > 0 && (call + 1) % options.print_every == 0) {
+        std::cout << "Step " << (call + 1) * batch << ", used nodes "
+                  << last.usedNodes << ":" << std::endl;
+        PrintTimings(last);
+      }
+    }
+
+    join_peers(false);
+    if (peer_failed) {
+      return 1;
+    }
+
+    if (!options.output.empty()) {
+      std::vector<cl_float4> positions;
+      backend->ReadPositions(positions);
+      // Every rank only writes its own particles
+      for (const auto& peer : peers) {
+        peer->ReadPositions(positions);
+      }
+      std::ofstream file(options.output);
+      for (const cl_float4& p : positions) {
+        file << p.s[0] << " " << p.s[1] << " " << p.s[2] << "\n";
+      }
+    }
+  } catch (const std::exception& ex) {
+    // TransportClosed if a peer failed
+    std::cerr << ex.what() << std::endl;
+    join_peers(true);
+    return 1;
+  }
+  backend->Clean();
+  for (const auto& peer : peers) {
+    peer->Clean();
+  }
+
+  const int steps = calls * batch;
+  std::cout << "Backend: " << backendOptions[static_cast<int>(options.backend)]
+            << ", particles: " << settings.particle_count
+            << ", steps: " << steps << ", force kernel: "
+            << forceKernelNames[static_cast<int>(settings.force_kernel)]
+            << ", integrator: "
+            << integratorNames[static_cast<int>(settings.integrator)]
+            << std::endl;
+  if (cpu) {
+    std::cout << "SIMD kernel: " << cpu->GetInteractionKernel().name
+              << std::endl;
+  }
+  if (gpu) {
+    std::cout << "Device: " << gpu->GetDevice().getInfo<CL_DEVICE_NAME>()
+              << std::endl;
+  }
+  if (multi) {
+    for (int d = 0; d < multi->GetDeviceCount(); d++) {
+      std::cout << "Device " << d << ": "
+                << multi->GetDevice(d).getInfo<CL_DEVICE_NAME>() << std::endl;
+    }
+  }
+  if (options.backend == Backend::Distributed) {
+    std::vector<const ISimulationBackend*> ranks = {backend.get()};
+    for (const auto& peer : peers) {
+      ranks.push_back(peer.get());
+    }
+    for (size_t r = 0; r < ranks.size(); r++) {
+      const SimulationData& data = ranks[r]->GetSimulationData();
+      std::cout << "Rank " << r << ": " << data.ownParticles
+                << " particles, " << data.importedParticles << " imported"
+                << std::endl;
+    }
+    std::cout << "Load imbalance: " << last.loadImbalance
+              << ", rebalanced: " << last.rebalances << " times"
+              << std::endl;
+  }
+  std::cout << "Average per Calculate call:" << std::endl;
+  for (const auto& [name, field] : stages) sum.*field /= calls;
+  for (int d = 0; d < sum.deviceCount; d++) {
+    for (const auto& [name, field] : deviceStages)
+      sum.devices[d].*field /= calls;
+  }
+  PrintTimings(sum);
+  if (sum.interactions > 0)
+    std::cout << "Interactions: " << sum.interactions << ", "
+              << sum.interactions / elapsed.count() << "/s" << std::endl;
+  if (settings.max_rung > 0)
+    std::cout << "Active updates: " << sum.activeUpdates << std::endl;
+  if (settings.energy_diagnostic_every > 0)
+    std::cout << "Energy drift: " << sum.energyDrift << std::endl;
+  std::cout << "Wall time: " << elapsed.count() << "s, "
+            << steps / elapsed.count() << " steps/s" << std::endl;
+  return 0;
+}
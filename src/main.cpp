@@ -14,17 +14,27 @@
 
 // standard
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
 
+#include "CLDevices.h"
 #include "Communication.hpp"
+#include "CpuNBody.h"
 #include "MyApp.h"
 #include "NBody.h"
-void SecondThreadFunction(NBody& body, Communication& comm) {
+#include "ParticleExport.h"
+#include "SimulationBackend.h"
+void SecondThreadFunction(ISimulationBackend& body, Communication& comm) {
   do {
+    // Sleeps while paused, a command wakes it.
+    comm.WaitForWork();
     try {
-      if (comm.GetChangesOrFalseAndReset()) {
-        auto newsettings = comm.GetNewSettings();
+      if (comm.TakeNewSettings()) {
+        const SettingChanges& newsettings = comm.GetNewSettings();
         if (newsettings.only_regenerate) {
           body.RegenerateParticles();
         }
@@ -40,7 +50,7 @@ void SecondThreadFunction(NBody& body, Communication& comm) {
       comm.SetRunning(false);
       comm.SetCrashed(ex);
     }
-  } while (!comm.GetShutDownOrFalse());
+  } while (!comm.GetShutDown());
 
   std::cout << "Other thread stopping" << std::endl;
 }
@@ -183,7 +193,39 @@ int main(int argc, char* args[]) {
   // Create NBody Simulation
   {
     SimulationSettingsEditor SSE;
-    NBody nbody(SSE.GetCurrSettings());
+    // "--backend cpu" simulates on the CPU, otherwise OpenCL, by default on
+    // a context shared with OpenGL. "--platform P --device D" selects the
+    // OpenCL device like the headless runner, the settings can change it.
+    bool use_cpu = false;
+    int platform = -1;
+    int device = -1;
+    try {
+      for (int i = 1; i + 1 < argc; i++) {
+        const std::string arg = args[i];
+        if (arg == "--backend") {
+          use_cpu = std::string(args[i + 1]) == "cpu";
+        } else if (arg == "--platform") {
+          platform = std::stoi(args[i + 1]);
+        } else if (arg == "--device") {
+          device = std::stoi(args[i + 1]);
+        }
+      }
+    } catch (const std::logic_error& e) {
+      SDL_LogError(SDL_LOG_CATEGORY_ERROR, "[arguments] %s", e.what());
+      return 1;
+    }
+    if (platform >= 0 || device >= 0) {
+      const std::vector<CLDeviceDescription> devices = ListCLDevices();
+      const std::vector<CLDeviceDescription> candidates =
+          CandidateCLDevices(platform, device);
+      for (size_t i = 0; i < devices.size() && !candidates.empty(); i++) {
+        if (devices[i].platform == candidates[0].platform &&
+            devices[i].device == candidates[0].device) {
+          SSE.GetCurrSettings().cl_device = static_cast<int>(i);
+        }
+      }
+    }
+    std::unique_ptr<ISimulationBackend> backend;
     Communication comm = Communication(SSE.GetCurrSettings());
     // When this mutex is unlocked, then the nbody sim stops.
 
@@ -208,14 +250,54 @@ int main(int argc, char* args[]) {
         return 1;
       }
 
-      if (!nbody.InitCL(app.GetVBOAddresses())) {
+      // Copies the frames into the vertex buffers of the app.
+      std::unique_ptr<IParticleExport> particle_export;
+      // Creates the backend on the device of the current settings, the
+      // simulation thread must not run.
+      int backend_device = SSE.GetCurrSettings().cl_device;
+      auto create_backend = [&]() {
+        particle_export.reset();
+        if (backend) backend->Clean();
+        backend.reset();
+
+        backend_device = SSE.GetCurrSettings().cl_device;
+        NBody* nbody = nullptr;
+        if (use_cpu) {
+          backend = std::make_unique<CpuNBody>(SSE.GetCurrSettings());
+        } else {
+          CLDeviceSelection target;
+          target.share_gl = true;
+          const std::vector<CLDeviceDescription> devices = ListCLDevices();
+          if (backend_device >= 0 &&
+              static_cast<size_t>(backend_device) < devices.size()) {
+            target.platform = devices[backend_device].platform;
+            target.device = devices[backend_device].device;
+          }
+          auto gpu = std::make_unique<NBody>(SSE.GetCurrSettings(), target);
+          nbody = gpu.get();
+          backend = std::move(gpu);
+        }
+        if (!backend->Init()) {
+          return false;
+        }
+        if (nbody && nbody->SharesGL()) {
+          particle_export = std::make_unique<CLGLParticleExport>(*nbody);
+        } else if (nbody) {
+          particle_export = std::make_unique<CLHostParticleExport>(*nbody);
+        } else {
+          particle_export = std::make_unique<HostParticleExport>(*backend);
+        }
+        return true;
+      };
+
+      if (!create_backend()) {
         SDL_LogError(
             SDL_LOG_CATEGORY_ERROR,
             "[nbody.Init] Error during the initialization of the application!");
         return 1;
       }
-
-      t = std::thread(SecondThreadFunction, std::ref(nbody), std::ref(comm));
+      t = std::thread(SecondThreadFunction, std::ref(*backend),
+                      std::ref(comm));
 
       // Because the rendering is only updated when something changes, we need
       // to first render twice to account for the initial swap buffers.
@@ -294,7 +376,8 @@ int main(int argc, char* args[]) {
              static_cast<float>(CurrentTick - LastTick) / 1000.0f};
         LastTick = CurrentTick;  // Mentsük el utolsóként az aktuális "tick"-et!
 
-        bool updateddata = nbody.TryAndWriteData();
+        bool updateddata = particle_export->TryAndWriteData(
+            app.GetNextVBO(), app.GetHalfPrecision());
         if (updateddata) {
           app.UpdatedParticles();
         }
@@ -317,10 +400,41 @@ int main(int argc, char* args[]) {
           SSE.SetCrashed(std::nullopt);
         }
         if (cmd.has_value()) {
+          // A new device needs a new backend. The old simulation thread is
+          // stopped before the change is handed over, otherwise it could
+          // apply the settings to the old backend and the new one would
+          // start without a program.
+          const bool switch_device =
+              cmd->apply_changes && !use_cpu &&
+              SSE.GetCurrSettings().cl_device != backend_device;
+          if (switch_device) {
+            comm.SetShutDown(true);
+            t.join();
+            comm.SetShutDown(false);
+            if (!create_backend()) {
+              SSE.SetCrashed(CustomCLError(
+                  cl::Error(CL_DEVICE_NOT_AVAILABLE),
+                  "Failed to initialise the selected OpenCL device"));
+              SSE.GetCurrSettings().cl_device = DEFAULT_CL_DEVICE;
+              if (!create_backend()) {
+                SDL_LogError(SDL_LOG_CATEGORY_ERROR,
+                             "[nbody.Init] No usable OpenCL device left!");
+                quit = true;
+              }
+            }
+          }
+          // The new thread takes these settings first.
           comm.Handle(SSE, *cmd);
+          if (switch_device && !quit) {
+            t = std::thread(SecondThreadFunction, std::ref(*backend),
+                            std::ref(comm));
+          }
+          const SimulationSettings& applied = SSE.GetCurrSettings();
           if (cmd->apply_changes &&
-              SSE.GetCurrSettings().particle_count != app.GetParticleCount()) {
-            app.SetParticleCount(SSE.GetCurrSettings().particle_count);
+              (applied.particle_count != app.GetParticleCount() ||
+               applied.half_precision_export != app.GetHalfPrecision())) {
+            app.SetParticleCount(applied.particle_count,
+                                 applied.half_precision_export);
           }
         }
         comm.RenderSimulationResults();
@@ -351,8 +465,8 @@ int main(int argc, char* args[]) {
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
 
-    t.join();
-    nbody.Clean();
+    if (t.joinable()) t.join();
+    if (backend) backend->Clean();
     // OpenCL has ties to the SDL context.
   }
 
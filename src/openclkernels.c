@@ -7,13 +7,34 @@ typedef struct {
   float4 center_of_mass;
   float3 region_size;
   int isLeaf;  // 0 = isLeaf, 1 = Parent, 2 = Empty
-  int children[8];
-  // Size is 68 bytes :c
-  int padding[3];
-  // This way size is 80, which matches the alignment of the largest member
-  // float3(float4) of 16 bytes.
+  // The 8 children are always allocated next to each other.
+  int first_child;
+  // -1 for the root. Used by CalculateCenterOfMass to walk back up.
+  int parent;
+  // Number of children whose center of mass is already final.
+  int finished_children;
+  // Size is 48, a multiple of the float3(float4) alignment of 16 bytes.
 } Node;
 
+// The part of a node the traversal needs besides the center of mass, which is
+// kept in a separate float4 array. 24 bytes per visited node instead of 48.
+typedef struct {
+  // Largest side of the cell.
+  float size;
+  // -1 if the node has no children.
+  int first_child;
+} NodeInfo;
+
+// Acceleration field around the center of mass of a node, to first order:
+// a(x) = acc + J (x - center of mass) with the symmetric Jacobian J.
+typedef struct {
+  float4 acc;
+  // xx, yy, zz
+  float4 jacobian_diagonal;
+  // xy, xz, yz
+  float4 jacobian_off_diagonal;
+} LocalExpansion;
+
 #define isLeaf_LEAF 2
 #define isLeaf_PARENT 1
 #define isLeaf_EMPTY 0
@@ -27,16 +48,81 @@ typedef struct {
 #ifndef BUILD_OCTREE_STACK_SIZE
 #define BUILD_OCTREE_STACK_SIZE 8
 #endif
+// Sized from the max depth, see BarnesHutGroup
+#ifndef BARNESHUT_GROUP_STACK_SIZE
+#define BARNESHUT_GROUP_STACK_SIZE 1016
+#endif
 #ifndef BOUNDINGBOX_WORK_GROUP_SIZE
 #define BOUNDINGBOX_WORK_GROUP_SIZE 256
 #endif
+#ifndef RADIX_SORT_WORK_GROUP_SIZE
+#define RADIX_SORT_WORK_GROUP_SIZE 256
+#endif
+#ifndef BARNESHUT_GROUP_SIZE
+#define BARNESHUT_GROUP_SIZE 64
+#endif
+#ifndef DIRECT_SUM_TILE_SIZE
+#define DIRECT_SUM_TILE_SIZE 256
+#endif
+// 1 = monopoles, 2 = monopoles and quadrupoles
+#ifndef FMM_ORDER
+#define FMM_ORDER 2
+#endif
+// QUADRUPOLE_MOMENTS is defined on the command line to add the quadrupoles
+// of the nodes to the Barnes-Hut forces. The FMM needs them from order 2.
+#if defined(QUADRUPOLE_MOMENTS) || FMM_ORDER >= 2
+#define NODE_QUADRUPOLES
+#endif
+#ifndef FMM_LIST_SIZE
+#define FMM_LIST_SIZE 512
+#endif
+// Longest path from the root to a node the FMM can handle.
+#define FMM_MAX_DEPTH 32
+
+// 21 bits per axis, so a key fits into 63 bits of an ulong.
+#define MORTON_BITS_PER_AXIS 21
+#define RADIX_SORT_BITS 4
+#define RADIX_SORT_BUCKETS (1 << RADIX_SORT_BITS)
+// Every visited node pushes at most 8 children, one of which is popped next.
+#define MORTON_BUILD_STACK_SIZE (8 * MORTON_BITS_PER_AXIS)
+
+
+//          ╭─────────────────────────────────────────────────────────╮
+//          │                        Multipoles                        │
+//          ╰─────────────────────────────────────────────────────────╯
+
+// Traceless quadrupoles are stored as xx, yy, zz, xy, xz, yz in s0 ... s5.
+float8 QuadrupoleOfPoint(const float3 d, const float mass) {
+  const float d2 = dot(d, d);
+  return mass * (float8)(3.0f * d.x * d.x - d2, 3.0f * d.y * d.y - d2,
+                         3.0f * d.z * d.z - d2, 3.0f * d.x * d.y,
+                         3.0f * d.x * d.z, 3.0f * d.y * d.z, 0, 0);
+}
 
+float3 QuadrupoleTimes(const float8 q, const float3 v) {
+  return (float3)(q.s0 * v.x + q.s3 * v.y + q.s4 * v.z,
+                  q.s3 * v.x + q.s1 * v.y + q.s5 * v.z,
+                  q.s4 * v.x + q.s5 * v.y + q.s2 * v.z);
+}
+
+// Acceleration from the quadrupole of a node, on top of its monopole.
+// delta points from the particle to the center of mass, r2 is its softened
+// squared length.
+float3 QuadrupoleAcceleration(const float8 q, const float3 delta,
+                              const float r2, const float G) {
+  const float inv_r = rsqrt(r2);
+  const float inv_r5 = inv_r * inv_r * inv_r / r2;
+  const float3 q_delta = QuadrupoleTimes(q, delta);
+  return G * (-q_delta * inv_r5 +
+              2.5f * dot(delta, q_delta) * delta * inv_r5 / r2);
+}
 
 __kernel void BarnesHut(__global const float4* particles_pos,
                         __global ParticleData* particles_data,
                         __global const Node* nodes, const int particle_count,
                         const float distanceThreshold, const float eps,
-                        const float G, const int items_per_work_group) {
+                        const float G, const int items_per_work_group,
+                        __global const float8* node_quadrupole) {
   const int global_id = get_global_id(0);
 
   const int start = global_id * items_per_work_group;
@@ -61,7 +147,8 @@ __kernel void BarnesHut(__global const float4* particles_pos,
     stack[stackSize++] = 0;
 
     while (stackSize > 0) {
-      const __global Node* node = &nodes[stack[--stackSize]];
+      const int node_index = stack[--stackSize];
+      const __global Node* node = &nodes[node_index];
 
       if (node->center_of_mass.w < 0.01f) continue;
 
@@ -83,89 +170,460 @@ __kernel void BarnesHut(__global const float4* particles_pos,
                           (double)distance_squared);
         float3 add = delta * F / sqrt(distance_squared);
         force += add;
+#ifdef QUADRUPOLE_MOMENTS
+        if (node->isLeaf == isLeaf_PARENT) {
+          force += particle_pos.w *
+                   QuadrupoleAcceleration(node_quadrupole[node_index], delta,
+                                          distance_squared, G);
+        }
+#endif
       } else 
       if (node->isLeaf == isLeaf_PARENT) {
         for (int j = 0; j < 8; ++j) {
-          stack[stackSize++] = node->children[j];
+          stack[stackSize++] = node->first_child + j;
         }
       }
     }
       particle_data->force = force;
   }
 }
-/*
-__kernel void BarnesHut(__global const float4* particles_pos,
-                        __global ParticleData* particles_data,
-                        __global const Node* nodes, const int particle_count,
+
+// Same as BarnesHut, but reads the compact node layout written by
+// CalculateCenterOfMass instead of the whole Node.
+// Force on one particle from the compact layout, shared by BarnesHutCompact
+// and BarnesHutActive.
+float3 CompactTreeForce(const float4 particle_pos,
+                        __global const float4* node_com,
+                        __global const NodeInfo* node_info,
                         const float distanceThreshold, const float eps,
-                        const float G, const int items_per_work_group) {
-  const int global_id = get_group_id(0);
-  const int local_id = get_local_id(0);
-  const int local_size = get_local_size(0);
-  const int depth = (sizeof(int)*8-clz(local_size))/3;
-  __local float3 force[512];
+                        const float G,
+                        __global const float8* node_quadrupole) {
+  int stack[BARNESHUT_STACK_SIZE];
+  int stackSize = 0;
+  float3 force = (float3)(0, 0, 0);
+
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0) {
+    const int node = stack[--stackSize];
+    const float4 center_of_mass = node_com[node];
+
+    if (center_of_mass.w < 0.01f) continue;
+
+    const float3 delta = (center_of_mass.xyz - particle_pos.xyz);
+    const float distance_squared =
+        delta.x * delta.x + delta.y * delta.y + delta.z * delta.z + eps * eps;
+
+    const NodeInfo info = node_info[node];
+    const float d_squared = info.size * info.size / distance_squared;
+
+    if (info.first_child < 0 ||
+        d_squared < distanceThreshold * distanceThreshold) {
+      float F = (float)(((double)G * (double)particle_pos.w *
+                         (double)center_of_mass.w) /
+                        (double)distance_squared);
+      force += delta * F / sqrt(distance_squared);
+#ifdef QUADRUPOLE_MOMENTS
+      if (info.first_child >= 0) {
+        force += particle_pos.w *
+                 QuadrupoleAcceleration(node_quadrupole[node], delta,
+                                        distance_squared, G);
+      }
+#endif
+    } else {
+      for (int j = 0; j < 8; ++j) {
+        stack[stackSize++] = info.first_child + j;
+      }
+    }
+  }
+  return force;
+}
+
+__kernel void BarnesHutCompact(__global const float4* particles_pos,
+                               __global ParticleData* particles_data,
+                               __global const float4* node_com,
+                               __global const NodeInfo* node_info,
+                               const int particle_count,
+                               const float distanceThreshold, const float eps,
+                               const float G, const int items_per_work_group,
+                               __global const float8* node_quadrupole) {
+  const int global_id = get_global_id(0);
 
   const int start = global_id * items_per_work_group;
 
   const int end = min(start + items_per_work_group, particle_count);
-  int stack[1024];
-  int stackSize = 0;
-  int val = 0;
-  int tmp = local_id;
-  for (int i = 0; i < depth; i++) {
-    val = nodes[val].children[tmp & 7];
-    tmp = tmp >> 3;
-  }
   for (int id = start; id < end; id++) {
-    float4 particle_pos = particles_pos[id];
-    __global ParticleData* particle_data = &particles_data[id];
-    force[local_id] = (float3)(0, 0, 0);
+    particles_data[id].force =
+        CompactTreeForce(particles_pos[id], node_com, node_info,
+                         distanceThreshold, eps, G, node_quadrupole);
+  }
+}
+// BarnesHutCompact over the particles in the active list only, see
+// CompactActive.
+__kernel void BarnesHutActive(__global const float4* particles_pos,
+                              __global ParticleData* particles_data,
+                              __global const float4* node_com,
+                              __global const NodeInfo* node_info,
+                              __global const int* active,
+                              __global const int* active_count,
+                              const float distanceThreshold, const float eps,
+                              const float G, const int items_per_work_group,
+                              __global const float8* node_quadrupole) {
+  const int global_id = get_global_id(0);
 
-    stack[stackSize++] = val;
+  const int start = global_id * items_per_work_group;
 
-    while (stackSize > 0) {
-      const __global Node* node = &nodes[stack[--stackSize]];
+  const int end = min(start + items_per_work_group, *active_count);
+  for (int i = start; i < end; i++) {
+    const int id = active[i];
+    particles_data[id].force =
+        CompactTreeForce(particles_pos[id], node_com, node_info,
+                         distanceThreshold, eps, G, node_quadrupole);
+  }
+}
+// BarnesHutCompact without a stack. Opening a node moves to its first child,
+// accepting it (or skipping an empty one) follows the next index written by
+// ThreadOctree.
+__kernel void BarnesHutStackless(__global const float4* particles_pos,
+                                 __global ParticleData* particles_data,
+                                 __global const float4* node_com,
+                                 __global const NodeInfo* node_info,
+                                 __global const int* node_next,
+                                 const int particle_count,
+                                 const float distanceThreshold, const float eps,
+                                 const float G,
+                                 const int items_per_work_group,
+                                 __global const float8* node_quadrupole) {
+  const int global_id = get_global_id(0);
 
-      if (node->center_of_mass.w < 0.01f) continue;
+  const int start = global_id * items_per_work_group;
 
-      const float3 delta = (node->center_of_mass.xyz - particle_pos.xyz);
+  const int end = min(start + items_per_work_group, particle_count);
+  for (int id = start; id < end; id++) {
+    const float4 particle_pos = particles_pos[id];
+    float3 force = (float3)(0, 0, 0);
+
+    int node = 0;
+    while (node >= 0) {
+      const float4 center_of_mass = node_com[node];
+
+      if (center_of_mass.w < 0.01f) {
+        node = node_next[node];
+        continue;
+      }
+
+      const float3 delta = (center_of_mass.xyz - particle_pos.xyz);
       const float distance_squared =
           delta.x * delta.x + delta.y * delta.y + delta.z * delta.z + eps * eps;
 
-      float biggestcomp = max(max(node->region_size.x, node->region_size.y),
-                              node->region_size.z);
-      float d_squared = biggestcomp * biggestcomp * 4.f / distance_squared;
+      const NodeInfo info = node_info[node];
+      const float d_squared = info.size * info.size / distance_squared;
 
-      if (node->isLeaf == isLeaf_LEAF ||
+      if (info.first_child < 0 ||
           d_squared < distanceThreshold * distanceThreshold) {
         float F = (float)(((double)G * (double)particle_pos.w *
-                           (double)node->center_of_mass.w) /
+                           (double)center_of_mass.w) /
                           (double)distance_squared);
-        float3 add = delta * F / sqrt(distance_squared);
-        force[local_id] += add;
-      } else if (node->isLeaf == isLeaf_PARENT) {
-        for (int j = 0; j < 8; ++j) {
-          stack[stackSize++] = node->children[j];
+        force += delta * F / sqrt(distance_squared);
+#ifdef QUADRUPOLE_MOMENTS
+        if (info.first_child >= 0) {
+          force += particle_pos.w *
+                   QuadrupoleAcceleration(node_quadrupole[node], delta,
+                                          distance_squared, G);
         }
+#endif
+        node = node_next[node];
+      } else {
+        node = info.first_child;
       }
     }
+    particles_data[id].force = force;
+  }
+}
+// The work group walks the tree together, one particle per work item. The
+// particles are sorted spatially, so the members mostly need the same nodes.
+// Nodes are taken from a shared stack in batches of 8 and staged in local
+// memory once for the whole group. A node is opened if any member needs it
+// opened, in which case every member uses its children instead.
+// A batch pops up to 8 nodes and pushes up to 64 children, so the shared
+// stack grows by up to 56 entries per level the group descends. Opening a
+// complete tree with parents on d levels needs 56 * (d - 1) + 8 entries, the
+// host sizes BARNESHUT_GROUP_STACK_SIZE for parents down to max_depth.
+// Children that do not fit are dropped and overflow is set, the host reports
+// it.
+__kernel __attribute__((reqd_work_group_size(BARNESHUT_GROUP_SIZE, 1, 1))) void
+BarnesHutGroup(__global const float4* particles_pos,
+               __global ParticleData* particles_data,
+               __global const float4* node_com,
+               __global const NodeInfo* node_info, const int particle_count,
+               const float distanceThreshold, const float eps, const float G,
+               __global uint* interactions,
+               __global const float8* node_quadrupole,
+               __global int* overflow) {
+  const int global_id = get_global_id(0);
+  const int local_id = get_local_id(0);
+  const bool active = global_id < particle_count;
+
+  __local int stack[BARNESHUT_GROUP_STACK_SIZE];
+  __local int stackSize;
+  __local float4 batch_com[8];
+  __local NodeInfo batch_info[8];
+  __local int batch_open[8];
+#ifdef QUADRUPOLE_MOMENTS
+  __local float8 batch_quadrupole[8];
+#endif
+  __local uint group_interactions;
+
+  const float4 particle_pos =
+      active ? particles_pos[global_id] : (float4)(0, 0, 0, 0);
+  float3 force = (float3)(0, 0, 0);
+  uint own_interactions = 0;
+
+  if (local_id == 0) {
+    stack[0] = 0;
+    stackSize = 1;
+    group_interactions = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  while (true) {
+    const int batch_size = min(stackSize, 8);
+    if (batch_size == 0) break;
+
+    if (local_id < batch_size) {
+      const int node = stack[stackSize - 1 - local_id];
+      batch_com[local_id] = node_com[node];
+      batch_info[local_id] = node_info[node];
+      batch_open[local_id] = 0;
+#ifdef QUADRUPOLE_MOMENTS
+      batch_quadrupole[local_id] = node_quadrupole[node];
+#endif
+    }
     barrier(CLK_LOCAL_MEM_FENCE);
     if (local_id == 0) {
-      float3 force_sum = (float3)(0, 0, 0);
-      for (int i = 0; i < local_size; i++) {
-        force_sum += force[i];
+      stackSize -= batch_size;
+    }
+
+    // Vote
+    for (int b = 0; b < batch_size && active; b++) {
+      const float4 center_of_mass = batch_com[b];
+      if (center_of_mass.w < 0.01f || batch_info[b].first_child < 0) continue;
+      const float3 delta = (center_of_mass.xyz - particle_pos.xyz);
+      const float distance_squared =
+          delta.x * delta.x + delta.y * delta.y + delta.z * delta.z + eps * eps;
+      const float d_squared =
+          batch_info[b].size * batch_info[b].size / distance_squared;
+      if (d_squared >= distanceThreshold * distanceThreshold) {
+        batch_open[b] = 1;
       }
-      particle_data->force = force_sum;
     }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int b = 0; b < batch_size && active; b++) {
+      const float4 center_of_mass = batch_com[b];
+      if (center_of_mass.w < 0.01f || batch_open[b]) continue;
+      const float3 delta = (center_of_mass.xyz - particle_pos.xyz);
+      const float distance_squared =
+          delta.x * delta.x + delta.y * delta.y + delta.z * delta.z + eps * eps;
+      float F = (float)(((double)G * (double)particle_pos.w *
+                         (double)center_of_mass.w) /
+                        (double)distance_squared);
+      force += delta * F / sqrt(distance_squared);
+#ifdef QUADRUPOLE_MOMENTS
+      if (batch_info[b].first_child >= 0) {
+        force += particle_pos.w *
+                 QuadrupoleAcceleration(batch_quadrupole[b], delta,
+                                        distance_squared, G);
+      }
+#endif
+      own_interactions++;
+    }
+
+    if (local_id == 0) {
+      for (int b = 0; b < batch_size; b++) {
+        if (!batch_open[b]) continue;
+        if (stackSize + 8 > BARNESHUT_GROUP_STACK_SIZE) {
+          *overflow = 1;
+          continue;
+        }
+        for (int j = 0; j < 8; ++j) {
+          stack[stackSize++] = batch_info[b].first_child + j;
+        }
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (active) {
+    particles_data[global_id].force = force;
+  }
+
+  atomic_add(&group_interactions, own_interactions);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (local_id == 0) {
+    // interactions[1] holds the carry of interactions[0]
+    const uint prev = atomic_add(&interactions[0], group_interactions);
+    if (prev + group_interactions < prev) {
+      atomic_inc(&interactions[1]);
+    }
+  }
+}
+
+// Exact all-pairs force, one particle per work item. The work group loads the
+// positions in tiles of DIRECT_SUM_TILE_SIZE into local memory, so each
+// position is read from global memory once per work group instead of once per
+// work item. The padding of the last tile has zero mass.
+__kernel __attribute__((reqd_work_group_size(DIRECT_SUM_TILE_SIZE, 1, 1))) void
+DirectSum(__global const float4* particles_pos,
+          __global ParticleData* particles_data, const int particle_count,
+          const float eps, const float G) {
+  const int global_id = get_global_id(0);
+  const int local_id = get_local_id(0);
+  const bool active = global_id < particle_count;
+
+  __local float4 tile[DIRECT_SUM_TILE_SIZE];
+
+  const float4 particle_pos =
+      active ? particles_pos[global_id] : (float4)(0, 0, 0, 0);
+  // Sum of m_j * delta / r^3, scaled by G * m_i at the end.
+  float3 acc = (float3)(0, 0, 0);
+
+  for (int tile_start = 0; tile_start < particle_count;
+       tile_start += DIRECT_SUM_TILE_SIZE) {
+    const int j = tile_start + local_id;
+    tile[local_id] =
+        j < particle_count ? particles_pos[j] : (float4)(0, 0, 0, 0);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int k = 0; k < DIRECT_SUM_TILE_SIZE; k++) {
+      const float4 other = tile[k];
+      // The particle itself has delta = 0, so it adds nothing.
+      const float3 delta = other.xyz - particle_pos.xyz;
+      const float distance_squared =
+          delta.x * delta.x + delta.y * delta.y + delta.z * delta.z + eps * eps;
+      const float inv_distance = rsqrt(distance_squared);
+      acc += delta * (other.w * inv_distance * inv_distance * inv_distance);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (active) {
+    particles_data[global_id].force =
+        acc * (float)((double)G * (double)particle_pos.w);
+  }
+}
+
+// Kinetic energy, potential energy and momentum of every work group, reduced
+// on the host. The potential is summed over all pairs like DirectSum, so this
+// is O(N^2). The velocities still miss the closing half kick of the leapfrog
+// integrators, velocity_dt adds it back. Requires a power of two tile size.
+__kernel __attribute__((reqd_work_group_size(DIRECT_SUM_TILE_SIZE, 1, 1))) void
+EnergyDiagnostic(__global const float4* particles_pos,
+                 __global const ParticleData* particles_data,
+                 const int particle_count, const float eps, const float G,
+                 const float velocity_dt, __global float8* partial_sums) {
+  const int global_id = get_global_id(0);
+  const int local_id = get_local_id(0);
+  const bool active = global_id < particle_count;
+
+  __local float4 tile[DIRECT_SUM_TILE_SIZE];
+  __local float8 sums[DIRECT_SUM_TILE_SIZE];
+
+  const float4 particle_pos =
+      active ? particles_pos[global_id] : (float4)(0, 0, 0, 0);
+  float potential = 0;
+
+  for (int tile_start = 0; tile_start < particle_count;
+       tile_start += DIRECT_SUM_TILE_SIZE) {
+    const int j = tile_start + local_id;
+    tile[local_id] =
+        j < particle_count ? particles_pos[j] : (float4)(0, 0, 0, 0);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int k = 0; k < DIRECT_SUM_TILE_SIZE; k++) {
+      if (tile_start + k == global_id) continue;
+      const float4 other = tile[k];
+      const float3 delta = other.xyz - particle_pos.xyz;
+      const float distance_squared =
+          delta.x * delta.x + delta.y * delta.y + delta.z * delta.z + eps * eps;
+      potential -= other.w * rsqrt(distance_squared);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  float8 own = (float8)(0);
+  if (active) {
+    const ParticleData data = particles_data[global_id];
+    const float3 velocity =
+        data.velocity + data.force * velocity_dt / particle_pos.w;
+    const float3 momentum = velocity * particle_pos.w;
+    // (kinetic, potential, momentum.xyz), every pair is counted twice
+    own.s0 = 0.5f * dot(momentum, velocity);
+    own.s1 = 0.5f * (float)((double)G * (double)particle_pos.w * potential);
+    own.s234 = momentum;
+  }
+  sums[local_id] = own;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (int offset = DIRECT_SUM_TILE_SIZE / 2; offset > 0; offset >>= 1) {
+    if (local_id < offset) {
+      sums[local_id] += sums[local_id + offset];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (local_id == 0) {
+    partial_sums[get_group_id(0)] = sums[0];
   }
 }
-*/
 
+// The positions handed to the renderer, in their original order. Either a
+// float4 or, with HALF_PRECISION_EXPORT, 4 halves per particle.
+#ifdef HALF_PRECISION_EXPORT
+typedef half RenderPosition;
+#else
+typedef float4 RenderPosition;
+#endif
+
+void WriteRenderPosition(__global RenderPosition* render_positions,
+                         const int index, const float4 position) {
+#ifdef HALF_PRECISION_EXPORT
+  vstore_half4(position, index, render_positions);
+#else
+  render_positions[index] = position;
+#endif
+}
+
+// Kick the velocity with the current force, then drift the position with the
+// new velocity. Semi-implicit Euler kicks and drifts by dt, the leapfrog
+// integrators merge the closing half kick of the previous step with the
+// opening half kick of this one, see NBody::Calculate. The kick and the drift
+// of every update of a Calculate call are uploaded together, step picks the
+// one of this update. The last update (render_step) also writes the render
+// copy, so the positions are not read a second time just for the renderer.
+// Nothing moves once a force evaluation ran out of nodes or overflowed a
+// list, the forces are wrong then. aborted keeps the rest of the steps of the
+// Calculate from moving as well, the host refuses the whole batch.
 __kernel void AddForces(__global float4* particles_pos,
                         __global ParticleData* particles_data,
                         const int data_size, const int items_per_work_item,
-                        const float dt) {
+                        __global const float2* step_times, const int step,
+                        __global const int* particle_order,
+                        __global RenderPosition* render_positions,
+                        const int render_step, __global const int* itr,
+                        const int allocatedNodes,
+                        __global const int* overflow,
+                        __global int* aborted) {
   int global_id = get_global_id(0);
+  if (*aborted) return;
+  if (*itr > allocatedNodes || *overflow) {
+    // Every work item sees the same counters, so all of them stop here.
+    if (global_id == 0) *aborted = 1;
+    return;
+  }
+  const float kick_dt = step_times[step].x;
+  const float drift_dt = step_times[step].y;
+  const bool render = step == render_step;
 
   int start = global_id * items_per_work_item;
   int end = min(start + items_per_work_item, data_size);
@@ -174,11 +632,83 @@ __kernel void AddForces(__global float4* particles_pos,
     __global float4* particle = &particles_pos[id];
     __global ParticleData* particle_data = &particles_data[id];
 
-    particle_data->velocity += particle_data->force * dt / particle->w;
-    *particle += (float4)(particle_data->velocity * dt, 0);
+    particle_data->velocity += particle_data->force * kick_dt / particle->w;
+    const float4 position =
+        *particle + (float4)(particle_data->velocity * drift_dt, 0);
+    *particle = position;
+    if (render) {
+      WriteRenderPosition(render_positions, particle_order[id], position);
+    }
+  }
+}
+
+// Block timesteps. Every particle moves with big_dt / 2^rung, where the rung
+// is the smallest one with dt <= accuracy * sqrt(eps / |a|). The rungs are
+// indexed by the original particle index, so the Morton reordering does not
+// have to move them.
+
+// Assigns the rungs at the start of a block step and applies the opening half
+// kick, together with extra_kick_dt left over from the leapfrog integrator.
+__kernel void AssignRungs(__global const float4* particles_pos,
+                          __global ParticleData* particles_data,
+                          __global const int* particle_order,
+                          __global int* rungs, const int particle_count,
+                          const float big_dt, const float accuracy,
+                          const float eps, const int max_rung,
+                          const float extra_kick_dt,
+                          __global int* deepest_rung) {
+  const int global_id = get_global_id(0);
+  if (global_id >= particle_count) return;
+
+  const float mass = particles_pos[global_id].w;
+  const float3 acc = particles_data[global_id].force / mass;
+  const float a = length(acc);
+  int rung = 0;
+  if (a > 0) {
+    const float dt = accuracy * sqrt(eps / a);
+    rung = clamp((int)ceil(log2(big_dt / dt)), 0, max_rung);
+  }
+  rungs[particle_order[global_id]] = rung;
+  atomic_max(deepest_rung, rung);
+
+  particles_data[global_id].velocity +=
+      acc * (ldexp(big_dt, -rung) * 0.5f + extra_kick_dt);
+}
+
+// Collects the particles whose step ends now, those with rung >= min_rung.
+// The order of the list is not deterministic.
+__kernel void CompactActive(__global const int* particle_order,
+                            __global const int* rungs,
+                            const int particle_count, const int min_rung,
+                            __global int* active,
+                            __global int* active_count) {
+  const int global_id = get_global_id(0);
+  if (global_id >= particle_count) return;
+
+  if (rungs[particle_order[global_id]] >= min_rung) {
+    active[atomic_inc(active_count)] = global_id;
   }
 }
 
+// Closing half kick of the active particles, followed by the opening half
+// kick of their next step unless the block step is over.
+__kernel void KickActive(__global const float4* particles_pos,
+                         __global ParticleData* particles_data,
+                         __global const int* particle_order,
+                         __global const int* rungs,
+                         __global const int* active,
+                         __global const int* active_count, const float big_dt,
+                         const int closing_only) {
+  const int global_id = get_global_id(0);
+  if (global_id >= *active_count) return;
+
+  const int id = active[global_id];
+  const float dt = ldexp(big_dt, -rungs[particle_order[id]]);
+  particles_data[id].velocity += particles_data[id].force *
+                                 (closing_only ? dt * 0.5f : dt) /
+                                 particles_pos[id].w;
+}
+
 __kernel void BoundingBoxStage1(__global const float4* particles,
                                 __global float3* min_values,
                                 __global float3* max_values,
@@ -288,83 +818,67 @@ bool isinside(float3 inclusivemin, float3 exclusivemax, float3 inp) {
          all(fmax(exclusivemax, inp) == exclusivemax);
 }
 
-// This only runs once
-__kernel void CreateOctree(__global Node* nodes, const int start_depth) {
-  // Initialize nodes
-  size_t itr = 1;
-  size_t start_ind = 0;
-  size_t end_ind = 1;
-
-  // start_depth - 1, we will do the last block with Z indexing
-  for (size_t i = 0; i < start_depth - 1; i++) {
-    for (size_t j = start_ind; j < end_ind; j++) {
-      __global Node* current = &nodes[j];
-      for (int k = 0; k < 8; k++) {
-        current->children[k] = itr;
-        itr++;
-      }
-      current->isLeaf = isLeaf_PARENT;
-    }
-    start_ind = end_ind;
-    end_ind = itr;
-  }
-
-  // Last
-  size_t stride = 1 << start_depth;
-  size_t id = 0;
-  size_t stridei = 1;
-  size_t stridej = stride;
-  size_t stridek = stride * stride;
-
-  for (size_t j = start_ind; j < end_ind; j++) {
-    __global Node* current = &nodes[j];
-    for (int k = 0; k < 8; k++) {
-      int3 add = getIJK(id, start_depth);
-      size_t index = add.x * stridei + add.y * stridej + add.z * stridek;
-      current->children[k] = end_ind + index;
-      id++;
-    }
-    current->isLeaf = isLeaf_EMPTY;
-  }
-}
-
 size_t add8powers(const size_t exp) {
   size_t res = 0;
   for (size_t i = 0; i <= exp; i++) {
-    res += 1 << (3 * i);
+    res += (size_t)1 << (3 * i);
   }
   return res;
 }
 
+// Depth of a node in the static top of the tree.
+int staticNodeDepth(size_t index) {
+  int depth = 0;
+  size_t level_end = 1;
+  while (index >= level_end) {
+    depth++;
+    level_end += (size_t)1 << (3 * depth);
+  }
+  return depth;
+}
+
+// The levels above start_depth are a full octree stored breadth first, so the
+// children of node n are 8n + 1 ... 8n + 8. The offset of a node inside its
+// level is then its Z-order index, which getIJK decodes.
+// This only runs once, one work item per static node.
+__kernel void CreateOctree(__global Node* nodes, const int start_depth) {
+  const size_t global_id = get_global_id(0);
+  if (global_id >= add8powers(start_depth)) return;
+
+  __global Node* current = &nodes[global_id];
+  current->parent = global_id == 0 ? -1 : (global_id - 1) / 8;
+  if (global_id < add8powers(start_depth - 1)) {
+    current->first_child = 8 * global_id + 1;
+    current->isLeaf = isLeaf_PARENT;
+  } else {
+    current->isLeaf = isLeaf_EMPTY;
+  }
+}
+
+// One work item per static node.
 __kernel void InitOctree(__global Node* nodes, const int start_depth,
                          __global const float3* boundingbox_min,
                          __global const float3* boundingbox_max,
                          __global int* itr, const int allocatedNodes) {
-  float3 center_of_universe = (*boundingbox_max + *boundingbox_min) / 2.0f;
+  const size_t global_id = get_global_id(0);
+  const size_t static_nodes = add8powers(start_depth);
+  if (global_id >= static_nodes) return;
 
   const float eps = 0.001f;
-  // float3 full_min = *boundingbox_min - center_of_universe - eps;
-  // float3 full_max = *boundingbox_max - center_of_universe + eps;
-  // float3 size = full_max - full_min;
   float3 size = (*boundingbox_max) - (*boundingbox_min) + eps;
 
-  nodes[0].region_size = size * 0.5f;
-
-  *itr = add8powers(start_depth);
-  size_t c = add8powers(start_depth - 1);
-  for (size_t i = 0; i < c; ++i) {
-    for (int j = 0; j < 8; j++) {
-      nodes[nodes[i].children[j]].region_size = nodes[i].region_size * 0.5f;
-    }
-    nodes[i].isLeaf = isLeaf_PARENT;
-    nodes[i].center_of_mass = (float4)(0, 0, 0, 0);
+  if (global_id == 0) {
+    *itr = static_nodes;
   }
-  for (size_t i = c; i < *itr; ++i) {
-    nodes[i].isLeaf = isLeaf_EMPTY;
-    nodes[i].center_of_mass = (float4)(0, 0, 0, 0);
-  }
-}
 
+  __global Node* current = &nodes[global_id];
+  // The root is half of the box, every level halves it again.
+  current->region_size = size * pow(0.5f, staticNodeDepth(global_id) + 1);
+  current->isLeaf = global_id < add8powers(start_depth - 1) ? isLeaf_PARENT
+                                                            : isLeaf_EMPTY;
+  current->center_of_mass = (float4)(0, 0, 0, 0);
+  current->finished_children = 0;
+}
 
 // Kernel for initializing the octree
 __kernel void BuildOctree(__global const float4* particles_pos,
@@ -372,12 +886,11 @@ __kernel void BuildOctree(__global const float4* particles_pos,
                           __global const float3* boundingbox_min,
                           __global const float3* boundingbox_max,
                           const int particle_count, const int start_depth,
-                          __global int* itr,const int enter_depth, const int max_depth) {
+                          __global int* itr,const int enter_depth, const int max_depth,
+                          __global int* particle_leaf) {
 
   const int global_id = get_global_id(0);
 
-  size_t stride = 1 << start_depth;
-
   float3 center_of_universe = (*boundingbox_max + *boundingbox_min) / 2.0f;
   const float eps = 0.001f;
   float3 full_min = *boundingbox_min - center_of_universe - eps * 0.5f;
@@ -390,16 +903,12 @@ __kernel void BuildOctree(__global const float4* particles_pos,
   // This is where it truly begins
   __global Node* currentstarter = &nodes[start_ind + global_id];
 
-  // Since the space is split into 8^start_depth, we can extract the i, j, k
-  // coordinates as such:
-  size_t tmp = global_id;
-  const size_t i = tmp & (stride - 1);
-  tmp = tmp >> start_depth;
-
-  const size_t j = tmp & (stride - 1);
-  tmp = tmp >> start_depth;
-  const size_t k = tmp & (stride - 1);
-  tmp = tmp >> start_depth;
+  // The start_depth level is in Z-order, so the i, j, k coordinates of the
+  // cell are interleaved in its index.
+  const int3 ijk = getIJK(global_id, start_depth);
+  const size_t i = ijk.x;
+  const size_t j = ijk.y;
+  const size_t k = ijk.z;
   // We got its location in the world
 
   const float3 start_depth_center =
@@ -446,24 +955,23 @@ __kernel void BuildOctree(__global const float4* particles_pos,
 
         if (current->isLeaf == isLeaf_EMPTY) {
           int previtr = atomic_add(itr, 8);
+          current->first_child = previtr;
           for (int m = 0; m < 8; m++) {
-            current->children[m] = previtr + m;
             __global Node* n = &nodes[previtr + m];
             n->region_size = current->region_size / 2.0f;
             n->isLeaf = isLeaf_EMPTY;
             n->center_of_mass = (float4)(0, 0, 0, 0);
+            n->parent = current - nodes;
+            n->finished_children = 0;
           }
         }
         current->isLeaf = isLeaf_PARENT;
-        //  Adjust data for node
-        current->center_of_mass +=
-            (float4)(particle_pos.xyz * particle_pos.w, particle_pos.w);
 
         // Move onto next node
         current_block_size = current_block_size * 0.5f;
         current_block_center =
             current_block_center + current_block_size * octant;
-        current = &nodes[current->children[index]];
+        current = &nodes[current->first_child + index];
       }
       int depth = enter_depth;
       while (!done) {
@@ -485,6 +993,7 @@ __kernel void BuildOctree(__global const float4* particles_pos,
           } else {
             current->isLeaf = isLeaf_PARENT;
             // Its only that one particle, its center of mass is that particle
+            const int prev_particle = current->first_child;
             float3 prev_particle_pos =
                 current->center_of_mass.xyz;
             int prev_index =
@@ -493,39 +1002,400 @@ __kernel void BuildOctree(__global const float4* particles_pos,
                 (prev_particle_pos.z > current_block_center.z*current->center_of_mass.w ? 4 : 0);
 
           int previtr = atomic_add(itr, 8);
+          current->first_child = previtr;
           for (int m = 0; m < 8; m++) {
-            current->children[m] = previtr + m;
             __global Node* n = &nodes[previtr + m];
             n->region_size = current->region_size / 2.0f;
             n->isLeaf = isLeaf_EMPTY;
             n->center_of_mass = (float4)(0, 0, 0, 0);
+            n->parent = current - nodes;
+            n->finished_children = 0;
           }
 
             __global Node* new_node_for_prev =
-                &nodes[current->children[prev_index]];
+                &nodes[current->first_child + prev_index];
             new_node_for_prev->isLeaf = isLeaf_LEAF;
             new_node_for_prev->center_of_mass = current->center_of_mass;
+            new_node_for_prev->first_child = prev_particle;
+            particle_leaf[prev_particle] = new_node_for_prev - nodes;
           }
         } else if (current->isLeaf == isLeaf_EMPTY) {
           done = true;
 
           current->isLeaf = isLeaf_LEAF;
+          // A leaf has no children, it keeps its particle there instead so
+          // that it can be moved when the leaf is split.
+          current->first_child = stack[p3];
+        }
+        // Only the leaves hold mass here, the parents are summed up by
+        // CalculateCenterOfMass.
+        if (done) {
+          current->center_of_mass +=
+              (float4)(particle_pos.xyz * particle_pos.w, particle_pos.w);
+          particle_leaf[stack[p3]] = current - nodes;
         }
-        // If parent or anything else
-        //  Adjust data for node
-        current->center_of_mass +=
-            (float4)(particle_pos.xyz * particle_pos.w, particle_pos.w);
 
         // Move onto next node
         current_block_size = current_block_size * 0.5f;
         current_block_center =
             current_block_center + current_block_size * octant;
-        current = &nodes[current->children[index]];
+        current = &nodes[current->first_child + index];
       }
     }
   }
 }
 
+//          ╭─────────────────────────────────────────────────────────╮
+//          │                 Morton code octree build                 │
+//          ╰─────────────────────────────────────────────────────────╯
+
+// Spreads the lower 21 bits of a so that there are two zero bits between each.
+ulong SplitBy3(const uint a) {
+  ulong x = a & 0x1fffffUL;
+  x = (x | x << 32) & 0x1f00000000ffffUL;
+  x = (x | x << 16) & 0x1f0000ff0000ffUL;
+  x = (x | x << 8) & 0x100f00f00f00f00fUL;
+  x = (x | x << 4) & 0x10c30c30c30c30c3UL;
+  x = (x | x << 2) & 0x1249249249249249UL;
+  return x;
+}
+
+// Bit order matches the child index used by the octree: x + 2y + 4z.
+ulong MortonEncode(const uint3 cell) {
+  return SplitBy3(cell.x) | (SplitBy3(cell.y) << 1) | (SplitBy3(cell.z) << 2);
+}
+
+// First index in [begin, end) whose key is not less than value.
+int MortonLowerBound(__global const ulong* keys, int begin, int end,
+                     const ulong value) {
+  while (begin < end) {
+    const int mid = begin + (end - begin) / 2;
+    if (keys[mid] < value) {
+      begin = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  return begin;
+}
+
+// Must be called by every work-item of the group.
+void LocalInclusiveScan(__local int* data, const int local_id) {
+  for (int offset = 1; offset < RADIX_SORT_WORK_GROUP_SIZE; offset <<= 1) {
+    const int add = local_id >= offset ? data[local_id - offset] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    data[local_id] += add;
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+// A counter for each of the 16 radix digits, 16 bits each, digit d in bits
+// 16 * (d % 4) of component d / 4. Holds up to 65535 keys per digit, more
+// than a work group ever counts. 32 bytes of local memory per work item.
+typedef ulong4 DigitCounters;
+
+DigitCounters DigitCounter(const int digit) {
+  const ulong one = 1UL << (16 * (digit & 3));
+  const int lane = digit >> 2;
+  return (DigitCounters)(lane == 0 ? one : 0, lane == 1 ? one : 0,
+                         lane == 2 ? one : 0, lane == 3 ? one : 0);
+}
+
+int DigitCount(const DigitCounters counters, const int digit) {
+  const int lane = digit >> 2;
+  const ulong packed = lane == 0   ? counters.s0
+                       : lane == 1 ? counters.s1
+                       : lane == 2 ? counters.s2
+                                   : counters.s3;
+  return (int)((packed >> (16 * (digit & 3))) & 0xFFFF);
+}
+
+// LocalInclusiveScan of every digit counter at once.
+void LocalInclusiveScanDigits(__local DigitCounters* data, const int local_id) {
+  for (int offset = 1; offset < RADIX_SORT_WORK_GROUP_SIZE; offset <<= 1) {
+    const DigitCounters add =
+        local_id >= offset ? data[local_id - offset] : (DigitCounters)(0);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    data[local_id] += add;
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+__kernel void CalculateMortonCodes(__global const float4* particles_pos,
+                                   __global ulong* keys, __global int* indices,
+                                   __global const float3* boundingbox_min,
+                                   __global const float3* boundingbox_max,
+                                   const int particle_count) {
+  const int global_id = get_global_id(0);
+  if (global_id >= particle_count) return;
+
+  // Same box as InitOctree and BuildOctree.
+  const float eps = 0.001f;
+  const float3 origin = *boundingbox_min - eps * 0.5f;
+  const float3 size = (*boundingbox_max) - (*boundingbox_min) + eps;
+  const float cells = (float)(1 << MORTON_BITS_PER_AXIS);
+
+  const float3 scaled = (particles_pos[global_id].xyz - origin) / size * cells;
+  const uint3 cell = convert_uint3(clamp(scaled, 0.0f, cells - 1.0f));
+
+  keys[global_id] = MortonEncode(cell);
+  indices[global_id] = global_id;
+}
+
+// Each work group counts the digits of its contiguous chunk of keys.
+// The histogram is stored digit major so that a single exclusive scan over it
+// gives the output offset of every (digit, group) pair.
+__kernel void RadixSortHistogram(__global const ulong* keys,
+                                 __global int* histogram,
+                                 const int particle_count, const int shift) {
+  const int group_id = get_group_id(0);
+  const int local_id = get_local_id(0);
+  const int num_groups = get_num_groups(0);
+
+  __local int local_histogram[RADIX_SORT_BUCKETS];
+  if (local_id < RADIX_SORT_BUCKETS) local_histogram[local_id] = 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  const int items_per_group = (particle_count + num_groups - 1) / num_groups;
+  const int start = group_id * items_per_group;
+  const int end = min(start + items_per_group, particle_count);
+
+  for (int i = start + local_id; i < end; i += RADIX_SORT_WORK_GROUP_SIZE) {
+    atomic_inc(
+        &local_histogram[(keys[i] >> shift) & (RADIX_SORT_BUCKETS - 1)]);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (local_id < RADIX_SORT_BUCKETS) {
+    histogram[local_id * num_groups + group_id] = local_histogram[local_id];
+  }
+}
+
+// Exclusive scan of the histogram, launched as a single work group.
+__kernel void RadixSortScan(__global int* histogram, const int entries) {
+  const int local_id = get_local_id(0);
+
+  __local int partial[RADIX_SORT_WORK_GROUP_SIZE];
+
+  const int items_per_work_item =
+      (entries + RADIX_SORT_WORK_GROUP_SIZE - 1) / RADIX_SORT_WORK_GROUP_SIZE;
+  const int start = local_id * items_per_work_item;
+  const int end = min(start + items_per_work_item, entries);
+
+  int sum = 0;
+  for (int i = start; i < end; i++) {
+    sum += histogram[i];
+  }
+  partial[local_id] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  LocalInclusiveScan(partial, local_id);
+
+  int running = partial[local_id] - sum;
+  for (int i = start; i < end; i++) {
+    const int count = histogram[i];
+    histogram[i] = running;
+    running += count;
+  }
+}
+
+// Stable scatter: the chunk is walked in tiles of the work group size and the
+// rank of every key inside its digit is found with a single local scan, which
+// counts all the digits together in packed counters.
+__kernel void RadixSortScatter(__global const ulong* keys_in,
+                               __global const int* values_in,
+                               __global ulong* keys_out,
+                               __global int* values_out,
+                               __global const int* histogram,
+                               const int particle_count, const int shift) {
+  const int group_id = get_group_id(0);
+  const int local_id = get_local_id(0);
+  const int num_groups = get_num_groups(0);
+
+  __local int digit_offset[RADIX_SORT_BUCKETS];
+  __local DigitCounters counters[RADIX_SORT_WORK_GROUP_SIZE];
+
+  if (local_id < RADIX_SORT_BUCKETS) {
+    digit_offset[local_id] = histogram[local_id * num_groups + group_id];
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  const int items_per_group = (particle_count + num_groups - 1) / num_groups;
+  const int start = group_id * items_per_group;
+  const int end = min(start + items_per_group, particle_count);
+
+  for (int tile = start; tile < end; tile += RADIX_SORT_WORK_GROUP_SIZE) {
+    const int i = tile + local_id;
+    const bool valid = i < end;
+    const ulong key = valid ? keys_in[i] : 0;
+    const int digit = valid ? (int)((key >> shift) & (RADIX_SORT_BUCKETS - 1))
+                            : RADIX_SORT_BUCKETS;
+
+    counters[local_id] = valid ? DigitCounter(digit) : (DigitCounters)(0);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    LocalInclusiveScanDigits(counters, local_id);
+    const int destination =
+        valid ? digit_offset[digit] + DigitCount(counters[local_id], digit) - 1
+              : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (local_id < RADIX_SORT_BUCKETS) {
+      digit_offset[local_id] +=
+          DigitCount(counters[RADIX_SORT_WORK_GROUP_SIZE - 1], local_id);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (valid) {
+      keys_out[destination] = key;
+      values_out[destination] = values_in[i];
+    }
+  }
+}
+
+// One work item per start_depth cell, like BuildOctree. The particles of a
+// cell are a contiguous range of the sorted keys, so instead of scanning every
+// particle the cell binary searches its range and splits it by the next 3 bits
+// of the key on every level.
+__kernel void BuildOctreeMorton(__global const float4* particles_pos,
+                                __global const ulong* sorted_keys,
+                                __global const int* sorted_indices,
+                                __global Node* nodes, const int particle_count,
+                                const int start_depth, __global int* itr,
+                                const int max_depth,
+                                const int allocatedNodes,
+                                __global int* particle_leaf) {
+  const int global_id = get_global_id(0);
+
+  // The start_depth level is stored in Z-order, so the index of the cell is
+  // already the top of its particles' Morton keys.
+  const int cell_shift = 3 * (MORTON_BITS_PER_AXIS - start_depth);
+  const ulong cell_key = global_id;
+  const int cell_begin = MortonLowerBound(sorted_keys, 0, particle_count,
+                                          cell_key << cell_shift);
+  const int cell_end = MortonLowerBound(sorted_keys, cell_begin, particle_count,
+                                        (cell_key + 1) << cell_shift);
+
+  const int deepest = min(max_depth, MORTON_BITS_PER_AXIS);
+
+  int stack_node[MORTON_BUILD_STACK_SIZE];
+  int stack_begin[MORTON_BUILD_STACK_SIZE];
+  int stack_end[MORTON_BUILD_STACK_SIZE];
+  int stack_depth[MORTON_BUILD_STACK_SIZE];
+  int stackSize = 0;
+
+  if (cell_end > cell_begin) {
+    stack_node[stackSize] = add8powers(start_depth - 1) + global_id;
+    stack_begin[stackSize] = cell_begin;
+    stack_end[stackSize] = cell_end;
+    stack_depth[stackSize] = start_depth;
+    stackSize++;
+  }
+
+  while (stackSize > 0) {
+    stackSize--;
+    __global Node* current = &nodes[stack_node[stackSize]];
+    const int begin = stack_begin[stackSize];
+    const int end = stack_end[stackSize];
+    const int depth = stack_depth[stackSize];
+
+    int previtr = 0;
+    if (end - begin > 1 && depth < deepest) {
+      previtr = atomic_add(itr, 8);
+    }
+    // Also taken when we ran out of nodes, the host reports the overflow.
+    // Only the leaves hold mass here, the parents are summed up by
+    // CalculateCenterOfMass.
+    if (end - begin == 1 || depth >= deepest ||
+        previtr + 8 > allocatedNodes) {
+      float4 center_of_mass = (float4)(0, 0, 0, 0);
+      for (int p = begin; p < end; p++) {
+        const float4 particle_pos = particles_pos[sorted_indices[p]];
+        center_of_mass +=
+            (float4)(particle_pos.xyz * particle_pos.w, particle_pos.w);
+        particle_leaf[sorted_indices[p]] = stack_node[stackSize];
+      }
+      current->center_of_mass = center_of_mass;
+      current->isLeaf = isLeaf_LEAF;
+      continue;
+    }
+    current->isLeaf = isLeaf_PARENT;
+
+    const int child_shift = 3 * (MORTON_BITS_PER_AXIS - depth - 1);
+    const ulong prefix = sorted_keys[begin] >> (child_shift + 3);
+    int child_begin = begin;
+    current->first_child = previtr;
+    for (int m = 0; m < 8; m++) {
+      __global Node* n = &nodes[previtr + m];
+      n->region_size = current->region_size / 2.0f;
+      n->isLeaf = isLeaf_EMPTY;
+      n->center_of_mass = (float4)(0, 0, 0, 0);
+      n->parent = stack_node[stackSize];
+      n->finished_children = 0;
+
+      const int child_end =
+          m == 7 ? end
+                 : MortonLowerBound(sorted_keys, child_begin, end,
+                                    ((prefix << 3) | (m + 1)) << child_shift);
+      if (child_end > child_begin) {
+        stack_node[stackSize] = previtr + m;
+        stack_begin[stackSize] = child_begin;
+        stack_end[stackSize] = child_end;
+        stack_depth[stackSize] = depth + 1;
+        stackSize++;
+      }
+      child_begin = child_end;
+    }
+  }
+}
+
+//          ╭─────────────────────────────────────────────────────────╮
+//          │                   Particle reordering                   │
+//          ╰─────────────────────────────────────────────────────────╯
+
+// Gathers the particles into Morton order, so that neighbouring work items
+// of BarnesHut walk nearly the same path through the tree.
+// particle_order keeps the original index of every slot for the VBO copy.
+// After the gather the particles are sorted, so the indices are reset to the
+// identity and the keys stay valid for a Morton build in the same step.
+__kernel void ReorderParticles(__global const float4* particles_pos_in,
+                               __global const ParticleData* particles_data_in,
+                               __global const int* particle_order_in,
+                               __global int* sorted_indices,
+                               __global float4* particles_pos_out,
+                               __global ParticleData* particles_data_out,
+                               __global int* particle_order_out,
+                               const int particle_count) {
+  const int global_id = get_global_id(0);
+  if (global_id >= particle_count) return;
+
+  const int from = sorted_indices[global_id];
+  particles_pos_out[global_id] = particles_pos_in[from];
+  particles_data_out[global_id] = particles_data_in[from];
+  particle_order_out[global_id] = particle_order_in[from];
+  sorted_indices[global_id] = global_id;
+}
+
+// Scatters the positions back into their original order.
+__kernel void UnpermutePositions(__global const float4* particles_pos,
+                                 __global const int* particle_order,
+                                 __global float4* out, const int particle_count) {
+  const int global_id = get_global_id(0);
+  if (global_id >= particle_count) return;
+
+  out[particle_order[global_id]] = particles_pos[global_id];
+}
+
+// The render copy of AddForces, for the frames that do not end with one.
+__kernel void ExportPositions(__global const float4* particles_pos,
+                              __global const int* particle_order,
+                              __global RenderPosition* render_positions,
+                              const int particle_count) {
+  const int global_id = get_global_id(0);
+  if (global_id >= particle_count) return;
+
+  WriteRenderPosition(render_positions, particle_order[global_id],
+                      particles_pos[global_id]);
+}
+
 //__kernel void CalculateCenterOfMass(__global Node* nodes, const int
 // start_depth,
 //                                    __global int* itr) {
@@ -552,39 +1422,292 @@ __kernel void BuildOctree(__global const float4* particles_pos,
 //}
 //
 
-__kernel void CalculateCenterOfMass(__global Node* nodes, const int start_depth,
-                                    __global int* itr) {
-  size_t global_id = get_global_id(0);
+float cellSize(const float3 region_size) {
+  return 2.0f * max(max(region_size.x, region_size.y), region_size.z);
+}
+
+// Sums the masses from the leaves up, one work item per leaf. Every node that
+// finishes bumps the counter of its parent, and whoever finishes the 8th child
+// computes the parent and carries on upwards, so each parent is computed
+// exactly once and only after all of its children. Also divides every center
+// of mass by its mass and writes the compact traversal layout.
+// The leaves are treated as point masses, like BarnesHut does. node_radius is
+// the radius around the center of mass that holds every particle below the
+// node, only written with_radius. node_quadrupole is only calculated with
+// NODE_QUADRUPOLES and with_quadrupoles. Otherwise the buffers may hold a
+// single element.
+__kernel void CalculateCenterOfMass(__global Node* nodes, __global int* itr,
+                                    const int allocatedNodes,
+                                    __global float4* node_com,
+                                    __global NodeInfo* node_info,
+                                    __global float* node_radius,
+                                    __global float8* node_quadrupole,
+                                    const int with_radius,
+                                    const int with_quadrupoles) {
+  const int node_count = min(*itr, allocatedNodes);
+
+  for (int i = get_global_id(0); i < node_count; i += get_global_size(0)) {
+    __global Node* leaf = &nodes[i];
+    if (leaf->isLeaf == isLeaf_PARENT) continue;
+
+    const float4 leaf_sum = leaf->center_of_mass;
+    const float4 leaf_com =
+        leaf_sum.w > 0 ? (float4)(leaf_sum.xyz / leaf_sum.w, leaf_sum.w)
+                       : (float4)(0, 0, 0, 0);
+    leaf->center_of_mass = leaf_com;
+    node_com[i] = leaf_com;
+    node_info[i].size = cellSize(leaf->region_size);
+    node_info[i].first_child = -1;
+    if (with_radius) {
+      node_radius[i] = 0;
+    }
+#ifdef NODE_QUADRUPOLES
+    if (with_quadrupoles) {
+      node_quadrupole[i] = (float8)(0);
+    }
+#endif
 
-  int start_ind = add8powers(start_depth - 1);
-  for (size_t i = start_ind - 1; i != 0; --i) {
-    __global Node* n = &nodes[i];
-    for (size_t j = 0; j < 8; ++j) {
-      n->center_of_mass += nodes[n->children[j]].center_of_mass;
+    int parent = leaf->parent;
+    while (parent >= 0 && parent < node_count) {
+      // The children have to be written before the counter is seen.
+      mem_fence(CLK_GLOBAL_MEM_FENCE);
+      if (atomic_inc(&nodes[parent].finished_children) != 7) break;
+      mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+      // Written by other work items, so go around the cache.
+      volatile __global Node* current = &nodes[parent];
+      const int first_child = current->first_child;
+      float4 sum = (float4)(0, 0, 0, 0);
+      for (int j = 0; j < 8; j++) {
+        const float4 child =
+            ((volatile __global Node*)nodes)[first_child + j].center_of_mass;
+        sum += (float4)(child.xyz * child.w, child.w);
+      }
+      const float4 com =
+          sum.w > 0 ? (float4)(sum.xyz / sum.w, sum.w) : (float4)(0, 0, 0, 0);
+
+      float radius = 0;
+#ifdef NODE_QUADRUPOLES
+      float8 quadrupole = (float8)(0);
+#endif
+      for (int j = 0; j < 8; j++) {
+        const float4 child =
+            ((volatile __global Node*)nodes)[first_child + j].center_of_mass;
+        if (child.w <= 0) continue;
+        const float3 d = child.xyz - com.xyz;
+        if (with_radius) {
+          radius = max(radius, length(d) +
+                                   ((volatile __global float*)
+                                        node_radius)[first_child + j]);
+        }
+#ifdef NODE_QUADRUPOLES
+        if (with_quadrupoles) {
+          quadrupole += ((volatile __global float8*)
+                             node_quadrupole)[first_child + j] +
+                        QuadrupoleOfPoint(d, child.w);
+        }
+#endif
+      }
+
+      current->center_of_mass = com;
+      node_com[parent] = com;
+      node_info[parent].size = cellSize(current->region_size);
+      node_info[parent].first_child = first_child;
+      if (with_radius) {
+        node_radius[parent] = radius;
+      }
+#ifdef NODE_QUADRUPOLES
+      if (with_quadrupoles) {
+        node_quadrupole[parent] = quadrupole;
+      }
+#endif
+      parent = current->parent;
     }
   }
+}
 
-  __global Node* n = &nodes[0];
-  for (size_t j = 0; j < 8; ++j) {
-    n->center_of_mass += nodes[n->children[j]].center_of_mass;
+// Threads the tree: next is the node the traversal continues with once a node
+// and everything below it is done, the next sibling or the next of the parent.
+// -1 after the last node. One work item per node.
+__kernel void ThreadOctree(__global const Node* nodes, __global const int* itr,
+                           const int allocatedNodes, __global int* next) {
+  const int node_count = min(*itr, allocatedNodes);
+
+  for (int i = get_global_id(0); i < node_count; i += get_global_size(0)) {
+    int node = i;
+    int result = -1;
+    while (node != 0) {
+      const int parent = nodes[node].parent;
+      if (node - nodes[parent].first_child < 7) {
+        result = node + 1;
+        break;
+      }
+      node = parent;
+    }
+    next[i] = result;
   }
+}
 
-  // for (size_t i = 0; i < *itr; ++i) {
-  //   nodes[i].center_of_mass =
-  //       (float4)(nodes[i].center_of_mass.xyz / nodes[i].center_of_mass.w,
-  //                nodes[i].center_of_mass.w);
-  // }
+//          ╭─────────────────────────────────────────────────────────╮
+//          │                  Fast multipole method                  │
+//          ╰─────────────────────────────────────────────────────────╯
+
+// Adds the field of a source node to a local expansion around x (M2L). Also
+// used for the leaf to leaf interactions, a leaf is a point mass.
+void AddMultipoleToLocal(const float4 com, const float8 quadrupole,
+                         const float3 x, const float eps, const float G,
+                         float3* acc, float3* jacobian_diagonal,
+                         float3* jacobian_off_diagonal) {
+  const float3 delta = com.xyz - x;
+  const float r2 = dot(delta, delta) + eps * eps;
+  const float inv_r = rsqrt(r2);
+  const float inv_r3 = inv_r * inv_r * inv_r;
+  const float inv_r5 = inv_r3 / r2;
+  const float gm = G * com.w;
+
+  *acc += gm * delta * inv_r3;
+  *jacobian_diagonal += gm * (3.0f * delta * delta * inv_r5 - inv_r3);
+  *jacobian_off_diagonal += gm * 3.0f * inv_r5 *
+                            (float3)(delta.x * delta.y, delta.x * delta.z,
+                                     delta.y * delta.z);
+#if FMM_ORDER >= 2
+  // Only the field of the quadrupole, its gradient is left out.
+  *acc += QuadrupoleAcceleration(quadrupole, delta, r2, G);
+#endif
 }
-__kernel void DivideCentersByMass(__global Node* nodes, __global int* itr) {
-  const int global_id = get_global_id(0);
-  const int global_size = get_global_size(0);
-  const int item_per_thread = 1 + *itr / global_size;
-  const int start_ind = global_id * item_per_thread;
-  const int end_ind = min(start_ind + item_per_thread, *itr);
 
-  for (int i = start_ind; i < end_ind; i++) {
-    nodes[i].center_of_mass =
-        (float4)(nodes[i].center_of_mass.xyz / nodes[i].center_of_mass.w,
-                 nodes[i].center_of_mass.w);
+// Slots of the two lists FmmInteractions keeps in one array, one grows from
+// the front, the other from the back.
+#define FMM_SLOT(from_back, k) ((from_back) ? FMM_LIST_SIZE - 1 - (k) : (k))
+
+// Calculates the local expansion of every node, one work item per node.
+// Rather than passing the near lists down the tree, every node replays the
+// walk of its ancestors: on each level the sources that are well separated
+// from the ancestor are taken by it, the rest is refined and handed to the
+// next level. What is well separated from the node itself goes into its own
+// expansion. Leaves also take the remaining nearby leaves directly.
+// A particle then sums the expansions of every node above it (FmmEvaluate).
+// node_radius makes the separation test monotone for theta <= 1, so every
+// source is counted exactly once.
+__kernel void FmmInteractions(__global const Node* nodes,
+                              __global const float4* node_com,
+                              __global const NodeInfo* node_info,
+                              __global const float* node_radius,
+                              __global const float8* node_quadrupole,
+                              __global const int* itr,
+                              const int allocatedNodes,
+                              __global LocalExpansion* locals,
+                              const float theta, const float eps,
+                              const float G, __global int* overflow) {
+  const int node_count = min(*itr, allocatedNodes);
+  const float mac = min(theta, 1.0f);
+
+  int chain[FMM_MAX_DEPTH];
+  int list[FMM_LIST_SIZE];
+
+  for (int target = get_global_id(0); target < node_count;
+       target += get_global_size(0)) {
+    float3 acc = (float3)(0, 0, 0);
+    float3 jacobian_diagonal = (float3)(0, 0, 0);
+    float3 jacobian_off_diagonal = (float3)(0, 0, 0);
+
+    if (node_com[target].w > 0) {
+      // chain[0] is the target, chain[depth - 1] the root.
+      int depth = 0;
+      for (int n = target; n >= 0; n = nodes[n].parent) {
+        if (depth == FMM_MAX_DEPTH) {
+          *overflow = 1;
+          break;
+        }
+        chain[depth++] = n;
+      }
+
+      bool work_from_back = false;
+      int work_count = 1;
+      list[FMM_SLOT(work_from_back, 0)] = 0;
+
+      for (int level = depth - 1; level >= 0; level--) {
+        const int a = chain[level];
+        const bool is_target = level == 0;
+        const float4 a_com = node_com[a];
+        const float a_radius = node_radius[a];
+        const NodeInfo a_info = node_info[a];
+        int next_count = 0;
+
+        while (work_count > 0) {
+          const int source = list[FMM_SLOT(work_from_back, --work_count)];
+          const float4 s_com = node_com[source];
+          if (s_com.w < 0.01f) continue;
+          const NodeInfo s_info = node_info[source];
+
+          if (a_radius + node_radius[source] <
+              mac * distance(a_com.xyz, s_com.xyz)) {
+            if (is_target) {
+              AddMultipoleToLocal(s_com, node_quadrupole[source], a_com.xyz,
+                                  eps, G, &acc, &jacobian_diagonal,
+                                  &jacobian_off_diagonal);
+            }
+            continue;
+          }
+
+          // Not well separated, the children of the target deal with it.
+          if (is_target && a_info.first_child >= 0) continue;
+
+          const bool refine_source =
+              s_info.first_child >= 0 &&
+              (is_target || s_info.size > a_info.size);
+          if (!refine_source) {
+            if (!is_target) {
+              list[FMM_SLOT(!work_from_back, next_count++)] = source;
+            } else if (source != a) {
+              // Leaf to leaf
+              AddMultipoleToLocal(s_com, node_quadrupole[source], a_com.xyz,
+                                  eps, G, &acc, &jacobian_diagonal,
+                                  &jacobian_off_diagonal);
+            }
+          } else if (work_count + next_count + 8 > FMM_LIST_SIZE) {
+            *overflow = 1;
+          } else {
+            for (int j = 0; j < 8; j++) {
+              list[FMM_SLOT(work_from_back, work_count++)] =
+                  s_info.first_child + j;
+            }
+          }
+        }
+
+        work_from_back = !work_from_back;
+        work_count = next_count;
+      }
+    }
+
+    locals[target].acc = (float4)(acc, 0);
+    locals[target].jacobian_diagonal = (float4)(jacobian_diagonal, 0);
+    locals[target].jacobian_off_diagonal = (float4)(jacobian_off_diagonal, 0);
   }
-}
\ No newline at end of file
+}
+
+// Evaluates the local expansions of the leaf of every particle and all of its
+// ancestors at the particle (L2L and L2P in one).
+__kernel void FmmEvaluate(__global const float4* particles_pos,
+                          __global ParticleData* particles_data,
+                          __global const int* particle_leaf,
+                          __global const Node* nodes,
+                          __global const float4* node_com,
+                          __global const LocalExpansion* locals,
+                          const int particle_count) {
+  const int global_id = get_global_id(0);
+  if (global_id >= particle_count) return;
+
+  const float4 particle_pos = particles_pos[global_id];
+  float3 acc = (float3)(0, 0, 0);
+  for (int n = particle_leaf[global_id]; n >= 0; n = nodes[n].parent) {
+    const float3 d = particle_pos.xyz - node_com[n].xyz;
+    const float3 diagonal = locals[n].jacobian_diagonal.xyz;
+    const float3 off_diagonal = locals[n].jacobian_off_diagonal.xyz;
+    acc += locals[n].acc.xyz + diagonal * d +
+           (float3)(off_diagonal.x * d.y + off_diagonal.y * d.z,
+                    off_diagonal.x * d.x + off_diagonal.z * d.z,
+                    off_diagonal.y * d.x + off_diagonal.z * d.y);
+  }
+  particles_data[global_id].force = acc * particle_pos.w;
+}